@@ -7,17 +7,10 @@
 #include <sys/types.h>
 #include <sys/socket.h> //Libreria C per i socket.
 #include <arpa/inet.h>  
+#include <time.h>
+#include "Protocollo.h" //frame e strutture condivise da tutti i programmi
 
 #define MAX_SIZE 1024   //dimensione max del buf
-#define ID_SIZE 11         
-#define ACK_SIZE 61        
-#define ASL_ACK 39
-
-//Pacchetto dell'ASL contenente il numero di tessera sanitaria di un green pass ed il suo referto di validità
-typedef struct  {
-    char ID[ID_SIZE];
-    char report;
-} REPORT;
 
 //Legge esattamente count byte s iterando opportunamente le letture. Legge anche se viene interrotta da una System Call.
 ssize_t full_read(int fd, void *buf, size_t count) {
@@ -55,13 +48,108 @@ ssize_t full_write(int fd, const void *buf, size_t count) {
 }
 
 
+/* Modalità batch: legge da in una riga "tessera report" per ogni GP da sospendere (0) o ripristinare (1) e invia i report sulla stessa
+   connessione senza attendere le risposte, al più window report in attesa di esito. Il ServerVerifica risponde nell'ordine di invio,
+   per ogni report viene stampata una riga "tessera<TAB>report<TAB>esito<TAB>messaggio"; al termine viene stampato su stderr il riepilogo. */
+void batch_report(int socket_fd, FILE *in, int window) {
+    char line[MAX_SIZE], buf[MAX_SIZE], *ID, *report;
+    unsigned char frame[PROTO_HEADER_SIZE + MAX_SIZE];
+    unsigned long sent = 0, received = 0, invalid = 0, done = 0, missing = 0, failed = 0;
+    struct timespec start, end;
+    double elapsed;
+    int eof = 0, result;
+    REPORT *in_flight;
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    PROTO_READER r;
+
+    if ((in_flight = malloc(window * sizeof(REPORT))) == NULL) {
+        perror("malloc() error");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!eof || received < sent) {
+        //Invia nuovi report finché la finestra non è piena
+        while (!eof && sent - received < window) {
+            if (fgets(line, sizeof(line), in) == NULL) {
+                eof = 1;
+                break;
+            }
+            if ((ID = strtok(line, " \t\r\n,;")) == NULL) continue; //riga vuota
+            report = strtok(NULL, " \t\r\n,;");
+            if (strlen(ID) != ID_SIZE - 1 || id_key(ID) == 0 || report == NULL || strlen(report) != 1 || (report[0] != '0' && report[0] != '1')) {
+                printf("%s\t-\t-\tRiga non valida, attesi numero di tessera (10 lettere o cifre) e report (0 o 1)\n", ID);
+                invalid++;
+                continue;
+            }
+            strcpy(in_flight[sent % window].ID, ID);
+            in_flight[sent % window].report = report[0];
+            proto_begin(&w, frame, sizeof(frame), MSG_REPORT_UPDATE, sent);
+            proto_put_ID(&w, ID);
+            proto_put_u8(&w, report[0]);
+            if (proto_send(socket_fd, &w) < 0) {
+                perror("full_write() error");
+                exit(1);
+            }
+            sent++;
+        }
+        if (received == sent) continue;
+
+        //Riceve l'esito del report più vecchio: il primo byte è l'esito, il resto il messaggio da mostrare
+        if (proto_recv(socket_fd, &h, frame, sizeof(frame)) < 0 || h.type != MSG_RESULT || h.req_id != (unsigned int)received) {
+            perror("full_read() error");
+            exit(1);
+        }
+        proto_reader(&r, frame, h.length);
+        result = proto_get_u8(&r);
+        proto_get_text(&r, buf, sizeof(buf));
+        printf("%s\t%c\t%c\t%s\n", in_flight[received % window].ID, in_flight[received % window].report, result, buf);
+        if (result == '0') done++;
+        else if (result == '1') missing++;
+        else failed++;
+        received++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%lu report inviati in %.3f secondi (%.0f report/s): %lu avvenuti, %lu tessere inesistenti, "
+            "%lu servizio non disponibile, %lu righe non valide\n", received, elapsed, elapsed > 0 ? received / elapsed : 0,
+            done, missing, failed, invalid);
+    free(in_flight);
+}
+
 int main(int argc, char **argv) {
-    int socket_fd;
+    int socket_fd, opt, window = 64;
     struct sockaddr_in server_addr;
     REPORT package;
-    char start_bit, buf[MAX_SIZE];
-
-    start_bit = '1'; //Inizializziamo il bit a 1 da inviare al ServerVerifica
+    char buf[MAX_SIZE];
+    unsigned char frame[PROTO_HEADER_SIZE + MAX_SIZE];
+    const char *batch = NULL;
+    FILE *in = stdin;
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    PROTO_READER r;
+
+    //Senza opzioni l'ASL è interattiva, con -b legge tessere e report dal file indicato ("-" per lo standard input)
+    while ((opt = getopt(argc, argv, "b:w:")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch = optarg;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-b file di tessere e report, - per lo standard input] [-w report in attesa di esito]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (window < 1) window = 1;
+    if (batch != NULL && strcmp(batch, "-") != 0 && (in = fopen(batch, "r")) == NULL) {
+        perror("fopen() error");
+        exit(1);
+    }
 
     //Creazione del descrittore del socket
     if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -85,10 +173,11 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    //Invia un bit di valore 1 al ServerVerifica per informarlo che la comunicazione deve avvenire con l'ASL
-    if (full_write(socket_fd, &start_bit, sizeof(char)) < 0) {
-        perror("full_write() error");
-        exit(1);
+    //In modalità batch i report vengono inviati senza interazione e senza attese
+    if (batch != NULL) {
+        batch_report(socket_fd, in, window);
+        close(socket_fd);
+        exit(0);
     }
 
     printf("*ASL*\n");
@@ -96,14 +185,15 @@ int main(int argc, char **argv) {
 
     while (1) {
         printf("Inserisci codice tessera sanitaria: ");
-        if (fgets(package.ID, MAX_SIZE, stdin) == NULL) {
+        if (fgets(buf, sizeof(buf), stdin) == NULL) {
             perror("fgets() error");
             exit(1);
         }
         //Controllo sull'input dell'utente
-        if (strlen(package.ID) != ID_SIZE) printf("Numero caratteri tessera sanitaria non corretto, devono essere esattamente 10! Riprovare\n\n");
+        if (strlen(buf) != ID_SIZE || id_key(buf) == 0) printf("Numero tessera sanitaria non corretto, devono essere esattamente 10 lettere o cifre! Riprovare\n\n");
         else {
             //Andiamo a inserire il terminatore al posto dell'invio inserito dalla fgets, poichè questo veniva contato ed inserito come carattere nella stringa
+            memcpy(package.ID, buf, ID_SIZE - 1);
             package.ID[ID_SIZE - 1] = 0;
             break;
         }
@@ -122,16 +212,22 @@ int main(int argc, char **argv) {
     if (package.report == '1') printf("\n Invio richiesta di ripristino GP\n");
     else printf("\n Invio richiesta di sospensione GP\n");
 
-    //Invia pacchetto report al ServerVerifica
-    if (full_write(socket_fd, &package, sizeof(REPORT)) < 0) {
+    //Invia pacchetto report al ServerVerifica: il tipo MSG_REPORT_UPDATE informa il ServerVerifica che la comunicazione avviene con l'ASL
+    proto_begin(&w, frame, sizeof(frame), MSG_REPORT_UPDATE, 0);
+    proto_put_ID(&w, package.ID);
+    proto_put_u8(&w, package.report);
+    if (proto_send(socket_fd, &w) < 0) {
         perror("full_write() error");
         exit(1);
     }
-    //Riceve messaggio di report dal ServerVerifica
-    if (full_read(socket_fd, buf, ASL_ACK) < 0) {
+    //Riceve messaggio di report dal ServerVerifica: il primo byte è l'esito, il resto il messaggio da mostrare
+    if (proto_recv(socket_fd, &h, frame, sizeof(frame)) < 0 || h.type != MSG_RESULT) {
         perror("full_read() error");
         exit(1);
     }
+    proto_reader(&r, frame, h.length);
+    proto_get_u8(&r);
+    proto_get_text(&r, buf, sizeof(buf));
     //Simuliamo un caricamento con la sleep
     sleep(2);
     //Stampa del messaggio del report ricevuto dal serverVerifica
@@ -0,0 +1,149 @@
+/*
+    Allocatore a slab dello stato delle connessioni dei server ad eventi (i worker del ServerVaccinale ed i cicli di eventi del ServerVerifica).
+
+    Gli oggetti sono divisi in POOL_CLASSES classi di dimensione, potenze di 2 da POOL_MIN_SIZE a POOL_MAX_SIZE byte. Ogni classe ricava i propri
+    oggetti da slab di POOL_SLAB_SIZE byte, che non vengono mai restituiti al sistema: la memoria resta limitata al picco degli oggetti in uso.
+    Ogni thread ha una lista di oggetti liberi per classe (POOL_CACHE), quindi allocazione e rilascio non usano lock né system call.
+    Quando la lista di un thread è vuota riceve un lotto di POOL_BATCH oggetti dalla lista globale della classe, quando supera 2 * POOL_BATCH
+    oggetti le restituisce quelli usati meno di recente: così anche gli oggetti liberati da un thread diverso da quello che li ha allocati
+    tornano disponibili a tutti.
+    I primi slab possono essere ricavati da un'area fornita dal chiamante, ad esempio i buffer registrati in io_uring.
+
+    Tutte le funzioni sono static inline, come in Protocollo.h.
+*/
+#ifndef ALLOCATORE_H
+#define ALLOCATORE_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define POOL_MIN_SHIFT 5        //la classe più piccola ha oggetti di 32 byte
+#define POOL_MIN_SIZE (1UL << POOL_MIN_SHIFT)
+#define POOL_CLASSES 10         //classi da 32 byte a 16 KiB
+#define POOL_MAX_SIZE (POOL_MIN_SIZE << (POOL_CLASSES - 1))
+#define POOL_SLAB_SIZE (128 * 1024) //memoria chiesta al sistema per volta, divisa tra gli oggetti di una sola classe
+#define POOL_BATCH 32           //oggetti spostati insieme tra la lista di un thread e la lista globale
+
+//Oggetto libero: i primi byte dell'oggetto collegano le liste
+typedef struct POOL_FREE {
+    struct POOL_FREE *next;         //oggetto libero successivo nella stessa lista
+    struct POOL_FREE *next_batch;   //nella lista globale: primo oggetto del lotto successivo
+} POOL_FREE;
+
+typedef struct {
+    POOL_FREE *head;
+    unsigned count;
+} POOL_LIST;
+
+//Oggetti liberi di un thread, usati senza lock: ogni thread che alloca o libera oggetti ha la propria
+typedef struct {
+    POOL_LIST lists[POOL_CLASSES];
+} POOL_CACHE;
+
+typedef struct {
+    pthread_mutex_t lock;               //protegge batches, slab ed arena
+    POOL_FREE *batches[POOL_CLASSES];   //lotti di POOL_BATCH oggetti liberi restituiti dai thread
+    char *slab[POOL_CLASSES];           //parte ancora da dividere dello slab corrente di ogni classe
+    size_t slab_left[POOL_CLASSES];
+    char *arena;                        //memoria da cui vengono ricavati i primi slab, NULL se assente
+    size_t arena_size, arena_used;
+    size_t used;                        //byte di slab ricavati, letto atomicamente dalle statistiche
+} POOL;
+
+//Inizializza il pool. Se arena non è NULL i primi arena_size byte di slab vengono ricavati da arena.
+static inline void pool_init(POOL *pool, void *arena, size_t arena_size) {
+    memset(pool, 0, sizeof(*pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->arena = arena;
+    pool->arena_size = arena ? arena_size : 0;
+}
+
+//Classe degli oggetti di size byte (al più POOL_MAX_SIZE). Con size costante viene calcolata durante la compilazione.
+static inline int pool_class(size_t size) {
+    return size <= POOL_MIN_SIZE ? 0 : 64 - __builtin_clzl(size - 1) - POOL_MIN_SHIFT;
+}
+
+//Ritorna 1 se ptr è stato ricavato dall'arena del pool
+static inline int pool_in_arena(POOL *pool, const void *ptr) {
+    return pool->arena != NULL && (const char *)ptr >= pool->arena && (const char *)ptr < pool->arena + pool->arena_size;
+}
+
+//Riempie la lista vuota di un thread: con un lotto della lista globale oppure con nuovi oggetti dello slab della classe. Ritorna -1 se la memoria è esaurita.
+static inline int pool_refill(POOL *pool, POOL_LIST *list, int c) {
+    size_t size = POOL_MIN_SIZE << c;
+    POOL_FREE *object;
+    char *slab;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((object = pool->batches[c]) != NULL) {
+        pool->batches[c] = object->next_batch;
+        list->head = object;
+        list->count = POOL_BATCH;
+        pthread_mutex_unlock(&pool->lock);
+        return 0;
+    }
+
+    if (pool->slab_left[c] < size) {
+        if (pool->arena_size - pool->arena_used >= POOL_SLAB_SIZE) {
+            slab = pool->arena + pool->arena_used;
+            pool->arena_used += POOL_SLAB_SIZE;
+        } else if ((slab = malloc(POOL_SLAB_SIZE)) == NULL) {
+            pthread_mutex_unlock(&pool->lock);
+            return -1;
+        }
+        pool->slab[c] = slab;
+        pool->slab_left[c] = POOL_SLAB_SIZE;
+        __atomic_add_fetch(&pool->used, POOL_SLAB_SIZE, __ATOMIC_RELAXED);
+    }
+    for (i = 0; i < POOL_BATCH && pool->slab_left[c] >= size; i++) {
+        object = (POOL_FREE *)pool->slab[c];
+        object->next = list->head;
+        list->head = object;
+        list->count++;
+        pool->slab[c] += size;
+        pool->slab_left[c] -= size;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+//Alloca un oggetto di size byte, non azzerato, dalla lista del thread. Ritorna NULL se la memoria è esaurita.
+static inline void *pool_alloc(POOL *pool, POOL_CACHE *cache, size_t size) {
+    int c = pool_class(size);
+    POOL_LIST *list = &cache->lists[c];
+    POOL_FREE *object;
+
+    if (list->head == NULL && pool_refill(pool, list, c) < 0) return NULL;
+    object = list->head;
+    list->head = object->next;
+    list->count--;
+    return object;
+}
+
+//Libera un oggetto di size byte allocato da un thread qualsiasi. Gli oggetti liberati per ultimi, ancora nella cache del processore, vengono riusati per primi.
+static inline void pool_free(POOL *pool, POOL_CACHE *cache, void *ptr, size_t size) {
+    int c = pool_class(size);
+    POOL_LIST *list = &cache->lists[c];
+    POOL_FREE *object = ptr, *batch;
+    unsigned i;
+
+    if (ptr == NULL) return;
+    object->next = list->head;
+    list->head = object;
+    if (++list->count < 2 * POOL_BATCH) return;
+
+    //La lista resta con i POOL_BATCH oggetti liberati per ultimi, gli altri tornano alla lista globale come un unico lotto
+    for (i = 1; i < POOL_BATCH; i++) object = object->next;
+    batch = object->next;
+    object->next = NULL;
+    list->count = POOL_BATCH;
+
+    pthread_mutex_lock(&pool->lock);
+    batch->next_batch = pool->batches[c];
+    pool->batches[c] = batch;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#endif
@@ -7,12 +7,10 @@
 #include <sys/types.h>
 #include <sys/socket.h> //libreria C per i socket.
 #include <arpa/inet.h>  
+#include <time.h>
+#include "Protocollo.h" //frame e strutture condivise da tutti i programmi
 
 #define MAX_SIZE 1024   //dimensione max del buffer
-#define ACK_SIZE 64     
-#define WELCOME_SIZE 108 
-#define APP_ACK 39       
-#define ID_SIZE 11 //10 byte per la tessera sanitaria più un byte per il terminatore
 
 //Legge esattamente count byte s iterando opportunamente le letture. Legge anche se viene interrotta da una System Call.
 ssize_t full_read(int fd, void *buf, size_t count) {
@@ -53,12 +51,156 @@ ssize_t full_write(int fd, const void *buf, size_t count) {
 }
 
 
-int main() {
-    int socket_fd;
+//Riceve un frame del tipo atteso, in risposta alla richiesta req_id. Termina il programma se la risposta non è quella attesa.
+void expect(int socket_fd, unsigned char type, unsigned int req_id, FRAME_HEADER *h, unsigned char *payload, size_t size) {
+    if (proto_recv(socket_fd, h, payload, size) < 0 || h->type != type || h->req_id != req_id) {
+        perror("full_read() error");
+        exit(1);
+    }
+}
+
+/* Modalità batch: legge da in una tessera per riga e le invia sulla stessa connessione senza attendere le risposte, al più window
+   tessere in attesa di esito. Il ServerVerifica risponde nell'ordine di invio, per ogni tessera viene stampata una riga
+   "tessera<TAB>esito<TAB>messaggio"; al termine viene stampato su stderr il riepilogo con le tessere al secondo.
+   In una sessione ogni tessera riceve solo il risultato, senza ack. */
+void batch_scan(int socket_fd, FILE *in, int window, int session) {
+    char line[MAX_SIZE], buf[MAX_SIZE], *ID, (*in_flight)[ID_SIZE];
+    unsigned char frame[PROTO_HEADER_SIZE + MAX_SIZE];
+    unsigned long sent = 0, received = 0, invalid = 0, results[4] = {0};
+    struct timespec start, end;
+    double elapsed;
+    int eof = 0, result;
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    PROTO_READER r;
+
+    if ((in_flight = malloc(window * ID_SIZE)) == NULL) {
+        perror("malloc() error");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (!eof || received < sent) {
+        //Invia nuove tessere finché la finestra non è piena
+        while (!eof && sent - received < window) {
+            if (fgets(line, sizeof(line), in) == NULL) {
+                eof = 1;
+                break;
+            }
+            if ((ID = strtok(line, " \t\r\n,;")) == NULL) continue; //riga vuota
+            if (strlen(ID) != ID_SIZE - 1 || id_key(ID) == 0) {
+                printf("%s\t-\tNumero tessera sanitaria non corretto, servono 10 lettere o cifre\n", ID);
+                invalid++;
+                continue;
+            }
+            strcpy(in_flight[sent % window], ID);
+            proto_begin(&w, frame, sizeof(frame), MSG_SCAN, sent);
+            proto_put_ID(&w, ID);
+            if (proto_send(socket_fd, &w) < 0) {
+                perror("full_write() error");
+                exit(1);
+            }
+            sent++;
+        }
+        if (received == sent) continue;
+
+        //Per ogni tessera arrivano l'ack (solo fuori da una sessione) ed il risultato: il primo byte è l'esito, il resto il messaggio da mostrare
+        if (!session) expect(socket_fd, MSG_ACK, received, &h, frame, sizeof(frame));
+        expect(socket_fd, MSG_RESULT, received, &h, frame, sizeof(frame));
+        proto_reader(&r, frame, h.length);
+        result = proto_get_u8(&r);
+        proto_get_text(&r, buf, sizeof(buf));
+        printf("%s\t%c\t%s\n", in_flight[received % window], result, buf);
+        if (result >= '0' && result <= '3') results[result - '0']++;
+        received++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%lu tessere verificate in %.3f secondi (%.0f tessere/s): %lu validi, %lu non validi, %lu inesistenti, "
+            "%lu servizio non disponibile, %lu righe non valide\n", received, elapsed, elapsed > 0 ? received / elapsed : 0,
+            results[1], results[0], results[2], results[3], invalid);
+    free(in_flight);
+}
+
+//Legge da tastiera un numero di tessera, ripetendo la richiesta finché non è corretto. Ritorna -1 alla fine dell'input.
+int read_ID(char ID[]) {
+    char line[MAX_SIZE];
+
+    while (1) {
+        printf("Inserisci codice tessera sanitaria: ");
+        if (fgets(line, sizeof(line), stdin) == NULL) return -1;
+
+        //Controllo sull'input dell'utente
+        if (strlen(line) != ID_SIZE || id_key(line) == 0) printf("Numero tessera sanitaria non corretto, servono 10 lettere o cifre. Riprova\n\n");
+        else {
+            //Andiamo a inserire il terminatore al posto dell'invio inserito dalla fgets, poichè questo veniva contato ed inserito come carattere nella stringa
+            memcpy(ID, line, ID_SIZE - 1);
+            ID[ID_SIZE - 1] = 0;
+            return 0;
+        }
+    }
+}
+
+/* Sessione interattiva: le tessere inserite vengono verificate una dopo l'altra sulla stessa connessione, senza nuovi benvenuti né ack.
+   È la modalità dei varchi sempre accesi; la sessione termina alla fine dell'input. */
+void session_scan(int socket_fd) {
+    char buf[MAX_SIZE], ID[ID_SIZE];
+    unsigned char frame[PROTO_HEADER_SIZE + MAX_SIZE];
+    unsigned int req_id;
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    PROTO_READER r;
+
+    for (req_id = 1; read_ID(ID) == 0; req_id++) {
+        proto_begin(&w, frame, sizeof(frame), MSG_SCAN, req_id);
+        proto_put_ID(&w, ID);
+        if (proto_send(socket_fd, &w) < 0) {
+            perror("full_write() error");
+            exit(1);
+        }
+        expect(socket_fd, MSG_RESULT, req_id, &h, frame, sizeof(frame));
+        proto_reader(&r, frame, h.length);
+        proto_get_u8(&r);
+        proto_get_text(&r, buf, sizeof(buf));
+        printf("%s\n\n", buf);
+    }
+}
+
+int main(int argc, char **argv) {
+    int socket_fd, opt, window = 64, session = 0;
     struct sockaddr_in server_addr;
-    char start_bit, report, buf[MAX_SIZE], ID[ID_SIZE];
+    char buf[MAX_SIZE], ID[ID_SIZE];
+    unsigned char frame[PROTO_HEADER_SIZE + MAX_SIZE];
+    const char *batch = NULL;
+    FILE *in = stdin;
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    PROTO_READER r;
 
-    start_bit = '0'; //Inizializziamo il bit a 0 per inviarlo al ServerVerifica
+    //Senza opzioni l'AppVerifica è interattiva, con -b legge le tessere dal file indicato ("-" per lo standard input), con -s apre una sessione
+    while ((opt = getopt(argc, argv, "b:w:s")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch = optarg;
+            break;
+        case 's':
+            session = 1;
+            break;
+        case 'w':
+            window = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s sessione di più tessere] [-b file delle tessere, - per lo standard input] [-w tessere in attesa di esito]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (window < 1) window = 1;
+    if (batch != NULL) session = 1; //in modalità batch le tessere viaggiano sempre in una sessione, se il ServerVerifica la supporta
+    if (batch != NULL && strcmp(batch, "-") != 0 && (in = fopen(batch, "r")) == NULL) {
+        perror("fopen() error");
+        exit(1);
+    }
 
     //Creazione del descrittore del socket
     if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
@@ -82,48 +224,63 @@ int main() {
         exit(1);
     }
 
-    //Invia un bit di valore 0 al ServerVerifica per informarlo che la comunicazione deve avvenire con l'AppVerifica
-    if (full_write(socket_fd, &start_bit, sizeof(char)) < 0) {
+    //Invia un MSG_HELLO al ServerVerifica per informarlo che la comunicazione deve avvenire con l'AppVerifica
+    proto_begin(&w, frame, sizeof(frame), MSG_HELLO, 0);
+    proto_put_u8(&w, ROLE_APP_VERIFICA);
+    proto_put_u8(&w, session ? HELLO_SESSION : HELLO_SINGLE);
+    if (proto_send(socket_fd, &w) < 0) {
         perror("full_write() error");
         exit(1);
     }
 
     //Riceve il benvenuto dal ServerVerifica
-    if (full_read(socket_fd, buf, WELCOME_SIZE) < 0) {
+    if (proto_recv(socket_fd, &h, frame, sizeof(frame)) < 0 || h.type != MSG_WELCOME) {
         perror("full_read() error");
         exit(1);
     }
-    printf("%s\n\n", buf);
 
-    //Inserimento codice tessera sanitaria
-    while (1) {
-        printf("Inserisci codice tessera sanitaria: ");
-        if (fgets(ID, MAX_SIZE, stdin) == NULL) {
-            perror("fgets() error");
-            exit(1);
-        }
+    proto_reader(&r, frame, h.length);
+    proto_get_text(&r, buf, sizeof(buf));
 
-        //Controllo sull'input dell'utente
-        if (strlen(ID) != ID_SIZE) printf("Numero caratteri tessera sanitaria non corretto,Riprova\n\n");
-        else {
+    //Un ServerVerifica di versione precedente ignora la richiesta di sessione: le tessere ricevono l'ack una per una
+    if (session && h.version < 3) session = 0;
+    else if (session) expect(socket_fd, MSG_ACK, 0, &h, frame, sizeof(frame));
 
-            //Andiamo a inserire il terminatore al posto dell'invio inserito dalla fgets, poichè questo veniva contato ed inserito come carattere nella stringa
-            ID[ID_SIZE - 1] = 0;
-            break;
-        }
+    //In modalità batch le tessere vengono inviate senza interazione e senza attese
+    if (batch != NULL) {
+        batch_scan(socket_fd, in, window, session);
+        close(socket_fd);
+        exit(0);
+    }
+
+    printf("%s\n\n", buf);
+    if (session) {
+        session_scan(socket_fd);
+        close(socket_fd);
+        exit(0);
+    }
+
+    //Inserimento codice tessera sanitaria
+    if (read_ID(ID) < 0) {
+        perror("fgets() error");
+        exit(1);
     }
 
     //Invio del numero di tessera sanitaria da convalidare al server verifica
-    if (full_write(socket_fd, ID, ID_SIZE)) {
+    proto_begin(&w, frame, sizeof(frame), MSG_SCAN, 1);
+    proto_put_ID(&w, ID);
+    if (proto_send(socket_fd, &w) < 0) {
         perror("full_write() error");
         exit(1);
     }
 
     //Ricezione dell'ack
-    if (full_read(socket_fd, buf, ACK_SIZE) < 0) {
+    if (proto_recv(socket_fd, &h, frame, sizeof(frame)) < 0 || h.type != MSG_ACK) {
         perror("full_read() error");
         exit(1);
     }
+    proto_reader(&r, frame, h.length);
+    proto_get_text(&r, buf, sizeof(buf));
     printf("\n%s\n\n", buf);
 
     printf("Convalida in corso..\n\n");
@@ -131,11 +288,14 @@ int main() {
     //Facciamo attendere 3 secondi per completare l'operazione di verifica
     sleep(3);
     
-    //Riceve esito scansione Green Pass dal ServerVerifica
-    if (full_read(socket_fd, buf, APP_ACK) < 0) {
+    //Riceve esito scansione Green Pass dal ServerVerifica: il primo byte è l'esito, il resto il messaggio da mostrare
+    if (proto_recv(socket_fd, &h, frame, sizeof(frame)) < 0 || h.type != MSG_RESULT) {
         perror("full_read() error");
         exit(1);
     }
+    proto_reader(&r, frame, h.length);
+    proto_get_u8(&r);
+    proto_get_text(&r, buf, sizeof(buf));
     printf("%s\n", buf);
 
     close(socket_fd);
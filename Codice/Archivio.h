@@ -0,0 +1,84 @@
+/*
+    Formato su disco dei green pass del ServerVaccinale, condiviso con gli strumenti che leggono e scrivono l'archivio fuori dal server.
+
+    STORE_FILE è un'intestazione di una pagina seguita dagli slot di una tabella hash ad indirizzamento aperto con scansione lineare,
+    indicizzata dall'hash della chiave della tessera (id_key). Il numero di slot è una potenza di 2 ed il fattore di carico resta sotto il 70%.
+    Le modifiche successive all'ultimo checkpoint sono nei segmenti del log WAL_FILE, numerati in modo consecutivo a partire da
+    header.segment: all'avvio il ServerVaccinale li riapplica al file.
+    Il processo che modifica il file ne detiene un lock esclusivo (flock), così server e strumenti non lo modificano insieme.
+
+    Tutte le funzioni sono static inline, come in Protocollo.h.
+*/
+#ifndef ARCHIVIO_H
+#define ARCHIVIO_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/file.h>   // contiene flock()
+#include "Protocollo.h"
+
+#define STORE_FILE "greenpass.db" //file dei green pass, mappato in memoria
+#define STORE_MAGIC "GPSTOR3"  //slot con la chiave della tessera ed i giorni di validità
+#define STORE_HEADER_SIZE 4096 //l'intestazione occupa una pagina, così gli slot sono allineati alle pagine ed alle linee di cache
+#define WAL_FILE "greenpass.wal.%lu" //segmenti del log delle modifiche successive all'ultimo checkpoint
+
+//Elemento dell'indice dei green pass: il GP è memorizzato direttamente nello slot, key == 0 indica uno slot libero.
+//Ogni slot occupa una linea di cache, quindi una lettura tocca una sola linea ed una sola pagina.
+typedef struct {
+    GP_REQUEST gp;
+    unsigned int seq;   //seqlock dello slot: dispari mentre il writer modifica il GP
+    GP_KEY key;         //chiave della tessera del GP: la scansione confronta solo le chiavi, una volta scritta non cambia più
+} __attribute__((aligned(64))) GP_SLOT;
+
+//Intestazione del file dei GP, seguita dagli slot dell'indice
+typedef struct {
+    char magic[8];
+    unsigned long capacity; //numero di slot presenti nel file
+    unsigned long count;    //GP presenti all'ultimo checkpoint
+    unsigned long segment;  //primo segmento del log da riapplicare dopo l'ultimo checkpoint
+} STORE_HEADER;
+
+//Record del log: ogni modifica all'indice viene accodata al log prima di essere confermata
+typedef struct {
+    unsigned int checksum;  //checksum del resto del record, permette di riconoscere una scrittura interrotta
+    char type;              //'I' emissione di un nuovo GP, 'S' sostituzione di un GP esistente, 'R' modifica del report (sono significativi solo ID e report)
+    GP_REQUEST gp;
+} LOG_RECORD;
+
+//Checksum FNV-1a di len byte
+static inline unsigned int checksum(const void *data, size_t len) {
+    const unsigned char *p = data;
+    unsigned int hash = 2166136261U;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+//Checksum di un record del log, calcolata su tutto il record tranne la checksum: permette di riconoscere un record scritto solo in parte
+static inline unsigned int log_checksum(LOG_RECORD *record) {
+    return checksum((char *)record + sizeof(record->checksum), sizeof(LOG_RECORD) - sizeof(record->checksum));
+}
+
+/* Ritorna lo slot di slots che contiene il GP con la chiave indicata, oppure lo slot libero in cui andrebbe inserito.
+   Legge gli slot senza seqlock: va usata solo da chi modifica gli slot. */
+static inline GP_SLOT *index_probe(GP_SLOT *slots, size_t capacity, GP_KEY key) {
+    size_t i = key_hash(key) & (capacity - 1);
+
+    while (slots[i].key != 0 && slots[i].key != key) i = (i + 1) & (capacity - 1);
+    return &slots[i];
+}
+
+//Acquisisce il lock esclusivo del file dei GP aperto in fd. Ritorna 0, -1 se il file è già in uso da un altro processo.
+static inline int store_lock(int fd, const char *path) {
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) return 0;
+    if (errno == EWOULDBLOCK) fprintf(stderr, "File %s in uso da un altro processo\n", path);
+    else perror("flock() error");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,612 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>      // libreria C per la gestione delle situazioni di errore.
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>   // libreria C per la mappatura dei file in memoria
+#include <sys/types.h>
+#include <pthread.h>    // libreria C per i thread POSIX
+#include <time.h>
+#include "Protocollo.h" // frame e strutture condivise da tutti i programmi
+#include "Instradamento.h" // suddivisione delle tessere tra le istanze del ServerVaccinale
+#include "Archivio.h"   // formato del file dei GP e del log
+
+/*
+    Importazione ed esportazione in blocco dei green pass del ServerVaccinale, senza passare per CentroVaccinale e ServerVaccinale.
+
+    L'importazione legge un elenco di GP e li scrive nel file dei GP della directory indicata, che il ServerVaccinale deve aver lasciato
+    (il file viene bloccato, con il server avviato l'importazione rifiuta di partire). Il nuovo file viene costruito a parte con tutti
+    i thread disponibili: i GP già presenti, le modifiche del log non ancora applicate e le righe importate, che sostituiscono
+    i GP esistenti con lo stesso numero di tessera; se una tessera compare in più righe prevale l'ultima. Poi sostituisce il vecchio file con una rinomina, come la crescita dell'indice.
+    Con -s vengono importate solo le tessere dello shard indicato, così lo stesso elenco può essere caricato in ogni shard.
+
+    L'esportazione scrive tutti i GP del file, leggendo gli slot con il loro seqlock: può essere eseguita anche con il server avviato.
+
+    Formati:
+        testo (predefinito)   una riga "tessera,inizio,scadenza,report" per GP, date gg/mm/aaaa oppure aaaa-mm-gg, report 0 o 1.
+                              Le righe vuote e quelle che iniziano con # vengono ignorate.
+        binario (-B)          GP consecutivi nel formato dei frame (proto_put_gp, PROTO_GP_SIZE byte ciascuno).
+*/
+
+#define MAX_THREADS 256     //numero massimo di thread dell'importazione
+#define INDEX_CAPACITY 1024 //capacità minima dell'indice, come nel ServerVaccinale
+#define MAX_ERRORS 10       //righe non valide stampate da ogni thread
+#define OUT_BUFFER (1 << 20) //dimensione del buffer di uscita dell'esportazione
+
+//Parte dell'elenco assegnata ad un thread dell'importazione, o parte degli slot nelle fasi che scorrono l'indice
+typedef struct {
+    pthread_t tid;
+    const char *start, *end;    //righe o record assegnati al thread
+    unsigned long line;         //numero della prima riga della parte, per i messaggi di errore
+    size_t first, last;         //slot assegnati al thread
+    unsigned long rows, added, replaced, invalid, skipped;
+} PART;
+
+GP_SLOT *slots;                 //slot del nuovo file
+unsigned long *orders;          //per ogni slot del nuovo file: riga dell'elenco che ha scritto il GP, 0 per i GP esistenti e del log
+size_t capacity;
+int binary = 0;                 //1 per il formato binario
+int shard = -1;                 //shard da importare, -1 per tutte le tessere
+SHARD_MAP shard_map;
+PART parts[MAX_THREADS];
+int n_threads;
+
+//Sincronizza su disco la directory corrente, così la creazione e la rinomina dei file sopravvivono ad un crash
+void sync_dir() {
+    int fd;
+
+    if ((fd = open(".", O_RDONLY | O_DIRECTORY)) < 0) {
+        perror("open() error");
+        return;
+    }
+    if (fsync(fd) < 0) perror("fsync() error");
+    close(fd);
+}
+
+/* Scrive un GP nel nuovo indice. Più thread inseriscono insieme: uno slot libero viene occupato portando il seqlock da 0 ad 1 con
+   una compare-and-swap, ed il GP diventa visibile agli altri thread quando il seqlock torna pari. Un GP con la stessa tessera
+   sostituisce quello esistente se order, la riga dell'elenco da cui proviene, non precede quella del GP esistente: le righe di una
+   tessera arrivano da thread diversi in un ordine qualunque, ma prevale sempre l'ultima dell'elenco. key è la chiave della tessera del GP.
+   Ritorna 1 se il GP è nuovo, 0 se la tessera era già presente. */
+int import_put(GP_KEY key, const GP_REQUEST *gp, unsigned long order) {
+    size_t i = key_hash(key) & (capacity - 1);
+    unsigned int seq;
+
+    for (;;) {
+        seq = __atomic_load_n(&slots[i].seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;  //un altro thread sta scrivendo lo slot: la chiave non è ancora affidabile
+        if (seq == 0) {
+            if (!__atomic_compare_exchange_n(&slots[i].seq, &seq, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+            slots[i].gp = *gp;
+            slots[i].key = key;
+            orders[i] = order;
+            __atomic_store_n(&slots[i].seq, 2, __ATOMIC_RELEASE);
+            return 1;
+        }
+        if (slots[i].key == key) {
+            if (!__atomic_compare_exchange_n(&slots[i].seq, &seq, seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) continue;
+            if (order >= orders[i]) {
+                slots[i].gp = *gp;
+                orders[i] = order;
+            }
+            __atomic_store_n(&slots[i].seq, seq + 2, __ATOMIC_RELEASE);
+            return 0;
+        }
+        i = (i + 1) & (capacity - 1);
+    }
+}
+
+//Legge un intero positivo di al più max_digits cifre. Ritorna -1 se non ci sono cifre.
+int parse_number(const char **p, const char *end, int max_digits) {
+    int n = 0, digits = 0;
+
+    while (*p < end && **p >= '0' && **p <= '9' && digits < max_digits) {
+        n = n * 10 + (**p - '0');
+        (*p)++;
+        digits++;
+    }
+    return digits ? n : -1;
+}
+
+//Legge una data gg/mm/aaaa oppure aaaa-mm-gg e ne restituisce il numero del giorno in day. Ritorna -1 se la data non è valida.
+int parse_date(const char **p, const char *end, int *day) {
+    DATE date;
+    int first, second, third;
+    char separator;
+
+    if ((first = parse_number(p, end, 4)) < 0 || *p == end) return -1;
+    separator = **p;
+    if (separator != '/' && separator != '-') return -1;
+    (*p)++;
+    if ((second = parse_number(p, end, 2)) < 0 || *p == end || **p != separator) return -1;
+    (*p)++;
+    if ((third = parse_number(p, end, 4)) < 0) return -1;
+
+    if (separator == '-') {
+        date.year = first;
+        date.month = second;
+        date.day = third;
+    } else {
+        date.day = first;
+        date.month = second;
+        date.year = third;
+    }
+    if (date.year < 1970 || date.month < 1 || date.month > 12 || date.day < 1 || date.day > days_in_month(date.month, date.year)) return -1;
+    *day = days_from_date(&date);
+    return 0;
+}
+
+//Salta gli spazi ed il separatore di campo successivo. Ritorna -1 se manca il separatore.
+int parse_separator(const char **p, const char *end) {
+    while (*p < end && (**p == ' ' || **p == '\t')) (*p)++;
+    if (*p == end || (**p != ',' && **p != ';')) return -1;
+    (*p)++;
+    while (*p < end && (**p == ' ' || **p == '\t')) (*p)++;
+    return 0;
+}
+
+//Legge una riga "tessera,inizio,scadenza,report" del formato testo. Ritorna -1 se la riga non è valida.
+int parse_row(const char *p, const char *end, GP_REQUEST *gp) {
+    const char *ID = p;
+
+    memset(gp, 0, sizeof(GP_REQUEST));
+    while (p < end && p - ID < ID_SIZE && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+    if (p - ID != ID_SIZE - 1) return -1;
+    memcpy(gp->ID, ID, ID_SIZE - 1);
+    if (id_key(gp->ID) == 0) return -1;
+    if (parse_separator(&p, end) < 0 || parse_date(&p, end, &gp->start_day) < 0) return -1;
+    if (parse_separator(&p, end) < 0 || parse_date(&p, end, &gp->expire_day) < 0) return -1;
+    if (parse_separator(&p, end) < 0 || p == end || (*p != '0' && *p != '1')) return -1;
+    gp->report = *p++;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    if (p != end || gp->expire_day < gp->start_day) return -1;
+    return 0;
+}
+
+//Aggiunge al nuovo indice un GP letto dalla riga line dell'elenco, se appartiene allo shard da importare
+void import_gp(PART *part, const GP_REQUEST *gp, unsigned long line) {
+    if (shard >= 0 && shard_of(&shard_map, gp->ID) != shard) part->skipped++;
+    else if (import_put(id_key(gp->ID), gp, line)) part->added++;
+    else part->replaced++;
+}
+
+//Thread che conta le righe della propria parte dell'elenco, serve a dimensionare l'indice ed a numerare le righe
+void *count_thread(void *arg) {
+    PART *part = arg;
+    const char *p;
+
+    if (binary) part->rows = (part->end - part->start) / PROTO_GP_SIZE;
+    else for (p = part->start; p < part->end && (p = memchr(p, '\n', part->end - p)) != NULL; p++) part->rows++;
+    return NULL;
+}
+
+//Thread che importa la propria parte dell'elenco
+void *import_thread(void *arg) {
+    PART *part = arg;
+    const char *p, *end;
+    unsigned long line = part->line;
+    GP_REQUEST gp;
+    PROTO_READER r;
+
+    if (binary) {
+        for (p = part->start; p + PROTO_GP_SIZE <= part->end; p += PROTO_GP_SIZE) {
+            proto_reader(&r, p, PROTO_GP_SIZE);
+            proto_get_gp(&r, &gp);
+            if (id_key(gp.ID) == 0 || (gp.report != '0' && gp.report != '1') || gp.expire_day < gp.start_day) {
+                if (part->invalid++ < MAX_ERRORS) fprintf(stderr, "Record %lu non valido\n", (unsigned long)(p - part->start) / PROTO_GP_SIZE + line);
+                continue;
+            }
+            import_gp(part, &gp, (p - part->start) / PROTO_GP_SIZE + line);
+        }
+        return NULL;
+    }
+
+    for (p = part->start; p < part->end; p = end + 1, line++) {
+        if ((end = memchr(p, '\n', part->end - p)) == NULL) end = part->end;
+        if (end == p || *p == '\r' || *p == '#') continue;    //riga vuota o commento
+        if (parse_row(p, end, &gp) < 0) {
+            if (part->invalid++ < MAX_ERRORS) fprintf(stderr, "Riga %lu non valida: %.*s\n", line, (int)(end - p > 80 ? 80 : end - p), p);
+            continue;
+        }
+        import_gp(part, &gp, line);
+    }
+    return NULL;
+}
+
+//Thread che copia nel nuovo indice i GP della propria parte degli slot del vecchio file
+void *copy_thread(void *arg) {
+    PART *part = arg;
+    const GP_SLOT *old = (const GP_SLOT *)part->start;
+    size_t i;
+
+    for (i = part->first; i < part->last; i++)
+        if (old[i].key != 0) part->added += import_put(old[i].key, &old[i].gp, 0);
+    return NULL;
+}
+
+//Thread che riporta a 0 i seqlock della propria parte degli slot: nel file i GP partono da seqlock 0, come dopo la crescita
+void *reset_thread(void *arg) {
+    PART *part = arg;
+    size_t i;
+
+    for (i = part->first; i < part->last; i++) slots[i].seq = 0;
+    return NULL;
+}
+
+//Esegue func su tutte le parti, con un thread per parte
+void run_parts(void *(*func)(void *)) {
+    int i;
+
+    for (i = 0; i < n_threads; i++) {
+        if (pthread_create(&parts[i].tid, NULL, func, &parts[i]) != 0) {
+            perror("pthread_create() error");
+            exit(1);
+        }
+    }
+    for (i = 0; i < n_threads; i++) pthread_join(parts[i].tid, NULL);
+}
+
+//Divide tra le parti gli slot da 0 a count
+void split_slots(size_t count) {
+    int i;
+
+    for (i = 0; i < n_threads; i++) {
+        parts[i].first = count / n_threads * i;
+        parts[i].last = i == n_threads - 1 ? count : count / n_threads * (i + 1);
+    }
+}
+
+//Divide l'elenco in parti uguali, spostando l'inizio di ogni parte all'inizio della riga o del record successivo
+void split_input(const char *data, size_t size) {
+    size_t chunk = size / n_threads;
+    const char *p;
+    int i;
+
+    for (i = 0; i < n_threads; i++) {
+        if (binary) parts[i].start = data + chunk / PROTO_GP_SIZE * PROTO_GP_SIZE * i;
+        else if (i == 0) parts[i].start = data;
+        else if ((p = memchr(data + chunk * i, '\n', size - chunk * i)) == NULL) parts[i].start = data + size;
+        else parts[i].start = p + 1 > parts[i - 1].start ? p + 1 : parts[i - 1].start;
+    }
+    for (i = 0; i < n_threads; i++) parts[i].end = i == n_threads - 1 ? data + size : parts[i + 1].start;
+}
+
+//Mappa in memoria il file da importare, "-" per lo standard input. In size viene restituita la dimensione.
+const char *map_input(const char *path, size_t *size) {
+    struct stat st;
+    char *data = NULL, *grown;
+    size_t cap = 0;
+    ssize_t n;
+    void *map;
+    int fd;
+
+    //Lo standard input non può essere mappato: viene letto in memoria
+    if (strcmp(path, "-") == 0) {
+        *size = 0;
+        do {
+            if (*size == cap) {
+                cap = cap ? cap * 2 : 1 << 20;
+                if ((grown = realloc(data, cap)) == NULL) {
+                    perror("realloc() error");
+                    exit(1);
+                }
+                data = grown;
+            }
+            if ((n = read(STDIN_FILENO, data + *size, cap - *size)) < 0 && errno != EINTR) {
+                perror("read() error");
+                exit(1);
+            }
+            if (n > 0) *size += n;
+        } while (n != 0);
+        return data;
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0) {
+        perror("open() error");
+        exit(1);
+    }
+    *size = st.st_size;
+    if (*size == 0) return "";
+    if ((map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        perror("mmap() error");
+        exit(1);
+    }
+    madvise(map, *size, MADV_SEQUENTIAL);
+    close(fd);
+    return map;
+}
+
+/* Mappa il file dei GP esistente in sola lettura e ne controlla l'intestazione. Ritorna la mappatura, NULL se il file non esiste.
+   Con lock diverso da 0 acquisisce anche il lock del file, che resta acquisito fino al termine del programma. */
+STORE_HEADER *map_store(int lock) {
+    STORE_HEADER *header;
+    struct stat st;
+    int fd;
+
+    if ((fd = open(STORE_FILE, O_RDONLY)) < 0) {
+        if (errno == ENOENT) return NULL;
+        perror("open() error");
+        exit(1);
+    }
+    if (lock && store_lock(fd, STORE_FILE) < 0) exit(1);
+    if (fstat(fd, &st) < 0) {
+        perror("fstat() error");
+        exit(1);
+    }
+    if (st.st_size < STORE_HEADER_SIZE || (header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+        memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) != 0 ||
+        st.st_size != STORE_HEADER_SIZE + header->capacity * sizeof(GP_SLOT)) {
+        fprintf(stderr, "File %s non valido o in un formato precedente: avviare una volta il ServerVaccinale per convertirlo\n", STORE_FILE);
+        exit(1);
+    }
+    return header;
+}
+
+/* Riapplica al nuovo indice i segmenti del log successivi al checkpoint del vecchio file, come il ripristino del ServerVaccinale.
+   Ritorna il numero del primo segmento mancante; ad added viene sommato il numero di GP aggiunti. */
+unsigned long replay_log(unsigned long segment, unsigned long *added) {
+    LOG_RECORD record;
+    GP_SLOT *slot;
+    GP_KEY key;
+    char path[64];
+    FILE *fp;
+
+    for (;; segment++) {
+        snprintf(path, sizeof(path), WAL_FILE, segment);
+        if ((fp = fopen(path, "r")) == NULL) break;
+        while (fread(&record, sizeof(LOG_RECORD), 1, fp) == 1 && record.checksum == log_checksum(&record)) {
+            record.gp.ID[ID_SIZE - 1] = 0;
+            if ((key = id_key(record.gp.ID)) == 0) continue;
+            if (record.type == 'I' || record.type == 'S') *added += import_put(key, &record.gp, 0);
+            else if (record.type == 'R' && (slot = index_probe(slots, capacity, key))->key != 0) slot->gp.report = record.gp.report;
+        }
+        fclose(fp);
+    }
+    return segment;
+}
+
+//Importa l'elenco indicato nel file dei GP della directory corrente
+void import_store(const char *path) {
+    STORE_HEADER *old, *header;
+    const char *data;
+    size_t size, old_count = 0;
+    unsigned long rows = 0, added = 0, replaced = 0, invalid = 0, skipped = 0, first_segment = 0, segment = 0, line = 1;
+    struct timespec start, end;
+    char wal_path[64];
+    struct stat st;
+    void *map;
+    int fd, i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    data = map_input(path, &size);
+    if (binary && size % PROTO_GP_SIZE != 0) {
+        fprintf(stderr, "%s: la dimensione non è un multiplo di %d byte\n", path, PROTO_GP_SIZE);
+        exit(1);
+    }
+
+    split_input(data, size);
+    run_parts(count_thread);
+    for (i = 0; i < n_threads; i++) {
+        parts[i].line = line;
+        line += parts[i].rows;
+        rows += parts[i].rows;
+    }
+    if (!binary && size > 0 && data[size - 1] != '\n') rows++;  //ultima riga senza a capo
+
+    //Il nuovo indice ha spazio per i GP esistenti, per il log non ancora applicato e per tutte le righe, sotto il 70% di carico
+    if ((old = map_store(1)) != NULL) {
+        first_segment = old->segment;
+        old_count = old->count;
+        for (segment = first_segment;; segment++) {
+            snprintf(wal_path, sizeof(wal_path), WAL_FILE, segment);
+            if (stat(wal_path, &st) < 0) break;
+            old_count += st.st_size / sizeof(LOG_RECORD);
+        }
+    }
+    for (capacity = INDEX_CAPACITY; (old_count + rows) * 10 > capacity * 7; capacity *= 2);
+
+    if ((fd = open(STORE_FILE ".tmp", O_RDWR | O_CREAT | O_TRUNC, 0666)) < 0) {
+        perror("open() error");
+        exit(1);
+    }
+    if (store_lock(fd, STORE_FILE ".tmp") < 0) exit(1);
+    if (ftruncate(fd, STORE_HEADER_SIZE + capacity * sizeof(GP_SLOT)) < 0) {
+        perror("ftruncate() error");
+        exit(1);
+    }
+    if ((map = mmap(NULL, STORE_HEADER_SIZE + capacity * sizeof(GP_SLOT), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap() error");
+        exit(1);
+    }
+    header = map;
+    slots = (GP_SLOT *)((char *)map + STORE_HEADER_SIZE);
+    if ((orders = calloc(capacity, sizeof(unsigned long))) == NULL) {
+        perror("calloc() error");
+        exit(1);
+    }
+
+    //Prima i GP esistenti e le modifiche del log, poi le righe importate, che prevalgono sui GP con la stessa tessera
+    if (old != NULL) {
+        split_slots(old->capacity);
+        for (i = 0; i < n_threads; i++) parts[i].start = (const char *)old + STORE_HEADER_SIZE;
+        run_parts(copy_thread);
+        for (i = 0; i < n_threads; i++) {
+            added += parts[i].added;
+            parts[i].added = 0;
+        }
+        segment = replay_log(first_segment, &added);
+    }
+    split_input(data, size);     //la copia dei GP esistenti ha usato start per il vecchio file
+    run_parts(import_thread);
+    split_slots(capacity);
+    run_parts(reset_thread);
+    free(orders);
+    for (i = 0; i < n_threads; i++) {
+        replaced += parts[i].replaced;
+        invalid += parts[i].invalid;
+        skipped += parts[i].skipped;
+        added += parts[i].added;
+    }
+
+    /* Il nuovo file riparte dal segmento successivo all'ultimo riapplicato, che il ServerVaccinale creerà all'avvio.
+       Come nel checkpoint, prima gli slot e poi l'intestazione. */
+    if (msync(slots, capacity * sizeof(GP_SLOT), MS_SYNC) < 0) {
+        perror("msync() error");
+        exit(1);
+    }
+    memcpy(header->magic, STORE_MAGIC, sizeof(header->magic));
+    header->capacity = capacity;
+    header->count = added;
+    header->segment = segment;
+    if (msync(header, STORE_HEADER_SIZE, MS_SYNC) < 0 || rename(STORE_FILE ".tmp", STORE_FILE) < 0) {
+        perror("rename() error");
+        exit(1);
+    }
+    sync_dir();
+    for (; first_segment < segment; first_segment++) {
+        snprintf(wal_path, sizeof(wal_path), WAL_FILE, first_segment);
+        unlink(wal_path);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    fprintf(stderr, "%lu righe importate in %.3f secondi con %d thread: %lu GP nel file, %lu sostituiti, %lu righe non valide, "
+            "%lu di altri shard\n", rows, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, n_threads, added,
+            replaced, invalid, skipped);
+}
+
+//Scrive su out tutti i GP del file dei GP della directory corrente
+void export_store(FILE *out) {
+    STORE_HEADER *header;
+    GP_SLOT *old;
+    GP_REQUEST gp;
+    DATE start_date, expire_date;
+    unsigned char record[PROTO_GP_SIZE];
+    unsigned long exported = 0;
+    unsigned int seq;
+    size_t i;
+    int fd, stable;
+    PROTO_WRITER w;
+
+    if ((header = map_store(0)) == NULL) {
+        fprintf(stderr, "File %s inesistente\n", STORE_FILE);
+        exit(1);
+    }
+    /* Se il lock è libero nessun ServerVaccinale sta usando il file, che resta fermo per tutta l'esportazione: un seqlock dispari
+       è solo il residuo di un crash (il ServerVaccinale lo ripara con store_repair al prossimo avvio) e lo slot viene letto com'è.
+       Il descrittore resta aperto, ed il lock acquisito, fino al termine del programma. */
+    stable = (fd = open(STORE_FILE, O_RDONLY)) >= 0 && flock(fd, LOCK_EX | LOCK_NB) == 0;
+    old = (GP_SLOT *)((char *)header + STORE_HEADER_SIZE);
+    madvise(old, header->capacity * sizeof(GP_SLOT), MADV_SEQUENTIAL);
+    if (!binary) fprintf(out, "# tessera,inizio,scadenza,report\n");
+
+    for (i = 0; i < header->capacity; i++) {
+        //Lettura con il seqlock, come i lettori del ServerVaccinale: con il server avviato lo slot può essere in modifica
+        if (stable) memcpy(&gp, &old[i].gp, sizeof(GP_REQUEST));
+        else do {
+            while ((seq = __atomic_load_n(&old[i].seq, __ATOMIC_ACQUIRE)) & 1);
+            memcpy(&gp, &old[i].gp, sizeof(GP_REQUEST));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        } while (__atomic_load_n(&old[i].seq, __ATOMIC_RELAXED) != seq);
+        if (gp.ID[0] == 0) continue;
+
+        if (binary) {
+            w.data = record;
+            w.cap = sizeof(record);
+            w.len = 0;
+            w.error = 0;
+            proto_put_gp(&w, &gp);
+            fwrite(record, PROTO_GP_SIZE, 1, out);
+        } else {
+            date_from_days(gp.start_day, &start_date);
+            date_from_days(gp.expire_day, &expire_date);
+            fprintf(out, "%.*s,%02d/%02d/%04d,%02d/%02d/%04d,%c\n", ID_SIZE - 1, gp.ID, start_date.day, start_date.month, start_date.year,
+                    expire_date.day, expire_date.month, expire_date.year, gp.report);
+        }
+        exported++;
+    }
+    if (fflush(out) != 0) {
+        perror("fflush() error");
+        exit(1);
+    }
+    fprintf(stderr, "%lu GP esportati\n", exported);
+}
+
+int main(int argc, char **argv) {
+    const char *import = NULL, *export = NULL, *dir = NULL, *routing = NULL;
+    char path[4096];
+    FILE *out = stdout;
+    int opt;
+
+    n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "i:e:Bd:t:r:s:")) != -1) {
+        switch (opt) {
+        case 'i':
+            import = optarg;
+            break;
+        case 'e':
+            export = optarg;
+            break;
+        case 'B':
+            binary = 1;
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+        case 'r':
+            routing = optarg;
+            break;
+        case 's':
+            shard = atoi(optarg);
+            break;
+        default:
+            import = export = NULL;
+            break;
+        }
+    }
+    if ((import == NULL) == (export == NULL)) {
+        fprintf(stderr, "usage: %s -i elenco da importare | -e file di esportazione (- per lo standard input/output) [-B formato binario] "
+                "[-d directory del ServerVaccinale] [-t thread] [-s shard da importare] [-r file di instradamento]\n", argv[0]);
+        exit(1);
+    }
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+    if (shard >= 0) {
+        if (shard_map_load(&shard_map, routing) < 0) exit(1);
+        if (shard >= shard_map.n_shards) {
+            fprintf(stderr, "Shard %d inesistente, gli shard sono %d\n", shard, shard_map.n_shards);
+            exit(1);
+        }
+    }
+    //Il file di instradamento ed i file da importare ed esportare sono relativi alla directory di avvio
+    if (export != NULL && strcmp(export, "-") != 0 && (out = fopen(export, "w")) == NULL) {
+        perror("fopen() error");
+        exit(1);
+    }
+    if (import != NULL && strcmp(import, "-") != 0 && access(import, R_OK) < 0) {
+        perror("access() error");
+        exit(1);
+    }
+    if (import != NULL && import[0] != '/' && strcmp(import, "-") != 0 && dir != NULL) {
+        if (realpath(import, path) == NULL) {
+            perror("realpath() error");
+            exit(1);
+        }
+        import = path;
+    }
+    if (dir != NULL && chdir(dir) < 0) {
+        perror("chdir() error");
+        exit(1);
+    }
+
+    if (import != NULL) import_store(import);
+    else {
+        setvbuf(out, NULL, _IOFBF, OUT_BUFFER);
+        export_store(out);
+    }
+    exit(0);
+}
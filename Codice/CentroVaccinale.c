@@ -6,34 +6,37 @@
 #include <netdb.h>     
 #include <sys/types.h>
 #include <sys/socket.h> //Libreria C per i socket.
+#include <netinet/tcp.h> // contiene l'opzione TCP_NODELAY
 #include <arpa/inet.h>  // contiene le definizioni per le operazioni Internet.
+#include <pthread.h>    // libreria C per i thread POSIX
 #include <time.h>
 #include <signal.h>     //consente l'utilizzo delle funzioni per la gestione dei segnali fra processi.
+#include "Protocollo.h" //frame e strutture condivise da tutti i programmi
+#include "Instradamento.h" //suddivisione delle tessere tra le istanze del ServerVaccinale
+#include "Metriche.h"     //latenze e contatori delle richieste esposti sulla porta di amministrazione
 
 #define MAX_SIZE 1024      //dimensione max del buf
-#define ID_SIZE 11      //dimensione del codice della tessera (10 byte + 1 byte per il terminatore)
-#define ACK_SIZE 61
+#define ADMIN_PORT 9024    //porta locale delle metriche
 
-//Pacchetto che il centro vaccinale deve ricevere dall'utente contentente nome, cognome e numero di tessera sanitaria dell'utente
+//Coda limitata dei GP da inoltrare ad un'istanza del ServerVaccinale, svuotata dal relativo thread sender
 typedef struct {
-    char name[MAX_SIZE];
-    char surname[MAX_SIZE];
-    char ID[ID_SIZE];
-} VAX_REQUEST;
-
-//Permette di salvare una data, formata dai campi: giorno, mese ed anno
-typedef struct {
-    int day;
-    int month;
-    int year;
-} DATE;
-
-//Pacchetto inviato dal centro vaccinale al serverVaccinale contentente il numero di tessera sanitaria dell'utente, la data di inizio e fine validità del GP
-typedef struct {
-    char ID[ID_SIZE];
-    DATE start_date;
-    DATE expire_date;
-} GP_REQUEST;
+    SHARD_NODE *primary;        //i GP vanno sempre al primario dello shard, che li replica
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;   //segnala al sender che ci sono GP da inviare
+    pthread_cond_t not_full;    //segnala ai thread dei client che si è liberato spazio
+    GP_REQUEST *items;          //buffer circolare di capacity elementi
+    int capacity, head, len;    //len comprende i GP inviati ed in attesa di conferma
+} GP_QUEUE;
+
+SHARD_MAP shard_map;                    //istanze del ServerVaccinale e instradamento delle tessere
+GP_QUEUE gp_queues[MAX_SHARDS];         //una coda ed un sender per ogni shard
+int queue_capacity = 1024;              //GP al più in ogni coda
+int max_batch = PROTO_MAX_ISSUE_BATCH;  //numero massimo di GP inviati con un'unica richiesta
+
+//Operazioni misurate: la registrazione di un utente ed i blocchi di GP inviati al ServerVaccinale
+enum { REQ_ANSWER_USER, REQ_SEND_GP_BATCH, N_REQ };
+const char *const req_names[N_REQ] = {"answer_user", "send_GP_batch"};
+METRICS metrics;
 
 //Legge esattamente count byte s iterando opportunamente le letture. Legge anche se viene interrotta da una System Call.
 ssize_t full_read(int fd, void *buf, size_t count) {
@@ -44,7 +47,7 @@ ssize_t full_read(int fd, void *buf, size_t count) {
         if ((nread = read(fd, buf, nleft)) < 0) {
             if (errno == EINTR) 
             continue; // Se si verifica una System Call che interrompe ripeti il ciclo
-            else exit(nread);
+            else return -1; //Le connessioni sono gestite da thread: un errore non deve terminare il centro vaccinale
         } else if (nread == 0) break; // Se sono finiti, esci
         nleft -= nread;
         buf += nread;
@@ -63,7 +66,7 @@ ssize_t full_write(int fd, const void *buf, size_t count) {
         if ((nwritten = write(fd, buf, nleft)) < 0) {
             if (errno == EINTR) 
             continue; //Se si verifica una System Call che interrompe ripeti il ciclo
-            else exit(nwritten); //Se non è una System Call, esci con un errore
+            else return -1; //Se non è una System Call, ritorna un errore
         }
         nleft -= nwritten;
         buf += nwritten;
@@ -83,167 +86,321 @@ void handler (int sign){
     }
 }
 
-//Funzione per calcolare la data di scadenza e la data di inizio validità del green pass
-void create_expire_date(DATE *expire_date) {
-    time_t ticks;   //struttura per la gestione della data
-    ticks = time(NULL); //Estrapoliamo l'ora esatta della macchina e lo assegnamo alla variabile
+/* Calcola i giorni di inizio e fine validità del green pass, con un'unica lettura dell'ora della macchina. Il GP è valido dal giorno
+   di emissione per 3 mesi: la scadenza è lo stesso giorno 3 mesi dopo, o l'ultimo giorno del mese se più corto (es. 30/11 -> 28/02). */
+void create_validity(GP_REQUEST *gp) {
+    time_t ticks = time(NULL);   //Estrapoliamo l'ora esatta della macchina
+    struct tm tm_date;
+    DATE start_date, expire_date;
+
+    localtime_r(&ticks, &tm_date); //localtime_r perché più client vengono serviti contemporaneamente
+    start_date.day = tm_date.tm_mday;
+    start_date.month = tm_date.tm_mon + 1;      //Sommiamo 1 perchè i mesi vanno da 0 ad 11
+    start_date.year = tm_date.tm_year + 1900;   //Sommiamo 1900 perchè gli anni partono dal 1900
+
+    //Sommiamo 3 mesi: da ottobre, novembre e dicembre si passa all'anno successivo
+    expire_date.month = (start_date.month + 2) % 12 + 1;
+    expire_date.year = start_date.year + (start_date.month > 9);
+    expire_date.day = start_date.day;
+    if (expire_date.day > days_in_month(expire_date.month, expire_date.year)) expire_date.day = days_in_month(expire_date.month, expire_date.year);
+
+    printf("La data di inizio validità del green pass e': %02d/%02d/%04d\n", start_date.day, start_date.month, start_date.year);
+    printf("La data di scadenza del green pass e': %02d/%02d/%04d\n", expire_date.day, expire_date.month, expire_date.year);
+
+    gp->start_day = days_from_date(&start_date);
+    gp->expire_day = days_from_date(&expire_date);
+}
 
-    //Dichiarazione strutture per la conversione della data da stringa ad intero
-    struct tm *e_date = localtime(&ticks);
-    e_date->tm_mon += 4;           //Sommiamo 4 perchè i mesi vanno da 0 ad 11 (cioè 3 mesi di scadenza)
-    e_date->tm_year += 1900;       //Sommiamo 1900 perchè gli anni partono dal 122 (2022 - 1900)
+//Apre la connessione persistente verso un'istanza del ServerVaccinale. Ritorna il descrittore, -1 se l'istanza non è raggiungibile.
+int backend_connect(SHARD_NODE *node) {
+    int socket_fd, enable = 1;
 
-    //Effettuiamo il controllo nel caso in cui il vaccino sia stato fatto nel mese di ottobre, novembre o dicembre, comportando un aumento dell'anno
-    if (e_date->tm_mon == 13) { //if 13 è ottobre quindi si incrementano 3 mesi, arrivando a gennaio dell'anno successivo
-        e_date->tm_mon = 1;
-        e_date->tm_year++;
-    }
-    if (e_date->tm_mon == 14) { //if 14 è novembre quindi si incrementano 3 mesi, arrivando a febbraio dell'anno successivo
-        e_date->tm_mon = 2;
-        e_date->tm_year++;
-    }
-    if (e_date->tm_mon == 15) { //if 15 è dicembre quindi si incrementano 3 mesi, arrivando a marzo dell'anno successivo
-        e_date->tm_mon = 3;
-        e_date->tm_year++;
+    //Creazione del descrittore del socket
+    if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket() error");
+        return -1;
     }
 
-    printf("La data di scadenza del green pass e': %02d:%02d:%02d\n", e_date->tm_mday, e_date->tm_mon, e_date->tm_year);
+    //I blocchi vanno inviati subito, senza attendere l'algoritmo di Nagle
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
 
-    //Assegna i valori ai parametri di ritorno
-    expire_date->day = e_date->tm_mday ;
-    expire_date->month = e_date->tm_mon;
-    expire_date->year = e_date->tm_year;
+    //Effettua connessione con il server, l'indirizzo è stato risolto al caricamento del file di instradamento
+    if (connect(socket_fd, (struct sockaddr *)&node->addr, sizeof(node->addr)) < 0) {
+        fprintf(stderr, "connect() error: %s:%d: %s\n", node->host, node->port, strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
 }
 
-//Funzione per calcolare la data di inizio validità del GP, cioè la data esatta in cui il certificato viene emesso
-void create_start_date(DATE *start_date) {
-    time_t ticks;
-    ticks = time(NULL);
-
-    //Dichiarazione strutture per la conversione della data da stringa ad intero
-    struct tm *s_date = localtime(&ticks);
-    s_date->tm_mon += 1;           //Sommiamo 1 perchè i mesi vanno da 0 ad 11
-    s_date->tm_year += 1900;       //Sommiamo 1900 perchè gli anni partono dal 122 (2022 - 1900)
-
-    printf("La data di inizio validità del green pass e': %02d:%02d:%02d\n", s_date->tm_mday, s_date->tm_mon, s_date->tm_year);
+/* Invia un blocco di GP al ServerVaccinale ed attende la conferma del salvataggio.
+   Ritorna 0 se il blocco è stato salvato, -1 se la connessione è caduta, 1 se il ServerVaccinale non ha potuto salvarlo. */
+int send_GP_batch(int socket_fd, unsigned int req_id, GP_REQUEST *gp, int count) {
+    unsigned char frame[PROTO_HEADER_SIZE + 2 + PROTO_MAX_ISSUE_BATCH * PROTO_GP_SIZE];
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    int i;
+
+    //Il tipo MSG_GP_ISSUE_BATCH indica che la comunicazione avviene con il CentroVaccinale
+    proto_begin(&w, frame, sizeof(frame), MSG_GP_ISSUE_BATCH, req_id);
+    proto_put_u16(&w, count);
+    for (i = 0; i < count; i++) proto_put_gp(&w, &gp[i]);
+    if (proto_send(socket_fd, &w) < 0) {
+        perror("full_write() error");
+        return -1;
+    }
 
-    //Assegnamo i valori ai parametri di ritorno
-    start_date->day = s_date->tm_mday ;
-    start_date->month = s_date->tm_mon;
-    start_date->year = s_date->tm_year;
+    //Il ServerVaccinale risponde quando tutti i green pass del blocco sono stati salvati
+    if (proto_recv(socket_fd, &h, frame, sizeof(frame)) < 0 || h.type != MSG_RESULT || h.req_id != req_id) {
+        perror("full_read() error");
+        return -1;
+    }
+    return (h.length > 0 && frame[0] == '0') ? 0 : 1;
 }
 
-//Funzione che invia al ServerVaccinale un GP con data inizio e fini validità e ID
-void send_GP(GP_REQUEST gp) {
-    int socket_fd;
-    struct sockaddr_in server_addr;
-    char start_bit, buf[MAX_SIZE];
+/* Thread sender: svuota la coda inviando i GP a blocchi su un'unica connessione persistente. Mentre attende la conferma di un blocco
+   i nuovi GP si accumulano nella coda e partono tutti insieme nel blocco successivo. I GP restano nella coda finché il ServerVaccinale
+   non ne conferma il salvataggio: se il ServerVaccinale rallenta la coda si riempie ed i client attendono in enqueue_GP.
+   Ogni shard ha la propria coda, quindi un'istanza lenta o non raggiungibile non blocca i GP destinati alle altre. */
+void *sender_thread(void *arg) {
+    GP_QUEUE *queue = arg;
+    GP_REQUEST batch[PROTO_MAX_ISSUE_BATCH];
+    unsigned int req_id = 0;
+    int socket_fd = -1, count, i, result;
+    long start;
 
-    start_bit = '1'; //Inizializziamo il bit a 1 da inviare al ServerVaccinale
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->len == 0) pthread_cond_wait(&queue->not_empty, &queue->lock);
+        count = queue->len < max_batch ? queue->len : max_batch;
+        for (i = 0; i < count; i++) batch[i] = queue->items[(queue->head + i) % queue->capacity];
+        pthread_mutex_unlock(&queue->lock);
+
+        //Il blocco viene ripetuto finché non è stato salvato: il ServerVaccinale sostituisce i GP già presenti
+        for (;;) {
+            if (socket_fd < 0 && (socket_fd = backend_connect(queue->primary)) < 0) {
+                sleep(1);
+                continue;
+            }
+            start = metric_start(&metrics, REQ_SEND_GP_BATCH);
+            result = send_GP_batch(socket_fd, req_id++, batch, count);
+            metric_end(&metrics, REQ_SEND_GP_BATCH, start, result != 0);
+            if (result == 0) break;
+            if (result < 0) {
+                close(socket_fd);
+                socket_fd = -1;
+            }
+            printf("ServerVaccinale %s:%d non disponibile, nuovo tentativo tra 1 secondo\n", queue->primary->host, queue->primary->port);
+            sleep(1);
+        }
 
-    //Creazione del descrittore del socket
-    if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket() error");
-        exit(1);
+        //Solo ora i GP lasciano la coda e liberano spazio per i client in attesa
+        pthread_mutex_lock(&queue->lock);
+        queue->head = (queue->head + count) % queue->capacity;
+        queue->len -= count;
+        pthread_cond_broadcast(&queue->not_full);
+        pthread_mutex_unlock(&queue->lock);
     }
+    return NULL;
+}
 
-    //Valorizzazione struttura
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(1025); //porta
+//Accoda il nuovo GP per il sender dello shard della tessera. Se la coda è piena attende che lo shard abbia salvato i GP precedenti.
+void enqueue_GP(GP_REQUEST *gp) {
+    GP_QUEUE *queue = &gp_queues[shard_of(&shard_map, gp->ID)];
 
-    //Conversione dell'indirizzo IP dal formato dotted decimal a stringa di bit
-    if (inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr) <= 0) {
-        perror("inet_pton() error");
-        exit(1);
-    }
+    pthread_mutex_lock(&queue->lock);
+    while (queue->len == queue->capacity) pthread_cond_wait(&queue->not_full, &queue->lock);
+    queue->items[(queue->head + queue->len) % queue->capacity] = *gp;
+    queue->len++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
 
-    //Effettua connessione con il server
-    if (connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect() error");
-        exit(1);
-    }
+//Invia un messaggio di testo all'utente, il frame occupa solo i byte del testo. Ritorna -1 in caso di errore.
+int send_text(int connect_fd, unsigned int type, unsigned int req_id, const char *text) {
+    size_t size = PROTO_HEADER_SIZE + strlen(text);
+    unsigned char *frame;
+    PROTO_WRITER w;
+    int result;
 
-    //Invia un bit di valore 1 al ServerVaccinale per informarlo che la comunicazione deve avvenire con il CentroVaccinale
-    if (full_write(socket_fd, &start_bit, sizeof(char)) < 0) {
-        perror("full_write() error");
-        exit(1);
+    if ((frame = malloc(size)) == NULL) {
+        perror("malloc() error");
+        return -1;
     }
+    proto_begin(&w, frame, size, type, req_id);
+    proto_put_text(&w, text);
+    if((result = proto_send(connect_fd, &w)) < 0) perror("full_write() error");
+    free(frame);
+    return result;
+}
 
-    //Inviamo il green pass al ServerVaccinale
-    if (full_write(socket_fd, &gp, sizeof(gp)) < 0) {
-        perror("full_write() error");
-        exit(1);
+/* Legge nome o cognome dalla richiesta dell'utente senza copiarlo. Dalla versione 2 sono preceduti dalla loro lunghezza,
+   nei frame della versione 1 occupano invece NAME_SIZE - 1 byte completati con zeri */
+const char *get_name(PROTO_READER *r, unsigned int version, int *len) {
+    const char *name;
+    size_t n;
+
+    if (version >= 2) {
+        name = proto_get_lstring(r, &n);
+    } else {
+        if (r->off + NAME_SIZE - 1 > r->len) {
+            r->error = 1;
+            *len = 0;
+            return "";
+        }
+        name = (const char *)r->data + r->off;
+        n = strnlen(name, NAME_SIZE - 1);
+        r->off += NAME_SIZE - 1;
     }
-
-    close(socket_fd);
+    *len = n;
+    return name;
 }
 
     //Funzione per la gestione della comunicazione con l'utente
 void answer_user(int connect_fd) {
     char *hub_name[] = {"Milano", "Napoli", "Roma", "Torino", "Firenze", "Palermo", "Bari", "Catanzaro", "Bologna", "Udine"}; //Centri Vaccinali scelti randomicamente
     char buf[MAX_SIZE];
-    int index, welcome_size, package_size;
-    VAX_REQUEST package;
+    unsigned char *payload;
+    const char *name, *surname;
+    char ID[ID_SIZE];
+    int index, name_len, surname_len;
+    long start;
     GP_REQUEST gp;
+    FRAME_HEADER h;
+    PROTO_READER r;
 
     //Scegliamo un centro vaccinale casuale
-    srand(time(NULL));
     index = rand() % 10;
 
     //Stampa un messaggo di benvenuto da inviare all'utente quando si collega al centro vaccinale.
     snprintf(buf, MAX_SIZE, "*Benvenuto nel centro vaccinale di %s***\nInserisci nome, cognome e numero di tessera sanitaria.\n", hub_name[index]);
-    welcome_size = sizeof(buf);
-    //Invia i byte di scrittura del buf
-    if(full_write(connect_fd, &welcome_size, sizeof(int)) < 0) {
-        perror("full_write() error");
-        exit(1);
-    }
-    //Invio del benvenuto
-    if(full_write(connect_fd, buf, welcome_size) < 0) {
-        perror("full_write() error");
-        exit(1);
-    }
+    //Invio del benvenuto, viaggiano solo i caratteri del messaggio e la lunghezza è indicata nell'intestazione del frame
+    if (send_text(connect_fd, MSG_WELCOME, 0, buf) < 0) return;
 
-    //Riceviamo le informazioni per il GreenPass dall'Utente
-    if(full_read(connect_fd, &package, sizeof(VAX_REQUEST)) < 0) {
+    //Riceviamo le informazioni per il GreenPass dall'Utente, il payload viene allocato della sua dimensione reale
+    if((payload = proto_recv_alloc(connect_fd, &h, PROTO_VAX_REQUEST_MAX)) == NULL) {
         perror("full_read() error");
-        exit(1);
+        return;
+    }
+    //La latenza della registrazione va dalla richiesta dell'utente all'invio dell'ack, compresa l'attesa di spazio nella coda
+    start = metric_start(&metrics, REQ_ANSWER_USER);
+    proto_reader(&r, payload, h.length);
+    name = get_name(&r, h.version, &name_len);
+    surname = get_name(&r, h.version, &surname_len);
+    proto_get_ID(&r, ID);
+    if (h.type != MSG_VAX_REQUEST || r.error) {
+        printf("Richiesta non valida\n");
+        free(payload);
+        metric_end(&metrics, REQ_ANSWER_USER, start, 1);
+        return;
+    }
+    //Solo le tessere alfanumeriche possono essere salvate dal ServerVaccinale: le altre vengono rifiutate prima di emettere il GP
+    if (id_key(ID) == 0) {
+        printf("Numero tessera sanitaria non valido: %s\n", ID);
+        free(payload);
+        send_text(connect_fd, MSG_ACK, h.req_id, "Numero tessera sanitaria non valido, servono 10 lettere o cifre");
+        metric_end(&metrics, REQ_ANSWER_USER, start, 1);
+        return;
     }
 
     printf("\nDati ricevuti\n");
-    printf("Nome: %s\n", package.name);
-    printf("Cognome: %s\n", package.surname);
-    printf("Numero Tessera Sanitaria: %s\n\n", package.ID);
+    printf("Nome: %.*s\n", name_len, name);
+    printf("Cognome: %.*s\n", surname_len, surname);
+    printf("Numero Tessera Sanitaria: %s\n\n", ID);
+    free(payload);
+
+    memset(&gp, 0, sizeof(GP_REQUEST));
+    strcpy(gp.ID, ID);
+    create_validity(&gp);
+
+    //Il nuovo Green Pass viene accodato per il ServerVaccinale: l'utente attende solo se la coda è piena
+    enqueue_GP(&gp);
 
     //Notifica all'utente la corretta ricezione dei dati che aveva inviato.
-    snprintf(buf, ACK_SIZE, "I tuoi dati sono stati correttamente inseriti in piattaforma");
-    if(full_write(connect_fd, buf, ACK_SIZE) < 0) {
-        perror("full_write() error");
-        exit(1);
-    }
+    metric_end(&metrics, REQ_ANSWER_USER, start, send_text(connect_fd, MSG_ACK, h.req_id, "I tuoi dati sono stati correttamente inseriti in piattaforma") < 0);
+}
 
-    strcpy(gp.ID, package.ID);
-    create_start_date(&gp.start_date);
-    create_expire_date(&gp.expire_date);
+//Thread che gestisce la connessione di un utente. Sostituisce il figlio della fork: così tutti i client condividono la coda verso il ServerVaccinale
+void *client_thread(void *arg) {
+    int connect_fd = (int)(long)arg;
 
-    close(connect_fd);
+    //Riceve informazioni dall'utente
+    answer_user(connect_fd);
 
-    //Manda il nuovo Green Pass al CentroVaccinale
-    send_GP(gp);
+    close(connect_fd);
+    return NULL;
 }
 
-int main(int argc, char const *argv[]) {
-    int listen_fd, connect_fd;
+int main(int argc, char **argv) {
+    int listen_fd, connect_fd, opt, i, enable = 1, admin_port = ADMIN_PORT;
     VAX_REQUEST package;
     struct sockaddr_in serv_addr;
-    pid_t pid;
+    const char *routing = NULL;
+    pthread_t tid;
     signal(SIGINT,handler); //Cattura il segnale
+    signal(SIGPIPE, SIG_IGN); //Un utente che chiude la connessione durante una write non deve terminare il centro vaccinale
+
+    while ((opt = getopt(argc, argv, "q:b:r:a:")) != -1) {
+        switch (opt) {
+        case 'q':
+            queue_capacity = atoi(optarg);
+            break;
+        case 'r':
+            routing = optarg;
+            break;
+        case 'b':
+            max_batch = atoi(optarg);
+            break;
+        case 'a':
+            admin_port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-q GP nella coda verso ogni istanza del ServerVaccinale] [-b GP per blocco]"
+                    " [-r file di instradamento, predefinito " SHARD_CONFIG "] [-a porta delle metriche, 0 per disattivarle]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (queue_capacity < 1) queue_capacity = 1;
+    if (max_batch < 1) max_batch = 1;
+    if (max_batch > PROTO_MAX_ISSUE_BATCH) max_batch = PROTO_MAX_ISSUE_BATCH;
+    srand(time(NULL));
+
+    if (shard_map_load(&shard_map, routing) < 0) exit(1);
+
+    //Le metriche sono esposte solo sulla macchina locale: il centro vaccinale funziona anche se la porta non è disponibile
+    metrics_init(&metrics, req_names, N_REQ);
+    if (admin_port > 0) metrics_listen(&metrics, admin_port);
+
+    //I GP vengono inoltrati ad ogni istanza del ServerVaccinale da un unico thread su una connessione persistente
+    for (i = 0; i < shard_map.n_shards; i++) {
+        pthread_mutex_init(&gp_queues[i].lock, NULL);
+        pthread_cond_init(&gp_queues[i].not_empty, NULL);
+        pthread_cond_init(&gp_queues[i].not_full, NULL);
+        gp_queues[i].primary = &shard_map.shards[i].nodes[0];
+        gp_queues[i].capacity = queue_capacity;
+        if ((gp_queues[i].items = malloc(queue_capacity * sizeof(GP_REQUEST))) == NULL) {
+            perror("malloc() error");
+            exit(1);
+        }
+        if (pthread_create(&tid, NULL, sender_thread, &gp_queues[i]) != 0) {
+            perror("pthread_create() error");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+
     //Creazione del socket
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket() error");
         exit(1);
     }
 
+    //Permette di riavviare il centro vaccinale senza attendere il TIME_WAIT delle connessioni precedenti
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt() error");
+        exit(1);
+    }
+
     //Valorizzazione strutture
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -267,25 +424,18 @@ int main(int argc, char const *argv[]) {
 
         //Accetta una nuova connessione
         if ((connect_fd = accept(listen_fd, (struct sockaddr *)NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
             perror("accept() error");
             exit(1);
         }
 
-        //Creazione del figlio;
-        if ((pid = fork()) < 0) {
-            perror("fork() error");
-            exit(1);
-        }
-
-        if (pid == 0) {
-            close(listen_fd);
-
-            //Riceve informazioni dall'utente
-            answer_user(connect_fd);
-
+        //Creazione del thread che gestisce l'utente
+        if (pthread_create(&tid, NULL, client_thread, (void *)(long)connect_fd) != 0) {
+            perror("pthread_create() error");
             close(connect_fd);
-            exit(0);
-        } else close(connect_fd);
+            continue;
+        }
+        pthread_detach(tid);
     }
     exit(0);
 }
@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>      // libreria C per la gestione delle situazioni di errore.
+#include <string.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h> //Libreria C per i socket.
+#include <netinet/tcp.h> // contiene l'opzione TCP_NODELAY
+#include <arpa/inet.h>  // contiene le definizioni per le operazioni Internet.
+#include <pthread.h>    // libreria C per i thread POSIX
+#include <time.h>
+#include "Protocollo.h" //frame e strutture condivise da tutti i programmi
+
+/*
+    Generatore di carico per l'intero sistema GreenPass. Ogni thread esegue in ciclo operazioni scelte a caso secondo le proporzioni
+    indicate, parlando direttamente il protocollo dei server senza input da tastiera né attese:
+        registrazione   Utente -> CentroVaccinale (porta 1024)
+        verifica        AppVerifica -> ServerVerifica (porta 1026)
+        report ASL      ASL -> ServerVerifica (porta 1026)
+    Ogni operazione apre la propria connessione, come i client reali. Al termine vengono stampate per ogni operazione
+    le operazioni al secondo e le latenze p50, p99 e p999.
+*/
+
+#define MAX_SIZE 1024       //dimensione max del buf
+#define MAX_THREADS 1024    //numero massimo di thread
+#define N_OPS 3             //tipi di operazione
+#define OP_REGISTRATION 0
+#define OP_SCAN 1
+#define OP_REPORT 2
+
+//Latenze misurate per un tipo di operazione, in nanosecondi
+typedef struct {
+    unsigned long *latency;
+    size_t len, cap;
+    unsigned long errors;   //connessioni fallite o risposte non valide
+} OP_STATS;
+
+//Stato di un thread del generatore
+typedef struct {
+    pthread_t tid;
+    unsigned int seed;      //seme di rand_r, ogni thread ha il proprio
+    OP_STATS stats[N_OPS];
+    unsigned long scan_results[4]; //esiti delle verifiche: '0' non valido, '1' valido, '2' inesistente, '3' servizio non disponibile
+} LOAD_THREAD;
+
+const char *op_name[N_OPS] = {"registrazione", "verifica", "report ASL"};
+LOAD_THREAD threads[MAX_THREADS];
+struct in_addr server_ip;
+int n_threads = 8;
+int duration = 10;          //secondi di durata della prova
+long n_operations = 0;      //operazioni per thread, se diverso da 0 sostituisce la durata
+int weight[N_OPS] = {10, 80, 10}; //proporzioni tra registrazioni, verifiche e report ASL
+int n_IDs = 10000;          //numero di tessere diverse utilizzate
+long end_ns;
+
+/* Legge esattamente count byte s iterando opportunamente le letture. Legge anche se viene interrotta da una System Call.
+   Usata da proto_recv di Protocollo.h, che la lascia definire al programma: qui un errore ritorna -1 invece di terminare. */
+ssize_t full_read(int fd, void *buf, size_t count) {
+    size_t nleft;
+    ssize_t nread;
+    nleft = count;
+    while (nleft > 0) {  // ripeti finchè non ci sono left
+        if ((nread = read(fd, buf, nleft)) < 0) {
+            if (errno == EINTR)
+            continue; // Se si verifica una System Call che interrompe ripeti il ciclo
+            else return -1; //Un errore su una connessione conta come operazione fallita, non deve terminare il generatore
+        } else if (nread == 0) break; // Se sono finiti, esci
+        nleft -= nread;
+        buf += nread;
+    }
+    buf = 0;
+    return nleft;
+}
+
+
+//Scrive esattamente count byte s iterando opportunamente le scritture. Scrive anche se viene interrotta da una System Call. Usata da proto_send.
+ssize_t full_write(int fd, const void *buf, size_t count) {
+    size_t nleft;
+    ssize_t nwritten;
+    nleft = count;
+    while (nleft > 0) {          //repeat finchè non ci sono left
+        if ((nwritten = write(fd, buf, nleft)) < 0) {
+            if (errno == EINTR) continue; //Se si verifica una System Call che interrompe ripeti il ciclo
+            else return -1; //Se non è una System Call, ritorna un errore
+        }
+        nleft -= nwritten;
+        buf += nwritten;
+    }
+    buf = 0;
+    return nleft;
+}
+
+//Istante corrente in nanosecondi, usato per misurare le latenze
+long now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//Apre una connessione verso la porta indicata. Ritorna il descrittore, -1 in caso di errore.
+int connect_to(int port) {
+    int socket_fd, enable = 1;
+    struct sockaddr_in server_addr;
+
+    if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) return -1;
+
+    //I messaggi sono piccoli e vanno inviati subito, senza attendere l'algoritmo di Nagle
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    //Valorizzazione struttura
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    server_addr.sin_addr = server_ip;
+
+    if (connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/* Chiude una connessione dopo l'ultima risposta. La shutdown segnala al server che non arriveranno altre richieste ed il server chiude
+   a sua volta: attendendo la sua chiusura il TIME_WAIT resta al server, altrimenti ad alto carico il generatore esaurirebbe le porte locali. */
+void disconnect(int fd) {
+    char c;
+
+    shutdown(fd, SHUT_WR);
+    while (read(fd, &c, 1) > 0);
+    close(fd);
+}
+
+//Riceve un frame del tipo atteso. Ritorna 0 se il frame è stato ricevuto, -1 altrimenti.
+int expect(int fd, unsigned char type, FRAME_HEADER *h, unsigned char *payload) {
+    if (proto_recv(fd, h, payload, MAX_SIZE) < 0) return -1;
+    return h->type == type ? 0 : -1;
+}
+
+//Registrazione di una tessera presso il CentroVaccinale, come Utente. Ritorna 0 se la registrazione è stata confermata.
+int do_registration(const char ID[]) {
+    unsigned char buf[MAX_SIZE], request[PROTO_HEADER_SIZE + PROTO_VAX_REQUEST_MAX];
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    int fd;
+
+    proto_begin(&w, request, sizeof(request), MSG_VAX_REQUEST, 1);
+    proto_put_lstring(&w, "Carico", NAME_SIZE - 1);
+    proto_put_lstring(&w, "Generatore", NAME_SIZE - 1);
+    proto_put_ID(&w, ID);
+
+    if ((fd = connect_to(1024)) < 0) return -1;
+    if (expect(fd, MSG_WELCOME, &h, buf) < 0 || proto_send(fd, &w) < 0 || expect(fd, MSG_ACK, &h, buf) < 0) {
+        close(fd);
+        return -1;
+    }
+    disconnect(fd);
+    return 0;
+}
+
+//Verifica di una tessera presso il ServerVerifica, come AppVerifica. Ritorna l'esito ricevuto, -1 in caso di errore.
+int do_scan(const char ID[]) {
+    unsigned char buf[MAX_SIZE], hello[PROTO_HEADER_SIZE + 1], scan[PROTO_HEADER_SIZE + PROTO_ID_SIZE];
+    FRAME_HEADER h;
+    PROTO_WRITER w_hello, w_scan;
+    int fd;
+
+    proto_begin(&w_hello, hello, sizeof(hello), MSG_HELLO, 0);
+    proto_put_u8(&w_hello, ROLE_APP_VERIFICA);
+    proto_begin(&w_scan, scan, sizeof(scan), MSG_SCAN, 1);
+    proto_put_ID(&w_scan, ID);
+
+    if ((fd = connect_to(1026)) < 0) return -1;
+    if (proto_send(fd, &w_hello) < 0 || expect(fd, MSG_WELCOME, &h, buf) < 0 || proto_send(fd, &w_scan) < 0 ||
+        expect(fd, MSG_ACK, &h, buf) < 0 || expect(fd, MSG_RESULT, &h, buf) < 0 || h.length < 1) {
+        close(fd);
+        return -1;
+    }
+    disconnect(fd);
+    return buf[0];
+}
+
+//Modifica del report di una tessera presso il ServerVerifica, come ASL. Ritorna 0 se la risposta è arrivata.
+int do_report(const char ID[], char report) {
+    unsigned char buf[MAX_SIZE], request[PROTO_HEADER_SIZE + PROTO_ID_SIZE + 1];
+    FRAME_HEADER h;
+    PROTO_WRITER w;
+    int fd;
+
+    proto_begin(&w, request, sizeof(request), MSG_REPORT_UPDATE, 0);
+    proto_put_ID(&w, ID);
+    proto_put_u8(&w, report);
+
+    if ((fd = connect_to(1026)) < 0) return -1;
+    if (proto_send(fd, &w) < 0 || expect(fd, MSG_RESULT, &h, buf) < 0) {
+        close(fd);
+        return -1;
+    }
+    disconnect(fd);
+    return 0;
+}
+
+//Aggiunge una latenza alle statistiche dell'operazione
+void record_latency(OP_STATS *stats, unsigned long latency) {
+    unsigned long *grown;
+
+    if (stats->len == stats->cap) {
+        stats->cap = stats->cap ? stats->cap * 2 : 4096;
+        if ((grown = realloc(stats->latency, stats->cap * sizeof(unsigned long))) == NULL) {
+            perror("realloc() error");
+            exit(1);
+        }
+        stats->latency = grown;
+    }
+    stats->latency[stats->len++] = latency;
+}
+
+//Ciclo di un thread: sceglie un'operazione ed una tessera a caso, la esegue e ne misura la latenza
+void *load_thread(void *arg) {
+    LOAD_THREAD *t = arg;
+    char ID[ID_SIZE];
+    int op, pick, total = weight[0] + weight[1] + weight[2], result;
+    long i, start;
+
+    for (i = 0; n_operations > 0 ? i < n_operations : now_ns() < end_ns; i++) {
+        pick = rand_r(&t->seed) % total;
+        for (op = 0; pick >= weight[op]; op++) pick -= weight[op];
+        snprintf(ID, ID_SIZE, "GC%08u", (unsigned int)rand_r(&t->seed) % n_IDs % 100000000U); //tessere di 10 caratteri
+
+        start = now_ns();
+        if (op == OP_REGISTRATION) result = do_registration(ID);
+        else if (op == OP_SCAN) result = do_scan(ID);
+        else result = do_report(ID, rand_r(&t->seed) % 4 == 0 ? '0' : '1'); //un report su quattro sospende il GP
+
+        if (result < 0) {
+            t->stats[op].errors++;
+            continue;
+        }
+        record_latency(&t->stats[op], now_ns() - start);
+        if (op == OP_SCAN && result >= '0' && result <= '3') t->scan_results[result - '0']++;
+    }
+    return NULL;
+}
+
+int compare_latency(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return x < y ? -1 : x > y;
+}
+
+//Percentile p (tra 0 ed 1) di un vettore ordinato di latenze, in microsecondi
+double percentile(OP_STATS *stats, double p) {
+    size_t index;
+
+    if (stats->len == 0) return 0;
+    index = (size_t)(p * stats->len);
+    if (index >= stats->len) index = stats->len - 1;
+    return stats->latency[index] / 1000.0;
+}
+
+//Stampa una riga della tabella dei risultati
+void print_stats(const char *name, OP_STATS *stats, double elapsed) {
+    qsort(stats->latency, stats->len, sizeof(unsigned long), compare_latency);
+    printf("%-14s %10zu %8lu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, stats->len, stats->errors, stats->len / elapsed,
+           percentile(stats, 0.50), percentile(stats, 0.99), percentile(stats, 0.999),
+           stats->len ? stats->latency[stats->len - 1] / 1000.0 : 0);
+}
+
+//Unisce le statistiche di un'operazione di tutti i thread in all
+void merge_stats(OP_STATS *all, int op) {
+    int i;
+
+    memset(all, 0, sizeof(OP_STATS));
+    for (i = 0; i < n_threads; i++) {
+        all->errors += threads[i].stats[op].errors;
+        all->cap += threads[i].stats[op].len;
+    }
+    if ((all->latency = malloc((all->cap ? all->cap : 1) * sizeof(unsigned long))) == NULL) {
+        perror("malloc() error");
+        exit(1);
+    }
+    for (i = 0; i < n_threads; i++) {
+        memcpy(all->latency + all->len, threads[i].stats[op].latency, threads[i].stats[op].len * sizeof(unsigned long));
+        all->len += threads[i].stats[op].len;
+    }
+}
+
+int main(int argc, char **argv) {
+    int opt, i, op;
+    const char *host = "127.0.0.1";
+    struct hostent *data; //struttura per utilizzare la gethostbyname
+    unsigned long results[4] = {0};
+    OP_STATS all[N_OPS], total;
+    double elapsed;
+    long start;
+
+    while ((opt = getopt(argc, argv, "t:d:n:m:k:h:")) != -1) {
+        switch (opt) {
+        case 't':
+            n_threads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'n':
+            n_operations = atol(optarg);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d", &weight[0], &weight[1], &weight[2]) != 3) {
+                fprintf(stderr, "proporzioni non valide: %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 'k':
+            n_IDs = atoi(optarg);
+            break;
+        case 'h':
+            host = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-t thread] [-d secondi] [-n operazioni per thread] [-m registrazioni:verifiche:report]"
+                    " [-k numero tessere] [-h host]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (n_threads < 1) n_threads = 1;
+    if (n_threads > MAX_THREADS) n_threads = MAX_THREADS;
+    if (n_IDs < 1 || n_IDs > 100000000) n_IDs = 10000;
+    if (weight[0] < 0 || weight[1] < 0 || weight[2] < 0 || weight[0] + weight[1] + weight[2] == 0) {
+        fprintf(stderr, "le proporzioni devono essere positive\n");
+        exit(1);
+    }
+
+    //Conversione dal nome al dominio a indirizzo IP
+    if ((data = gethostbyname(host)) == NULL) {
+        herror("gethostbyname() error");
+        exit(1);
+    }
+    memcpy(&server_ip, data->h_addr_list[0], sizeof(server_ip));
+
+    printf("%d thread, %s %ld, proporzioni %d:%d:%d, %d tessere\n", n_threads, n_operations ? "operazioni per thread" : "secondi",
+           n_operations ? n_operations : duration, weight[0], weight[1], weight[2], n_IDs);
+
+    start = now_ns();
+    end_ns = start + duration * 1000000000L;
+    for (i = 0; i < n_threads; i++) {
+        threads[i].seed = time(NULL) ^ (i * 2654435761U);
+        if (pthread_create(&threads[i].tid, NULL, load_thread, &threads[i]) != 0) {
+            perror("pthread_create() error");
+            exit(1);
+        }
+    }
+    for (i = 0; i < n_threads; i++) pthread_join(threads[i].tid, NULL);
+    elapsed = (now_ns() - start) / 1e9;
+
+    //Tabella dei risultati, latenze in microsecondi
+    printf("\n%-14s %10s %8s %10s %10s %10s %10s %10s\n", "operazione", "completate", "errori", "ops/s", "p50(us)", "p99(us)", "p999(us)", "max(us)");
+    memset(&total, 0, sizeof(OP_STATS));
+    for (op = 0; op < N_OPS; op++) {
+        merge_stats(&all[op], op);
+        total.errors += all[op].errors;
+        total.cap += all[op].len;
+    }
+    if ((total.latency = malloc((total.cap ? total.cap : 1) * sizeof(unsigned long))) == NULL) {
+        perror("malloc() error");
+        exit(1);
+    }
+    for (op = 0; op < N_OPS; op++) {
+        memcpy(total.latency + total.len, all[op].latency, all[op].len * sizeof(unsigned long));
+        total.len += all[op].len;
+        print_stats(op_name[op], &all[op], elapsed);
+    }
+    print_stats("totale", &total, elapsed);
+
+    for (i = 0; i < n_threads; i++)
+        for (op = 0; op < 4; op++) results[op] += threads[i].scan_results[op];
+    printf("\nEsiti delle verifiche: %lu validi, %lu non validi, %lu inesistenti, %lu servizio non disponibile\n",
+           results[1], results[0], results[2], results[3]);
+    printf("Durata %.2f secondi\n", elapsed);
+    exit(0);
+}
@@ -0,0 +1,199 @@
+/*
+    Instradamento dei GP sugli shard del ServerVaccinale.
+
+    Lo spazio delle tessere è suddiviso tra più istanze del ServerVaccinale (shard) con l'hashing consistente: ogni shard occupa
+    SHARD_VNODES punti su un anello di interi a 64 bit, ed una tessera appartiene al primo punto che segue il suo hash.
+    I punti dipendono solo da host e porta dello shard, quindi aggiungendo o togliendo uno shard si sposta solo la parte di
+    tessere che gli spetta, e tutti i programmi che leggono lo stesso file calcolano lo stesso instradamento.
+
+    Il file di instradamento (SHARD_CONFIG se non indicato diversamente) contiene una riga "host porta" per il primario di ogni
+    shard, seguita da una riga "replica host porta" per ognuna delle sue repliche; le righe vuote e quelle che iniziano con #
+    vengono ignorate. Le repliche non cambiano l'instradamento: servono le letture del proprio shard, le modifiche vanno
+    sempre al primario. Se il file predefinito non esiste si usa un unico shard 127.0.0.1:1025, come prima della suddivisione.
+    Esempio di un cluster di prova su una sola macchina, con due repliche per il primo shard:
+        # host          porta
+        127.0.0.1       1025
+        replica 127.0.0.1 1035
+        replica 127.0.0.1 1045
+        127.0.0.1       1027
+        127.0.0.1       1028
+
+    Tutte le funzioni sono static inline, come in Protocollo.h.
+*/
+#ifndef INSTRADAMENTO_H
+#define INSTRADAMENTO_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "Protocollo.h"
+
+#define SHARD_CONFIG "shard.conf"   //file di instradamento predefinito
+#define SHARD_HOST_SIZE 256
+#define MAX_SHARDS 64               //numero massimo di shard
+#define MAX_REPLICAS 8              //numero massimo di repliche di uno shard
+#define SHARD_VNODES 160            //punti di ogni shard sull'anello: più punti, distribuzione più uniforme
+
+//Istanza del ServerVaccinale
+typedef struct {
+    char host[SHARD_HOST_SIZE];
+    int port;
+    struct sockaddr_in addr;        //indirizzo risolto al caricamento del file
+} SHARD_NODE;
+
+//Shard: nodes[0] è il primario, gli altri nodi sono le sue repliche
+typedef struct {
+    SHARD_NODE nodes[1 + MAX_REPLICAS];
+    int n_nodes;
+} SHARD;
+
+//Punto dell'anello dell'hashing consistente
+typedef struct {
+    unsigned long hash;
+    int shard;
+} SHARD_POINT;
+
+//Tabella di instradamento
+typedef struct {
+    SHARD shards[MAX_SHARDS];
+    int n_shards;
+    SHARD_POINT ring[MAX_SHARDS * SHARD_VNODES];    //ordinato per hash
+    int n_points;
+} SHARD_MAP;
+
+//Hash FNV-1a a 64 bit seguito dal rimescolamento finale di MurmurHash3, che distribuisce anche le chiavi molto simili tra loro.
+//L'indice dei GP usa invece key_hash sulla GP_KEY della tessera: l'instradamento continua a calcolare l'hash sui caratteri del numero
+//di tessera, così nessuna tessera cambia shard ed i GP già distribuiti tra i ServerVaccinale restano dove sono.
+static inline unsigned long shard_hash(const void *data, size_t len) {
+    const unsigned char *p = data;
+    unsigned long hash = 14695981039346656037UL;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211UL;
+    }
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdUL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53UL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static inline int shard_point_compare(const void *a, const void *b) {
+    const SHARD_POINT *x = a, *y = b;
+
+    if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+    return x->shard - y->shard;
+}
+
+//Valorizza un nodo risolvendo l'indirizzo. Ritorna 0, -1 se host o porta non sono validi.
+static inline int shard_node_init(SHARD_NODE *node, const char *host, int port) {
+    struct addrinfo hints, *res;
+
+    if (port <= 0 || port > 65535 || strlen(host) >= SHARD_HOST_SIZE) return -1;
+    memset(node, 0, sizeof(SHARD_NODE));
+    strcpy(node->host, host);
+    node->port = port;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) return -1;
+    node->addr = *(struct sockaddr_in *)res->ai_addr;
+    node->addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return 0;
+}
+
+//Aggiunge uno shard alla tabella con il primario indicato. Ritorna 0, -1 se l'host non è valido o la tabella è piena.
+static inline int shard_add(SHARD_MAP *map, const char *host, int port) {
+    SHARD *shard;
+    char key[SHARD_HOST_SIZE + 32];
+    int i, n;
+
+    if (map->n_shards == MAX_SHARDS) return -1;
+    shard = &map->shards[map->n_shards];
+    if (shard_node_init(&shard->nodes[0], host, port) < 0) return -1;
+    shard->n_nodes = 1;
+
+    //I punti sull'anello sono gli hash di "host:porta#i"
+    for (i = 0; i < SHARD_VNODES; i++) {
+        n = snprintf(key, sizeof(key), "%s:%d#%d", host, port, i);
+        map->ring[map->n_points].hash = shard_hash(key, n);
+        map->ring[map->n_points].shard = map->n_shards;
+        map->n_points++;
+    }
+    map->n_shards++;
+    return 0;
+}
+
+//Aggiunge una replica all'ultimo shard della tabella. Ritorna 0, -1 se non c'è uno shard, l'host non è valido o le repliche sono troppe.
+static inline int shard_add_replica(SHARD_MAP *map, const char *host, int port) {
+    SHARD *shard;
+
+    if (map->n_shards == 0) return -1;
+    shard = &map->shards[map->n_shards - 1];
+    if (shard->n_nodes == 1 + MAX_REPLICAS || shard_node_init(&shard->nodes[shard->n_nodes], host, port) < 0) return -1;
+    shard->n_nodes++;
+    return 0;
+}
+
+/* Carica la tabella di instradamento dal file indicato, NULL per il file predefinito. Ritorna 0, -1 se il file indicato non
+   può essere letto o contiene righe non valide; gli errori vengono stampati su stderr. */
+static inline int shard_map_load(SHARD_MAP *map, const char *path) {
+    char line[SHARD_HOST_SIZE + 64], host[SHARD_HOST_SIZE];
+    int port, n_line = 0, result;
+    FILE *file;
+
+    map->n_shards = map->n_points = 0;
+    if ((file = fopen(path != NULL ? path : SHARD_CONFIG, "r")) == NULL) {
+        if (path != NULL || errno != ENOENT) {
+            perror("fopen() error");
+            return -1;
+        }
+        //Senza file di instradamento c'è un unico ServerVaccinale sulla porta storica
+        return shard_add(map, "127.0.0.1", 1025);
+    }
+
+    while (fgets(line, sizeof(line), file) != NULL) {
+        n_line++;
+        if (sscanf(line, "%255s", host) != 1 || host[0] == '#') continue;
+        if (strcmp(host, "replica") == 0) result = sscanf(line, "%*s %255s %d", host, &port) == 2 ? shard_add_replica(map, host, port) : -1;
+        else result = sscanf(line, "%255s %d", host, &port) == 2 ? shard_add(map, host, port) : -1;
+        if (result < 0) {
+            fprintf(stderr, "%s:%d: riga non valida, attesi \"host porta\" oppure \"replica host porta\" dopo il primario\n",
+                    path != NULL ? path : SHARD_CONFIG, n_line);
+            fclose(file);
+            return -1;
+        }
+    }
+    fclose(file);
+    if (map->n_shards == 0) {
+        fprintf(stderr, "%s: nessuno shard indicato\n", path != NULL ? path : SHARD_CONFIG);
+        return -1;
+    }
+    qsort(map->ring, map->n_points, sizeof(SHARD_POINT), shard_point_compare);
+    return 0;
+}
+
+//Shard a cui appartiene una tessera: il primo punto dell'anello con hash maggiore o uguale a quello della tessera
+static inline int shard_of(const SHARD_MAP *map, const char ID[]) {
+    unsigned long hash = shard_hash(ID, strnlen(ID, ID_SIZE - 1));
+    int low = 0, high = map->n_points, mid;
+
+    if (map->n_shards == 1) return 0;
+    while (low < high) {
+        mid = (low + high) / 2;
+        if (map->ring[mid].hash < hash) low = mid + 1;
+        else high = mid;
+    }
+    return map->ring[low == map->n_points ? 0 : low].shard;
+}
+
+#endif
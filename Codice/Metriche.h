@@ -0,0 +1,348 @@
+/*
+    Metriche dei server: per ogni operazione un istogramma delle latenze ed i contatori delle richieste, esposti nel formato testo di
+    Prometheus su una porta di amministrazione raggiungibile solo dalla macchina locale (GET /metrics).
+
+    Ogni thread registra le proprie richieste in un blocco di contatori di cui è l'unico scrittore: la registrazione non usa lock né
+    istruzioni atomiche con lock. Il thread della porta di amministrazione somma i blocchi leggendoli atomicamente. Quando un thread
+    termina il suo blocco passa, con i contatori accumulati, al prossimo thread che registra una richiesta: i blocchi sono al più
+    quanti i thread contemporanei anche nei server con un thread per connessione.
+
+    L'istogramma è log-lineare come in HdrHistogram: ogni potenza di 2 di nanosecondi è divisa in METRIC_SUB intervalli uguali,
+    quindi ogni latenza fino a 2^METRIC_MAX_SHIFT ns (circa 18 minuti) è registrata con un errore relativo inferiore a 1/METRIC_SUB.
+
+    Tutte le funzioni sono static inline, come in Protocollo.h.
+*/
+#ifndef METRICHE_H
+#define METRICHE_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define METRIC_SUB_BITS 4       //ogni potenza di 2 è divisa in 16 intervalli: errore relativo inferiore al 6.25%
+#define METRIC_SUB (1 << METRIC_SUB_BITS)
+#define METRIC_MAX_SHIFT 40     //latenze registrate fino a 2^40 ns, le maggiori finiscono nell'ultimo intervallo
+#define METRIC_BUCKETS ((METRIC_MAX_SHIFT - METRIC_SUB_BITS + 1) * METRIC_SUB)
+#define METRIC_MAX_OPS 8        //operazioni al più di un server
+#define METRIC_WAITS METRIC_MAX_OPS //gruppi di richieste in attesa di un evento comune (METRIC_WAIT)
+
+//Contatori di un'operazione in un blocco
+typedef struct {
+    unsigned long started;      //richieste iniziate: quelle in corso sono started meno count
+    unsigned long count;        //richieste completate
+    unsigned long errors;       //richieste completate con un errore
+    unsigned long sum_ns;
+    unsigned long buckets[METRIC_BUCKETS];
+} METRIC_OP;
+
+//Blocco di contatori di un thread. I blocchi non vengono mai liberati, quindi la lista può essere letta senza lock.
+typedef struct METRIC_BLOCK {
+    struct METRIC_BLOCK *next;
+    int owned;                  //1 finché il blocco appartiene ad un thread
+    METRIC_OP ops[];            //n_ops operazioni
+} METRIC_BLOCK;
+
+typedef struct {
+    const char *const *names;   //nomi delle operazioni, usati come etichetta op
+    int n_ops;
+    METRIC_BLOCK *blocks;
+    pthread_key_t key;          //blocco del thread, rilasciato quando il thread termina
+    int listen_fd;
+} METRICS;
+
+/* Richieste la cui risposta attende un evento comune, ad esempio la sincronizzazione del log. Le richieste consecutive della stessa
+   operazione formano un gruppo e vengono registrate con l'inizio della prima: la loro latenza risulta maggiore al più del tempo
+   trascorso tra le due richieste, trascurabile rispetto all'attesa. */
+typedef struct {
+    long start[METRIC_WAITS];
+    unsigned short op[METRIC_WAITS];
+    unsigned short count[METRIC_WAITS];
+    int groups;
+} METRIC_WAIT;
+
+//Istante corrente in nanosecondi, su un orologio che non torna indietro
+static inline long metric_now() {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+//Intervallo dell'istogramma di una latenza di ns nanosecondi: i primi METRIC_SUB valori sono esatti, poi METRIC_SUB intervalli per potenza di 2
+static inline int metric_bucket(unsigned long ns) {
+    int shift, index;
+
+    if (ns < METRIC_SUB) return ns;
+    shift = 63 - __builtin_clzl(ns) - METRIC_SUB_BITS;
+    index = (shift + 1) * METRIC_SUB + ((ns >> shift) & (METRIC_SUB - 1));
+    return index < METRIC_BUCKETS ? index : METRIC_BUCKETS - 1;
+}
+
+//Latenza massima in nanosecondi registrata nell'intervallo index
+static inline unsigned long metric_upper(int index) {
+    int shift = index / METRIC_SUB - 1;
+
+    if (index < METRIC_SUB) return index;
+    return ((unsigned long)(METRIC_SUB + index % METRIC_SUB + 1) << shift) - 1;
+}
+
+//Rilascia il blocco di un thread terminato, con i suoi contatori, per il prossimo thread
+static inline void metric_release(void *block) {
+    __atomic_store_n(&((METRIC_BLOCK *)block)->owned, 0, __ATOMIC_RELEASE);
+}
+
+//Inizializza le metriche delle n_ops operazioni con i nomi indicati
+static inline void metrics_init(METRICS *metrics, const char *const *names, int n_ops) {
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->names = names;
+    metrics->n_ops = n_ops < METRIC_MAX_OPS ? n_ops : METRIC_MAX_OPS;
+    metrics->listen_fd = -1;
+    pthread_key_create(&metrics->key, metric_release);
+}
+
+//Blocco del thread chiamante: alla prima richiesta il thread riceve un blocco rilasciato da un thread terminato, oppure un nuovo blocco
+static inline METRIC_BLOCK *metric_block(METRICS *metrics) {
+    static __thread METRIC_BLOCK *self;
+    METRIC_BLOCK *block;
+    int owned;
+
+    if (self != NULL) return self;
+    for (block = __atomic_load_n(&metrics->blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        owned = 0;
+        if (__atomic_compare_exchange_n(&block->owned, &owned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (block == NULL) {
+        if ((block = calloc(1, sizeof(METRIC_BLOCK) + metrics->n_ops * sizeof(METRIC_OP))) == NULL) return NULL;
+        block->owned = 1;
+        block->next = __atomic_load_n(&metrics->blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&metrics->blocks, &block->next, block, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    pthread_setspecific(metrics->key, block);
+    self = block;
+    return block;
+}
+
+//Incrementa un contatore di cui il thread è l'unico scrittore: una lettura ed una scrittura atomiche, senza lock
+static inline void metric_add(unsigned long *counter, unsigned long value) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
+
+//Inizio di una richiesta dell'operazione op: ritorna l'istante da passare a metric_end
+static inline long metric_start(METRICS *metrics, int op) {
+    METRIC_BLOCK *block = metric_block(metrics);
+
+    if (block != NULL) metric_add(&block->ops[op].started, 1);
+    return metric_now();
+}
+
+//Registra count richieste dell'operazione op completate in elapsed nanosecondi
+static inline void metric_record(METRICS *metrics, int op, long elapsed, int error, unsigned count) {
+    METRIC_BLOCK *block = metric_block(metrics);
+    METRIC_OP *m;
+
+    if (block == NULL) return;
+    m = &block->ops[op];
+    if (elapsed < 0) elapsed = 0;
+    metric_add(&m->buckets[metric_bucket(elapsed)], count);
+    metric_add(&m->sum_ns, (unsigned long)elapsed * count);
+    if (error) metric_add(&m->errors, count);
+    metric_add(&m->count, count);
+}
+
+//Fine di una richiesta iniziata con metric_start. error è diverso da 0 se la richiesta non è stata servita.
+static inline void metric_end(METRICS *metrics, int op, long start, int error) {
+    metric_record(metrics, op, metric_now() - start, error, 1);
+}
+
+//Aggiunge a wait una richiesta iniziata in start, che sarà completata da metric_wait_end
+static inline void metric_wait_add(METRICS *metrics, METRIC_WAIT *wait, int op, long start) {
+    int i = wait->groups - 1;
+
+    if (i < 0 || wait->op[i] != op) {
+        if (wait->groups < METRIC_WAITS) {
+            i = wait->groups++;
+            wait->op[i] = op;
+            wait->start[i] = start;
+            wait->count[i] = 0;
+        } else {
+            //Con tutti i gruppi occupati la richiesta si unisce all'ultimo gruppo della stessa operazione, se non c'è viene registrata subito
+            while (i >= 0 && wait->op[i] != op) i--;
+            if (i < 0) {
+                metric_end(metrics, op, start, 0);
+                return;
+            }
+        }
+    }
+    wait->count[i]++;
+}
+
+//L'evento atteso è avvenuto: completa le richieste di wait. error è diverso da 0 se le risposte non potranno più essere inviate.
+static inline void metric_wait_end(METRICS *metrics, METRIC_WAIT *wait, int error) {
+    long now;
+    int i;
+
+    if (wait->groups == 0) return;
+    now = metric_now();
+    for (i = 0; i < wait->groups; i++) metric_record(metrics, wait->op[i], now - wait->start[i], error, wait->count[i]);
+    wait->groups = 0;
+}
+
+//Scrive in out le metriche nel formato testo di Prometheus, sommando i blocchi di tutti i thread
+static inline void metrics_print(METRICS *metrics, FILE *out) {
+    static const double bounds[] = {1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4, 1e-3, 2.5e-3, 5e-3,
+                                    1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    METRIC_OP *totals;
+    METRIC_BLOCK *block;
+    unsigned long cumulative, rank;
+    int op, i, j;
+
+    if ((totals = calloc(metrics->n_ops, sizeof(METRIC_OP))) == NULL) return;
+    for (block = __atomic_load_n(&metrics->blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next) {
+        for (op = 0; op < metrics->n_ops; op++) {
+            totals[op].started += __atomic_load_n(&block->ops[op].started, __ATOMIC_RELAXED);
+            totals[op].count += __atomic_load_n(&block->ops[op].count, __ATOMIC_RELAXED);
+            totals[op].errors += __atomic_load_n(&block->ops[op].errors, __ATOMIC_RELAXED);
+            totals[op].sum_ns += __atomic_load_n(&block->ops[op].sum_ns, __ATOMIC_RELAXED);
+            for (i = 0; i < METRIC_BUCKETS; i++) totals[op].buckets[i] += __atomic_load_n(&block->ops[op].buckets[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    //Il totale delle richieste è la somma degli intervalli, così resta coerente con l'istogramma letto mentre i thread registrano
+    for (op = 0; op < metrics->n_ops; op++) {
+        for (i = 0, totals[op].count = 0; i < METRIC_BUCKETS; i++) totals[op].count += totals[op].buckets[i];
+        if (totals[op].started < totals[op].count) totals[op].started = totals[op].count;
+    }
+
+    fprintf(out, "# HELP greenpass_requests_total Richieste completate per operazione.\n# TYPE greenpass_requests_total counter\n");
+    for (op = 0; op < metrics->n_ops; op++) fprintf(out, "greenpass_requests_total{op=\"%s\"} %lu\n", metrics->names[op], totals[op].count);
+    fprintf(out, "# HELP greenpass_request_errors_total Richieste completate senza essere servite.\n# TYPE greenpass_request_errors_total counter\n");
+    for (op = 0; op < metrics->n_ops; op++) fprintf(out, "greenpass_request_errors_total{op=\"%s\"} %lu\n", metrics->names[op], totals[op].errors);
+    fprintf(out, "# HELP greenpass_requests_in_flight Richieste iniziate e non ancora completate.\n# TYPE greenpass_requests_in_flight gauge\n");
+    for (op = 0; op < metrics->n_ops; op++)
+        fprintf(out, "greenpass_requests_in_flight{op=\"%s\"} %lu\n", metrics->names[op], totals[op].started - totals[op].count);
+
+    //Un intervallo dell'istogramma che attraversa un limite viene contato nel limite successivo
+    fprintf(out, "# HELP greenpass_request_duration_seconds Latenza delle richieste.\n# TYPE greenpass_request_duration_seconds histogram\n");
+    for (op = 0; op < metrics->n_ops; op++) {
+        for (i = 0, j = 0, cumulative = 0; j < (int)(sizeof(bounds) / sizeof(bounds[0])); j++) {
+            for (; i < METRIC_BUCKETS && metric_upper(i) <= bounds[j] * 1e9; i++) cumulative += totals[op].buckets[i];
+            fprintf(out, "greenpass_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n", metrics->names[op], bounds[j], cumulative);
+        }
+        fprintf(out, "greenpass_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n", metrics->names[op], totals[op].count);
+        fprintf(out, "greenpass_request_duration_seconds_sum{op=\"%s\"} %.9f\n", metrics->names[op], totals[op].sum_ns / 1e9);
+        fprintf(out, "greenpass_request_duration_seconds_count{op=\"%s\"} %lu\n", metrics->names[op], totals[op].count);
+    }
+
+    //Percentili calcolati sull'istogramma completo: il valore è la latenza massima dell'intervallo che contiene il percentile
+    fprintf(out, "# HELP greenpass_request_duration_quantile_seconds Percentili della latenza dall'avvio del server.\n"
+                 "# TYPE greenpass_request_duration_quantile_seconds gauge\n");
+    for (op = 0; op < metrics->n_ops; op++) {
+        for (j = 0; j < (int)(sizeof(quantiles) / sizeof(quantiles[0])); j++) {
+            fprintf(out, "greenpass_request_duration_quantile_seconds{op=\"%s\",quantile=\"%g\"} ", metrics->names[op], quantiles[j]);
+            if (totals[op].count == 0) {
+                fprintf(out, "NaN\n");
+                continue;
+            }
+            rank = (unsigned long)(quantiles[j] * totals[op].count);
+            if (rank < quantiles[j] * totals[op].count || rank == 0) rank++;
+            for (i = 0, cumulative = 0; i < METRIC_BUCKETS - 1 && (cumulative += totals[op].buckets[i]) < rank; i++);
+            fprintf(out, "%.9g\n", metric_upper(i) / 1e9);
+        }
+    }
+    free(totals);
+}
+
+//Thread della porta di amministrazione: risponde ad una connessione alla volta, GET /metrics riceve le metriche
+static inline void *metrics_thread(void *arg) {
+    METRICS *metrics = arg;
+    struct timeval timeout = {2, 0};
+    char request[1024], header[256], *body;
+    size_t body_len, len, off;
+    ssize_t n;
+    FILE *out;
+    int fd;
+
+    for (;;) {
+        if ((fd = accept(metrics->listen_fd, NULL, NULL)) < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) perror("accept() error");
+            continue;
+        }
+
+        //Un client lento non blocca la porta: la richiesta deve arrivare entro il timeout
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        for (len = 0; len < sizeof(request) - 1 && (n = read(fd, request + len, sizeof(request) - 1 - len)) > 0;) {
+            len += n;
+            request[len] = 0;
+            if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL) break;
+        }
+        request[len] = 0;
+
+        body = NULL;
+        body_len = 0;
+        if ((out = open_memstream(&body, &body_len)) == NULL) {
+            close(fd);
+            continue;
+        }
+        if (strncmp(request, "GET /metrics", 12) == 0 && (request[12] == ' ' || request[12] == '?' || request[12] == '\r' || request[12] == '\n')) {
+            metrics_print(metrics, out);
+            fclose(out);
+            len = snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", body_len);
+        } else {
+            fprintf(out, "Metriche disponibili con GET /metrics\n");
+            fclose(out);
+            len = snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n\r\n", body_len);
+        }
+
+        if (write(fd, header, len) == (ssize_t)len) {
+            for (off = 0; off < body_len && (n = write(fd, body + off, body_len - off)) > 0; off += n);
+        }
+        free(body);
+        close(fd);
+    }
+    return NULL;
+}
+
+//Avvia il thread che espone le metriche su 127.0.0.1:port. Ritorna -1 in caso di errore, senza metriche esposte.
+static inline int metrics_listen(METRICS *metrics, int port) {
+    struct sockaddr_in addr;
+    pthread_t tid;
+    int enable = 1;
+
+    if ((metrics->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket() error");
+        return -1;
+    }
+    setsockopt(metrics->listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    //La porta di amministrazione è raggiungibile solo dalla macchina del server
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(metrics->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(metrics->listen_fd, 16) < 0) {
+        perror("bind() error");
+        close(metrics->listen_fd);
+        metrics->listen_fd = -1;
+        return -1;
+    }
+    if (pthread_create(&tid, NULL, metrics_thread, metrics) != 0) {
+        perror("pthread_create() error");
+        close(metrics->listen_fd);
+        metrics->listen_fd = -1;
+        return -1;
+    }
+    pthread_detach(tid);
+    printf("Metriche disponibili su http://127.0.0.1:%d/metrics\n", port);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,479 @@
+/*
+    Protocollo di comunicazione comune a tutti i programmi del GreenPass.
+
+    Ogni messaggio è un frame formato da un'intestazione di 12 byte seguita dal payload:
+        magic   (2 byte)  sempre PROTO_MAGIC, permette di riconoscere un flusso non valido
+        version (1 byte)  versione del protocollo di chi ha scritto il frame
+        type    (1 byte)  tipo del messaggio, uno dei MSG_*
+        req_id  (4 byte)  scelto da chi invia la richiesta e ripetuto nella risposta
+        length  (4 byte)  lunghezza del payload, al più PROTO_MAX_PAYLOAD
+    Tutti i campi numerici sono interi senza segno little-endian di dimensione fissa, i campi vengono scritti uno dopo l'altro
+    senza padding: il formato non dipende dal layout delle struct in memoria né dal compilatore.
+
+    Compatibilità tra versioni: una nuova versione può solo aggiungere tipi di messaggio o campi in coda ad un payload.
+    Chi riceve ignora i byte in eccesso, quindi un frame di una versione più recente viene comunque interpretato;
+    PROTO_MIN_VERSION viene incrementata solo per modifiche incompatibili, ed i frame di versioni precedenti ricevono MSG_ERROR.
+    Quando un payload cambia forma il destinatario lo interpreta in base alla versione del frame (vedi MSG_VAX_REQUEST).
+
+    Tutte le funzioni sono static inline: ogni programma si compila da solo includendo questo file.
+    proto_send e proto_recv usano la full_write e la full_read definite dal programma che le utilizza.
+*/
+#ifndef PROTOCOLLO_H
+#define PROTOCOLLO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define ID_SIZE 11              //dimensione del codice della tessera (10 byte + 1 byte per il terminatore)
+#define NAME_SIZE 1024          //dimensione massima di nome e cognome
+
+#define PROTO_MAGIC 0x5047      //"GP"
+#define PROTO_VERSION 4
+#define PROTO_MIN_VERSION 1
+#define PROTO_HEADER_SIZE 12
+#define PROTO_MAX_PAYLOAD 65536
+#define PROTO_ID_SIZE (ID_SIZE - 1)                          //la tessera viaggia senza terminatore
+#define PROTO_DATE_SIZE 4                                    //anno (2 byte), mese, giorno
+#define PROTO_GP_SIZE (PROTO_ID_SIZE + 1 + 2 * PROTO_DATE_SIZE)
+#define PROTO_MAX_ISSUE_BATCH 64                             //GP al più in un MSG_GP_ISSUE_BATCH
+#define PROTO_VAX_REQUEST_MAX (2 * (2 + NAME_SIZE - 1) + PROTO_ID_SIZE)  //payload massimo di MSG_VAX_REQUEST
+#define PROTO_MAX_REPL_RECORDS 256                           //GP o record al più in un MSG_REPL_SNAPSHOT o MSG_REPL_RECORDS
+#define PROTO_REPL_RECORDS_MAX (4 * 8 + 2 + PROTO_MAX_REPL_RECORDS * (1 + PROTO_GP_SIZE))  //payload massimo di MSG_REPL_RECORDS
+#define PROTO_MAX_FILTER_KEYS 1024                           //chiavi al più in un MSG_FILTER_KEYS
+#define PROTO_FILTER_KEYS_MAX (1 + 2 + PROTO_MAX_FILTER_KEYS * 8)  //payload massimo di MSG_FILTER_KEYS
+
+//Tipi di messaggio e relativo payload
+#define MSG_ERROR 0x00          //codice (1 byte, PROTO_ERR_*), versione di chi risponde (1 byte)
+#define MSG_HELLO 0x01          //ruolo del client (1 byte, ROLE_*). Dalla versione 3 modalità (1 byte, HELLO_*), assente nelle precedenti
+#define MSG_WELCOME 0x02        //testo
+#define MSG_ACK 0x03            //testo
+#define MSG_RESULT 0x04         //esito (1 byte), testo facoltativo
+#define MSG_VAX_REQUEST 0x10    //nome e cognome (lunghezza di 2 byte seguita dai caratteri), tessera.
+                                //Fino alla versione 1 nome e cognome occupavano NAME_SIZE - 1 byte ciascuno
+#define MSG_GP_ISSUE 0x11       //GP emesso dal CentroVaccinale, risposta MSG_RESULT quando il GP è salvato
+#define MSG_GP_ISSUE_BATCH 0x17 //numero di GP (2 byte, al più PROTO_MAX_ISSUE_BATCH), GP. Risposta MSG_RESULT: '0' tutti salvati, '3' da ripetere
+#define MSG_GP_LOOKUP 0x12      //tessera, risposta MSG_GP_RESULT
+#define MSG_GP_RESULT 0x13      //esito (1 byte: '1' GP presente, '2' tessera inesistente, '3' servizio non disponibile), GP se l'esito è '1'.
+                                //Dalla versione 4 segue la posizione nel log del primario fino alla quale chi risponde è aggiornato
+#define MSG_GP_LOOKUP_BATCH 0x14  //numero di tessere (2 byte), tessere. Risposta MSG_GP_RESULT_BATCH
+#define MSG_GP_RESULT_BATCH 0x15  //numero di esiti (2 byte), per ogni tessera nello stesso ordine: esito (1 byte) e GP (azzerato se assente).
+                                  //Dalla versione 4 segue la posizione nel log del primario, come in MSG_GP_RESULT
+#define MSG_REPORT_UPDATE 0x16  //tessera, report (1 byte). Risposta MSG_RESULT: '0' avvenuta, '1' tessera inesistente, '3' servizio non disponibile.
+                                //Dalla versione 4 il MSG_RESULT del ServerVaccinale contiene dopo l'esito la posizione del report nel log
+#define MSG_SCAN 0x20           //tessera da verificare, risposta MSG_ACK seguito da MSG_RESULT ('1' valido, '0' non valido, '2' inesistente, '3').
+                                //In una sessione (HELLO_SESSION) la risposta è solo MSG_RESULT
+#define MSG_REPL_SUBSCRIBE 0x30 //nessun payload: una replica chiede al primario una copia dei GP seguita dalle modifiche successive
+#define MSG_REPL_SNAPSHOT 0x31  //numero di GP (2 byte), GP. Parte della copia iniziale, inviata prima di ogni MSG_REPL_RECORDS
+#define MSG_REPL_RECORDS 0x32   //numero del primo record (8 byte), ultimo record sincronizzato dal primario (8 byte), istante di invio
+                                //in nanosecondi dal 1970 (8 byte), numero di record (2 byte), per ogni record tipo (1 byte, 'I' 'S' 'R') e GP.
+                                //Senza record è un segnale di presenza del primario. Dalla versione 4 segue il segmento di avvio del primario (8 byte)
+#define MSG_FILTER_SUBSCRIBE 0x33 //nessun payload: il ServerVerifica chiede le chiavi delle tessere con un GP seguite da quelle delle nuove emissioni
+#define MSG_FILTER_KEYS 0x34    //fase (1 byte: 0 copia iniziale, 1 nuove emissioni), numero di chiavi (2 byte), chiavi (8 byte, id_key).
+                                //Il primo frame di fase 1 indica che la copia è completa, senza chiavi è un segnale di presenza
+
+//Codici di MSG_ERROR
+#define PROTO_ERR_VERSION 1     //versione del frame non più supportata
+#define PROTO_ERR_TYPE 2        //tipo di messaggio sconosciuto
+#define PROTO_ERR_MALFORMED 3   //payload non valido
+#define PROTO_ERR_READONLY 4    //modifica inviata ad una replica, va inviata al primario
+
+//Ruoli dei client in MSG_HELLO
+#define ROLE_APP_VERIFICA '0'
+
+//Modalità dell'AppVerifica in MSG_HELLO
+#define HELLO_SINGLE 0          //ogni tessera riceve MSG_ACK e MSG_RESULT
+#define HELLO_SESSION 1         //sessione: un solo MSG_ACK dopo il benvenuto, poi un MSG_RESULT per tessera nell'ordine di invio.
+                                //Un ServerVerifica di versione precedente risponde con il benvenuto di versione 2 e tratta le tessere singolarmente
+
+//Data del calendario, formata dai campi: giorno, mese (da 1 a 12) ed anno. È la forma in cui le date viaggiano nei frame e vengono stampate
+typedef struct {
+    int day;
+    int month;
+    int year;
+} DATE;
+
+/* Green pass: numero di tessera sanitaria dell'utente, report di validità e giorni di inizio e fine validità.
+   I giorni sono numerati dal 01/01/1970 (giorno 0) e calcolati una volta sola all'emissione: la verifica è un confronto tra interi. */
+typedef struct {
+    char ID[ID_SIZE];
+    char report; //0 GP non valido, 1 GP valido
+    int start_day;      //primo giorno di validità
+    int expire_day;     //ultimo giorno di validità
+} GP_REQUEST;
+
+//Pacchetto dell'ASL contenente il numero di tessera sanitaria di un green pass ed il suo referto di validità
+typedef struct {
+    char ID[ID_SIZE];
+    char report;
+} REPORT;
+
+/* Posizione nel log del primario di uno shard: segmento aperto all'avvio del primario e numero del record dall'avvio. I segmenti sono numerati
+   in modo crescente anche tra un riavvio e l'altro, quindi le posizioni si confrontano prima per segmento di avvio e poi per record */
+typedef struct {
+    unsigned long run;
+    unsigned long lsn;
+} LOG_POSITION;
+
+//Pacchetto che l'utente invia al centro vaccinale contenente nome, cognome e numero di tessera sanitaria
+typedef struct {
+    char name[NAME_SIZE];
+    char surname[NAME_SIZE];
+    char ID[ID_SIZE];
+} VAX_REQUEST;
+
+//Intestazione di un frame già decodificata
+typedef struct {
+    unsigned short magic;
+    unsigned char version;
+    unsigned char type;
+    unsigned int req_id;
+    unsigned int length;
+} FRAME_HEADER;
+
+//Scrittura di un frame in un buffer: error vale 1 se il buffer non è abbastanza grande
+typedef struct {
+    unsigned char *data;
+    size_t cap, len;
+    int error;
+} PROTO_WRITER;
+
+//Lettura del payload di un frame: error vale 1 se il payload è più corto del previsto
+typedef struct {
+    const unsigned char *data;
+    size_t len, off;
+    int error;
+} PROTO_READER;
+
+ssize_t full_read(int fd, void *buf, size_t count);
+ssize_t full_write(int fd, const void *buf, size_t count);
+
+/* Numero del giorno di una data del calendario gregoriano, 0 per il 01/01/1970. Calcolo solo aritmetico, senza localtime(): l'anno
+   viene fatto iniziare a marzo, così il giorno aggiuntivo dei bisestili cade alla fine e la lunghezza dei mesi segue una formula. */
+static inline int days_from_date(const DATE *date) {
+    int year = date->year - (date->month <= 2);
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int year_of_era = year - era * 400;
+    int day_of_year = (153 * (date->month + (date->month > 2 ? -3 : 9)) + 2) / 5 + date->day - 1;
+    int day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+
+    return era * 146097 + day_of_era - 719468;
+}
+
+//Data del calendario corrispondente al numero del giorno, inversa di days_from_date
+static inline void date_from_days(int days, DATE *date) {
+    int z = days + 719468;
+    int era = (z >= 0 ? z : z - 146096) / 146097;
+    int day_of_era = z - era * 146097;
+    int year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int month = (5 * day_of_year + 2) / 153;
+
+    date->day = day_of_year - (153 * month + 2) / 5 + 1;
+    date->month = month < 10 ? month + 3 : month - 9;
+    date->year = year_of_era + era * 400 + (date->month <= 2);
+}
+
+/* Chiave di una tessera: i 10 caratteri alfanumerici (cifre, lettere maiuscole e minuscole) come cifre da 1 a 62 di un numero
+   in base 63, che sta in 60 bit. La chiave 0 non corrisponde a nessuna tessera. Indice e cache confrontano e calcolano l'hash
+   della chiave con operazioni su una sola parola invece che sui caratteri. */
+typedef unsigned long GP_KEY;
+
+//Cifra di un carattere della tessera, 0 se il carattere non è ammesso
+static inline unsigned int id_digit(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0' + 1;
+    if (c >= 'A' && c <= 'Z') return c - 'A' + 11;
+    if (c >= 'a' && c <= 'z') return c - 'a' + 37;
+    return 0;
+}
+
+//Chiave della tessera, 0 se la tessera non è formata da esattamente ID_SIZE - 1 caratteri alfanumerici
+static inline GP_KEY id_key(const char ID[]) {
+    GP_KEY key = 0;
+    unsigned int digit;
+    int i;
+
+    for (i = 0; i < ID_SIZE - 1; i++) {
+        if ((digit = id_digit(ID[i])) == 0) return 0;
+        key = key * 63 + digit;
+    }
+    return key;
+}
+
+//Hash della chiave (rimescolamento finale di MurmurHash3): tutti i bit della chiave influenzano quelli bassi, usati come indice
+static inline unsigned long key_hash(GP_KEY key) {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53UL;
+    key ^= key >> 33;
+    return key;
+}
+
+//Giorni del mese indicato
+static inline int days_in_month(int month, int year) {
+    DATE first = {1, month, year}, next = {1, month % 12 + 1, year + (month == 12)};
+
+    return days_from_date(&next) - days_from_date(&first);
+}
+
+static inline void proto_put_u8(PROTO_WRITER *w, unsigned int value) {
+    if (w->len + 1 > w->cap) {
+        w->error = 1;
+        return;
+    }
+    w->data[w->len++] = value & 0xff;
+}
+
+static inline void proto_put_u16(PROTO_WRITER *w, unsigned int value) {
+    proto_put_u8(w, value);
+    proto_put_u8(w, value >> 8);
+}
+
+static inline void proto_put_u32(PROTO_WRITER *w, unsigned int value) {
+    proto_put_u16(w, value);
+    proto_put_u16(w, value >> 16);
+}
+
+static inline void proto_put_u64(PROTO_WRITER *w, unsigned long value) {
+    proto_put_u32(w, value);
+    proto_put_u32(w, value >> 32);
+}
+
+static inline void proto_put_bytes(PROTO_WRITER *w, const void *data, size_t count) {
+    if (w->len + count > w->cap) {
+        w->error = 1;
+        return;
+    }
+    memcpy(w->data + w->len, data, count);
+    w->len += count;
+}
+
+//Scrive un campo di testo di dimensione fissa: la stringa viene troncata o completata con zeri
+static inline void proto_put_string(PROTO_WRITER *w, const char *text, size_t size) {
+    size_t n = strnlen(text, size);
+
+    proto_put_bytes(w, text, n);
+    for (; n < size; n++) proto_put_u8(w, 0);
+}
+
+//Scrive un testo di lunghezza variabile preceduto dalla sua lunghezza (2 byte), al più size caratteri
+static inline void proto_put_lstring(PROTO_WRITER *w, const char *text, size_t size) {
+    size_t n = strnlen(text, size);
+
+    proto_put_u16(w, n);
+    proto_put_bytes(w, text, n);
+}
+
+//Scrive un testo che occupa il resto del payload, senza terminatore
+static inline void proto_put_text(PROTO_WRITER *w, const char *text) {
+    proto_put_bytes(w, text, strlen(text));
+}
+
+static inline void proto_put_ID(PROTO_WRITER *w, const char ID[]) {
+    proto_put_string(w, ID, PROTO_ID_SIZE);
+}
+
+static inline void proto_put_date(PROTO_WRITER *w, const DATE *date) {
+    proto_put_u16(w, date->year);
+    proto_put_u8(w, date->month);
+    proto_put_u8(w, date->day);
+}
+
+//Nel frame il giorno viaggia come data del calendario, il formato dei frame non dipende dalla rappresentazione in memoria
+static inline void proto_put_day(PROTO_WRITER *w, int day) {
+    DATE date;
+
+    date_from_days(day, &date);
+    proto_put_date(w, &date);
+}
+
+static inline void proto_put_gp(PROTO_WRITER *w, const GP_REQUEST *gp) {
+    proto_put_ID(w, gp->ID);
+    proto_put_u8(w, gp->report);
+    proto_put_day(w, gp->start_day);
+    proto_put_day(w, gp->expire_day);
+}
+
+static inline void proto_put_position(PROTO_WRITER *w, const LOG_POSITION *position) {
+    proto_put_u64(w, position->run);
+    proto_put_u64(w, position->lsn);
+}
+
+//Inizia un frame nel buffer indicato. La lunghezza del payload viene scritta da proto_end.
+static inline void proto_begin(PROTO_WRITER *w, void *buf, size_t cap, unsigned int type, unsigned int req_id) {
+    w->data = buf;
+    w->cap = cap;
+    w->len = 0;
+    w->error = 0;
+    proto_put_u16(w, PROTO_MAGIC);
+    proto_put_u8(w, PROTO_VERSION);
+    proto_put_u8(w, type);
+    proto_put_u32(w, req_id);
+    proto_put_u32(w, 0);
+}
+
+//Completa il frame. Ritorna la dimensione totale del frame, -1 se non è stato possibile scriverlo per intero.
+static inline ssize_t proto_end(PROTO_WRITER *w) {
+    size_t length = w->len - PROTO_HEADER_SIZE;
+
+    if (w->error || length > PROTO_MAX_PAYLOAD) return -1;
+    w->data[8] = length & 0xff;
+    w->data[9] = (length >> 8) & 0xff;
+    w->data[10] = (length >> 16) & 0xff;
+    w->data[11] = (length >> 24) & 0xff;
+    return w->len;
+}
+
+static inline void proto_reader(PROTO_READER *r, const void *payload, size_t len) {
+    r->data = payload;
+    r->len = len;
+    r->off = 0;
+    r->error = 0;
+}
+
+static inline unsigned int proto_get_u8(PROTO_READER *r) {
+    if (r->off + 1 > r->len) {
+        r->error = 1;
+        return 0;
+    }
+    return r->data[r->off++];
+}
+
+static inline unsigned int proto_get_u16(PROTO_READER *r) {
+    unsigned int value = proto_get_u8(r);
+    return value | proto_get_u8(r) << 8;
+}
+
+static inline unsigned int proto_get_u32(PROTO_READER *r) {
+    unsigned int value = proto_get_u16(r);
+    return value | proto_get_u16(r) << 16;
+}
+
+static inline unsigned long proto_get_u64(PROTO_READER *r) {
+    unsigned long value = proto_get_u32(r);
+    return value | (unsigned long)proto_get_u32(r) << 32;
+}
+
+static inline void proto_get_bytes(PROTO_READER *r, void *data, size_t count) {
+    if (r->off + count > r->len) {
+        r->error = 1;
+        memset(data, 0, count);
+        return;
+    }
+    memcpy(data, r->data + r->off, count);
+    r->off += count;
+}
+
+//Legge un campo di testo di dimensione fissa in text, che deve contenere size + 1 byte
+static inline void proto_get_string(PROTO_READER *r, char *text, size_t size) {
+    proto_get_bytes(r, text, size);
+    text[size] = 0;
+}
+
+/* Legge un testo scritto con proto_put_lstring senza copiarlo: ritorna il puntatore ai caratteri all'interno del payload,
+   che non sono terminati, e ne scrive la lunghezza in len */
+static inline const char *proto_get_lstring(PROTO_READER *r, size_t *len) {
+    const char *text;
+
+    *len = proto_get_u16(r);
+    if (r->error || r->off + *len > r->len) {
+        r->error = 1;
+        *len = 0;
+        return "";
+    }
+    text = (const char *)r->data + r->off;
+    r->off += *len;
+    return text;
+}
+
+//Legge il testo che occupa il resto del payload, troncandolo a size - 1 caratteri
+static inline void proto_get_text(PROTO_READER *r, char *text, size_t size) {
+    size_t n = r->len - r->off;
+
+    if (n > size - 1) n = size - 1;
+    memcpy(text, r->data + r->off, n);
+    text[n] = 0;
+    r->off = r->len;
+}
+
+static inline void proto_get_ID(PROTO_READER *r, char ID[]) {
+    proto_get_string(r, ID, PROTO_ID_SIZE);
+}
+
+static inline void proto_get_date(PROTO_READER *r, DATE *date) {
+    date->year = proto_get_u16(r);
+    date->month = proto_get_u8(r);
+    date->day = proto_get_u8(r);
+}
+
+static inline int proto_get_day(PROTO_READER *r) {
+    DATE date;
+
+    proto_get_date(r, &date);
+    return days_from_date(&date);
+}
+
+static inline void proto_get_gp(PROTO_READER *r, GP_REQUEST *gp) {
+    memset(gp, 0, sizeof(GP_REQUEST));
+    proto_get_ID(r, gp->ID);
+    gp->report = proto_get_u8(r);
+    gp->start_day = proto_get_day(r);
+    gp->expire_day = proto_get_day(r);
+}
+
+static inline void proto_get_position(PROTO_READER *r, LOG_POSITION *position) {
+    position->run = proto_get_u64(r);
+    position->lsn = proto_get_u64(r);
+}
+
+/* Decodifica l'intestazione di un frame presente all'inizio di data. Ritorna la dimensione totale del frame, 0 se l'intestazione
+   non è ancora arrivata per intero, -1 se il flusso non è valido. */
+static inline ssize_t proto_parse_header(const void *data, size_t len, FRAME_HEADER *h) {
+    PROTO_READER r;
+
+    if (len < PROTO_HEADER_SIZE) return 0;
+    proto_reader(&r, data, PROTO_HEADER_SIZE);
+    h->magic = proto_get_u16(&r);
+    h->version = proto_get_u8(&r);
+    h->type = proto_get_u8(&r);
+    h->req_id = proto_get_u32(&r);
+    h->length = proto_get_u32(&r);
+    if (h->magic != PROTO_MAGIC || h->length > PROTO_MAX_PAYLOAD) return -1;
+    return PROTO_HEADER_SIZE + h->length;
+}
+
+//Invia un frame completato con proto_end. Ritorna 0 se l'invio è avvenuto, -1 in caso di errore.
+static inline int proto_send(int fd, PROTO_WRITER *w) {
+    if (proto_end(w) < 0) return -1;
+    return full_write(fd, w->data, w->len) == 0 ? 0 : -1;
+}
+
+/* Riceve un frame: l'intestazione viene decodificata in h ed il payload copiato in payload, che può contenere cap byte.
+   Ritorna 0 se il frame è stato ricevuto, -1 se la connessione è chiusa o il frame non è valido. */
+static inline int proto_recv(int fd, FRAME_HEADER *h, void *payload, size_t cap) {
+    unsigned char header[PROTO_HEADER_SIZE];
+
+    if (full_read(fd, header, PROTO_HEADER_SIZE) != 0) return -1;
+    if (proto_parse_header(header, PROTO_HEADER_SIZE, h) < 0 || h->length > cap) return -1;
+    if (full_read(fd, payload, h->length) != 0) return -1;
+    return 0;
+}
+
+/* Come proto_recv, ma il payload viene allocato della lunghezza indicata nell'intestazione, che non può superare max.
+   Ritorna il payload da liberare con free, NULL se la connessione è chiusa o il frame non è valido. */
+static inline void *proto_recv_alloc(int fd, FRAME_HEADER *h, size_t max) {
+    unsigned char header[PROTO_HEADER_SIZE];
+    void *payload;
+
+    if (full_read(fd, header, PROTO_HEADER_SIZE) != 0) return NULL;
+    if (proto_parse_header(header, PROTO_HEADER_SIZE, h) < 0 || h->length > max) return NULL;
+    if ((payload = malloc(h->length ? h->length : 1)) == NULL) return NULL;
+    if (full_read(fd, payload, h->length) != 0) {
+        free(payload);
+        return NULL;
+    }
+    return payload;
+}
+
+#endif
@@ -1,317 +1,1852 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <unistd.h>
-#include <errno.h>      // libreria C per la gestione delle situazioni di errore.
-#include <string.h>
-#include <fcntl.h> 
-#include <sys/stat.h>
-#include <sys/file.h>
-#include <sys/types.h>
-#include <sys/socket.h> // libreria C per i socket
-#include <arpa/inet.h>  // contiene le definizioni per le operazioni Internet.
-#include <time.h>
-#include <signal.h>     // libreria C che consente l'uso delle funzioni per la gestione dei segnali fra processi.
-#define MAX_SIZE 2048   // dimensione max del buf
-#define ID_SIZE 11        //dimensione del codice della tessera (10 byte + 1 byte per il terminatore)
-
-//Pacchetto dell'ASL contenente il numero di tessera sanitaria di un green pass ed il suo report di validità
-typedef struct  {
-    char ID[ID_SIZE];
-    char report;
-} REPORT;
-
-//Permette di salvare una data
-typedef struct {
-    int day;
-    int month;
-    int year;
-} DATE;
-
-//Pacchetto inviato dal centro vaccinale al server vaccinale contentente il numero di tessera sanitaria dell'utente, la data di inizio e fine del GP
-typedef struct {
-    char ID[ID_SIZE];
-    char report; //0 GP non valido, 1 GP valido
-    DATE start_date;
-    DATE expire_date;
-} GP_REQUEST;
-
-//Legge esattamente count byte s iterando opportunamente le letture. Legge anche se viene interrotta da una System Call.
-ssize_t full_read(int fd, void *buf, size_t count) {
-    size_t nleft;
-    ssize_t nread;
-    nleft = count;
-    while (nleft > 0) {  // repeat finchè non ci sono left
-        if ((nread = read(fd, buf, nleft)) < 0) {
-            if (errno == EINTR) 
-            continue; // Se si verifica una System Call che interrompe ripeti il ciclo
-            else exit(nread);
-        } else if (nread == 0) break; // Se sono finiti, esci
-        nleft -= nread;
-        buf += nread;
-    }
-    buf = 0;
-    return nleft;
-}
-
-
-//Scrive esattamente count byte s iterando opportunamente le scritture. Scrive anche se viene interrotta da una System Call.
-ssize_t full_write(int fd, const void *buf, size_t count) {
-    size_t nleft;
-    ssize_t nwritten;
-    nleft = count;
-    while (nleft > 0) {          //repeat finchè non ci sono left
-        if ((nwritten = write(fd, buf, nleft)) < 0) {
-            if (errno == EINTR) 
-            continue; //Se si verifica una System Call che interrompe ripeti il ciclo
-            else exit(nwritten); //Se non è una System Call, esci con un errore
-        }
-        nleft -= nwritten;
-        buf += nwritten;
-    }
-    buf = 0;
-    return nleft;
-}
-
-//Handler che cattura il segnale CTRL-C e stampa un messaggio di arrivederci.
-void handler (int sign){
-    if (sign == SIGINT) {
-        printf("\n Uscita.. \n");
-        sleep(2); //aspetta 2 secondi prima della prossima operazione
-        printf("*Grazie per aver utilizzato il nostro servizio*\n");
-        exit(0);
-    }
-}
-
-//Invia un GP richiesto dal ServerVerifica
-void send_gp(int connect_fd) {
-    char report, ID[ID_SIZE];
-    int fd;
-    GP_REQUEST gp;
-
-    //Riceve il numero di tessera dal ServerVerifica
-    if (full_read(connect_fd, ID, ID_SIZE) < 0) {
-        perror("full_read() error");
-        exit(1);
-    }
-    //Apre il file rinominato "ID", cioè il codice ricevuto dal ServerVerifica
-    fd = open(ID, O_RDONLY, 0777);
-    /* Se il numero di tessera sanitaria inviato dall'AppVerifca non esiste la variabile globale errno cattura l'evento ed in quel caso
-       invia un report uguale ad 1 al ServerVerifica, che a sua volta aggiornerà l'AppVerifica dell'inesistenza del codice. In caso
-       contrario invierà un report uguale a 0 per indicare che l'operazione è avvenuta correttamente.
-    */
-    
-    if (errno == 2) {
-        printf("Numero tessera inesistente, riprovare.\n");
-        report = '2';
-        
-        if (full_write(connect_fd, &report, sizeof(char)) < 0) {
-            perror("full_write() error");
-            exit(1);
-        }
-    } else {
-
-        //Accede in modo esclusivo al file in lettura
-        if (flock(fd, LOCK_EX) < 0) {
-            perror("flock() error");
-            exit(1);
-        }
-        
-        //Lettura del GP dal file aperto
-        if (read(fd, &gp, sizeof(GP_REQUEST)) < 0) {
-            perror("read() error");
-            exit(1);
-        }
-
-            if(flock(fd, LOCK_UN) < 0) {
-            perror("flock() error");
-            exit(1);
-        }
-
-        close(fd);
-        report = '1';
-
-        //Invia il report al ServerVerifica
-        if (full_write(connect_fd, &report, sizeof(char)) < 0) {
-            perror("full_write() error");
-            exit(1);
-        }
-
-        //Mandiamo il GP richiesto al ServerVerifica che controllerà la validità
-        if(full_write(connect_fd, &gp, sizeof(GP_REQUEST)) < 0) {
-            perror("full_write() error");
-            exit(1);
-        }
-    }
-}
-
-//Modifica il report di un GP, sotto richiesta dell'ASL
-void modify_report(int connect_fd) {
-    REPORT package;
-    GP_REQUEST gp;
-    int fd;
-    char report;
-
-    //Riceve il pacchetto dal ServerVerifica proveniente dall'ASL contenente numero di tessera ed il risultato del tampone
-    if (full_read(connect_fd, &package, sizeof(REPORT)) < 0) {
-        perror("full_read() error");
-        exit(1);
-    }
-
-    //Apre il file contenente il GP relativo al numero di tessera ricevuto dall'ASL
-    fd = open(package.ID, O_RDWR , 0777);
-
-    if (errno == 2) {
-        printf("Numero tessera inesistente, riprova.\n");
-        report = '1';
-    } else {
-        //Accediamo modo esclusivo al file in lettura
-        if(flock(fd, LOCK_EX | LOCK_NB) < 0) {
-            perror("flock() error");
-            exit(1);
-        }
-        //Legge il file aperto contenente il GP relativo al numero di tessera ricevuto dall'ASL
-        if (read(fd, &gp, sizeof(GP_REQUEST)) < 0) {
-            perror("read() error");
-            exit(1);
-        }
-
-        //Assegna il report ricevuto dall'ASL al green pass
-        gp.report = package.report;
-
-        lseek(fd, 0, SEEK_SET);
-
-        //Andiamo a sovrascrivere i campi di GP nel file binario con nome il numero di tessera sanitaria del green pass
-        if (write(fd, &gp, sizeof(GP_REQUEST)) < 0) {
-            perror("write() error");
-            exit(1);
-        }
-        
-        if(flock(fd, LOCK_UN) < 0) {
-            perror("flock() error");
-            exit(1);
-        }
-        report = '0';
-    }
-
-    //Invia il report al ServerVerifica
-    if (full_write(connect_fd, &report, sizeof(char)) < 0) {
-        perror("full_write() error");
-        exit(1);
-    }
-}
-
-//Funzione che tratta la comunicazione con il ServerVerifica, ricava il GP dal file system relativo al numero di tessera ricevuto e lo invia al ServerVerifica.
-void SV_comunication(int connect_fd) {
-    char start_bit;
-
-    /*
-        Il ServerVaccinale riceve un bit dal ServerVerifica, che può essere 0 o 1, siccome sono due funzioni differenti.
-        Quando riceve 0  il ServerVaccinale gestirà la funzione per modificare il report di un GP.
-        Quando riceve 1  il ServerVaccinale gestirà la funzione per inviare un GP al ServerVerifica.
-    */
-    if (full_read(connect_fd, &start_bit, sizeof(char)) < 0) {
-        perror("full_read() error");
-        exit(1);
-    }
-    if (start_bit == '0') modify_report(connect_fd);
-    else if (start_bit == '1') send_gp(connect_fd);
-    else printf("Dato non valido\n\n");
-}
-
-//Funzione che tratta la comunicazione con il CentroVaccinale e salva i dati ricevuti da questo in un filesystem.
-void CV_comunication(int connect_fd) {
-    int fd;
-    GP_REQUEST gp;
-
-    //Riceve il GP dal CentroVaccinale
-    if (full_read(connect_fd, &gp, sizeof(GP_REQUEST)) < 0) {
-        perror("full_write() error");
-        exit(1);
-    }
-
-    //Quando viene generato un nuovo green pass è valido di defualt
-    gp.report = '1';
-
-    //Per ogni Tessera Sanitaria crea un file contenente i dati ricevuti.
-    if ((fd = open(gp.ID, O_WRONLY| O_CREAT | O_TRUNC, 0777)) < 0) {
-        perror("open() error");
-        exit(1);
-    }
-    //Andiamo a scrivere i campi di GP nel file binario con nome il numero di tessera sanitaria del green pass
-    if (write(fd, &gp, sizeof(GP_REQUEST)) < 0) {
-        perror("write() error");
-        exit(1);
-    }
-
-    close(fd);
-}
-
-int main() {
-    int listen_fd, connect_fd, package_size;
-    struct sockaddr_in serv_addr;
-    pid_t pid;
-    char start_bit;
-    signal(SIGINT,handler); //Cattura il segnale
-    //Creazione del socket
-    if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket() error");
-        exit(1);
-    }
-
-    //Valorizzazione strutture
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons(1025);
-
-    //Assegnazione della porta al server
-    if (bind(listen_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("bind() error");
-        exit(1);
-    }
-
-    //Mette il socket in ascolto in attesa di nuove connessioni
-    if (listen(listen_fd, 1024) < 0) {
-        perror("listen() error");
-        exit(1);
-    }
-
-    for (;;) {
-
-    printf("In attesa di nuovi dati\n\n");
-
-        //Accetta una nuova connessione
-        if ((connect_fd = accept(listen_fd, (struct sockaddr *)NULL, NULL)) < 0) {
-            perror("accept() error");
-            exit(1);
-        }
-
-        //Creazione del figlio;
-        if ((pid = fork()) < 0) {
-            perror("fork() error");
-            exit(1);
-        }
-
-        //Porzione di codice eseguita dal figlio
-        if (pid == 0) {
-            close(listen_fd);
-
-            /*
-                Il ServerVaccinale riceve un bit come primo messaggio, che può essere 0 o 1, siccome ci sono due connessioni differenti.
-                Quando riceve 1 il figlio gestirà la connessione con il CentroVaccinale.
-                Quando riceve 0 il figlio gestirà la connessione con il ServerVerifica.
-            */
-
-            if (full_read(connect_fd, &start_bit, sizeof(char)) < 0) {
-                perror("full_read() error");
-                exit(1);
-            }
-            if (start_bit == '1') CV_comunication(connect_fd);
-            else if (start_bit == '0') SV_comunication(connect_fd);
-            else printf("Client non riconosciuto\n\n");
-
-            close(connect_fd);
-            exit(0);
-        } else close(connect_fd);
-    }
-    exit(0);
+#define _GNU_SOURCE     // necessario per accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>      // libreria C per la gestione delle situazioni di errore.
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>   // libreria C per la mappatura dei file in memoria
+#include <sys/types.h>
+#include <sys/socket.h> // libreria C per i socket
+#include <sys/epoll.h>  // libreria C per il multiplexing dell'I/O tramite epoll
+#include <sys/eventfd.h> // permette al thread del log di risvegliare i worker
+#include <netinet/tcp.h> // contiene l'opzione TCP_NODELAY
+#include <arpa/inet.h>  // contiene le definizioni per le operazioni Internet.
+#include <pthread.h>    // libreria C per i thread POSIX
+#include <time.h>
+#include <signal.h>     // libreria C che consente l'uso delle funzioni per la gestione dei segnali fra processi.
+#include "Protocollo.h" // frame e strutture condivise da tutti i programmi
+#include "Instradamento.h" // indirizzi delle istanze del ServerVaccinale
+#include "Archivio.h"    // formato del file dei GP e del log
+#include "Allocatore.h"  // allocatore a slab dello stato delle connessioni
+#include "Metriche.h"    // latenze e contatori delle richieste esposti sulla porta di amministrazione
+#define MAX_SIZE 2048   // dimensione max del buf
+#define OUT_SIZE 16384  // dimensione del buffer di uscita di una connessione
+#define MAX_RESPONSE (PROTO_HEADER_SIZE + 2 + MAX_BATCH * (1 + PROTO_GP_SIZE) + 16) // dimensione della risposta più grande inviata dal server
+#define MAX_EVENTS 256  //numero massimo di eventi restituiti da una epoll_wait
+#define MAX_WORKER 64   //numero massimo di thread worker
+#define MAX_BATCH 128   //numero massimo di tessere in una richiesta di verifica a blocchi
+#define INDEX_CAPACITY 1024 //capacità iniziale dell'indice dei green pass, deve essere una potenza di 2
+#define STORE_MAGIC_V1 "GPSTORE" //slot con le date del calendario, convertito all'avvio
+#define STORE_MAGIC_V2 "GPSTOR2" //slot con i giorni di validità ma senza chiave della tessera, convertito all'avvio
+#define WAL_HISTORY 65536 //ultimi record del log conservati in memoria per le repliche
+#define REPL_STATUS_INTERVAL 10 //secondi tra due stampe del ritardo di una replica
+#define ADMIN_PORT_OFFSET 8000 //la porta delle metriche predefinita è la porta del server più ADMIN_PORT_OFFSET
+#define ACCEPT_RETRY_MS 100 //attesa prima di ritentare l'accept dopo un errore come descrittori esauriti
+
+/* Indice dei green pass: tabella hash ad indirizzamento aperto con scansione lineare, indicizzata dal numero di tessera.
+   La tabella è il file dei GP mappato in memoria, quindi le letture non richiedono system call.
+   Le modifiche sono eseguite da un solo writer alla volta (write_lock). I lettori non prendono write_lock: leggono ogni slot
+   con il suo seqlock e ripetono la lettura se il writer lo stava modificando, quindi non attendono mai un'emissione o un report. */
+typedef struct {
+    STORE_HEADER *header;   //inizio della mappatura
+    GP_SLOT *slots;
+    size_t capacity;    //numero di slot, sempre una potenza di 2
+    size_t count;       //GP presenti nell'indice
+    int fd;
+    pthread_rwlock_t lock;          //in scrittura solo per sostituire la mappatura quando l'indice cresce
+    pthread_mutex_t write_lock;     //serializza le modifiche all'indice ed il loro ordine nel log
+    pthread_mutex_t checkpoint_lock; //serializza i checkpoint e la sostituzione del file durante la crescita
+} GP_INDEX;
+
+//GP, slot e record del log del formato STORE_MAGIC_V1, in cui inizio e scadenza erano date del calendario. Servono solo alla conversione
+typedef struct {
+    char ID[ID_SIZE];
+    char report;
+    DATE start_date;
+    DATE expire_date;
+} GP_V1;
+
+typedef struct {
+    GP_V1 gp;
+    unsigned int seq;
+} __attribute__((aligned(64))) GP_SLOT_V1;
+
+typedef struct {
+    unsigned int checksum;
+    char type;
+    GP_V1 gp;
+} LOG_RECORD_V1;
+
+//Slot del formato STORE_MAGIC_V2, in cui lo slot non conteneva la chiave e la posizione dipendeva dall'hash dei caratteri della tessera
+typedef struct {
+    GP_REQUEST gp;
+    unsigned int seq;
+} __attribute__((aligned(64))) GP_SLOT_V2;
+
+//Thread che invia i record del log ad una replica o ad un ServerVerifica: il segmento che contiene il suo prossimo record non viene cancellato
+typedef struct WAL_READER {
+    unsigned long next;         //prossimo record da inviare, aggiornato atomicamente
+    int fd;                     //segmento aperto per leggere i record non più in memoria, -1 se assente
+    unsigned long fd_segment;
+    struct WAL_READER *next_reader;
+} WAL_READER;
+
+//Log delle modifiche, diviso in segmenti. I record vengono accodati in memoria e scritti su disco a gruppi dal thread di group commit
+typedef struct {
+    pthread_mutex_t lock;       //protegge i buffer ed i contatori
+    pthread_mutex_t flush_lock; //serializza le scritture sul segmento corrente
+    pthread_cond_t pending;     //segnala al thread di group commit ed ai thread delle tessere che ci sono nuovi record
+    char *buf, *spare;          //record in attesa di essere scritti e buffer di riserva
+    size_t len, cap, spare_cap;
+    unsigned long lsn;          //numero dell'ultimo record accodato
+    unsigned long durable_lsn;  //numero dell'ultimo record sincronizzato su disco
+    unsigned long records;      //record accodati dall'ultimo checkpoint
+    unsigned long segment;      //segmento corrente
+    unsigned long first_segment; //segmento più vecchio ancora presente su disco
+    int fd;
+    LOG_RECORD *history;        //ultimi WAL_HISTORY record accodati, il record lsn sta in history[lsn % WAL_HISTORY]
+    unsigned long *segment_lsn; //primo record di ogni segmento aperto dall'avvio: il segmento run_segment + i inizia con segment_lsn[i]
+    unsigned long run_segment;
+    size_t n_segments;
+    WAL_READER *readers;        //thread che inviano il log, protetti da lock
+    pthread_cond_t synced;      //segnalata ad ogni sincronizzazione, risveglia i thread che inviano le modifiche alle repliche
+} WAL;
+
+//Stato di un ServerVaccinale avviato come replica: posizione nel flusso delle modifiche del primario e ritardo rispetto ad esso
+typedef struct {
+    SHARD_NODE primary;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;       //segnalata quando la prima copia dei GP è stata ricevuta
+    int synced;                 //1 dopo la prima copia completa: solo allora la replica accetta connessioni
+    int connected;
+    unsigned long primary_run;  //segmento di avvio del primario, con applied_lsn forma la posizione inviata con i GP
+    unsigned long applied_lsn;  //ultimo record del primario applicato
+    unsigned long primary_lsn;  //ultimo record sincronizzato dal primario secondo l'ultimo frame ricevuto
+    long lag_ns;                //ritardo dell'ultimo frame: istante di applicazione meno istante di invio dal primario
+    time_t last_frame;          //istante di ricezione dell'ultimo frame
+} REPLICA;
+
+//Stato di una connessione. I socket sono non bloccanti, quindi i byte ricevuti e quelli da inviare vengono accumulati nei buffer
+typedef struct CONNECTION {
+    int fd;
+    struct WORKER *worker;
+    unsigned long commit_lsn;   //record del log che deve essere su disco prima di inviare le risposte accodate
+    struct CONNECTION *park_prev, *park_next; //connessioni in attesa della sincronizzazione del log
+    int parked;
+    int subscription;   //MSG_REPL_SUBSCRIBE o MSG_FILTER_SUBSCRIBE ricevuto: la connessione passa ad un thread che invia le modifiche
+    METRIC_WAIT wait;   //richieste le cui risposte attendono la sincronizzazione del log, misurate quando partono
+    size_t in_len;      //byte ricevuti presenti in "in"
+    size_t out_len;     //byte da inviare presenti in "out"
+    size_t out_off;     //byte di "out" già inviati
+    char *in;           //MAX_SIZE byte del pool, presente solo mentre ci sono byte ricevuti da elaborare
+    char *out;          //OUT_SIZE byte del pool, presente solo mentre ci sono risposte da inviare
+} CONNECTION;
+
+//Thread worker: ogni worker ha la propria istanza epoll e serve le connessioni che gli assegna il thread principale
+typedef struct WORKER {
+    pthread_t tid;
+    int epoll_fd;
+    int event_fd;           //risveglia il worker quando il log è stato sincronizzato su disco
+    CONNECTION *parked;     //connessioni con risposte in attesa della sincronizzazione del log
+    POOL_CACHE cache;       //oggetti liberi del pool delle connessioni usati dal worker
+} WORKER;
+
+WORKER workers[MAX_WORKER];
+POOL conn_pool;             //stato delle connessioni ed i loro buffer: una connessione inattiva occupa solo il proprio CONNECTION
+int n_workers;
+GP_INDEX gp_index;
+WAL wal;
+int fsync_interval = 0;     //millisecondi tra due sincronizzazioni del log, 0 per confermare le modifiche solo dopo la sincronizzazione
+int checkpoint_interval = 60; //secondi tra due checkpoint
+int recovering;             //vale 1 durante la riapplicazione del log all'avvio
+int is_replica;             //vale 1 se il server è una replica: le modifiche arrivano solo dal primario
+REPLICA replica = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+//Operazioni misurate, con il tipo della richiesta ed il nome della funzione che la serve
+enum { REQ_CV_COMUNICATION, REQ_CV_COMUNICATION_BATCH, REQ_SEND_GP, REQ_SEND_GP_BATCH, REQ_MODIFY_REPORT, N_REQ };
+const char *const req_names[N_REQ] = {"CV_comunication", "CV_comunication_batch", "send_gp", "send_gp_batch", "modify_report"};
+const unsigned int req_types[N_REQ] = {MSG_GP_ISSUE, MSG_GP_ISSUE_BATCH, MSG_GP_LOOKUP, MSG_GP_LOOKUP_BATCH, MSG_REPORT_UPDATE};
+METRICS metrics;
+
+//Legge esattamente count byte s iterando opportunamente le letture. Usata solo sui socket bloccanti della replicazione.
+ssize_t full_read(int fd, void *buf, size_t count) {
+    size_t nleft;
+    ssize_t nread;
+    nleft = count;
+    while (nleft > 0) {  // ripeti finchè non ci sono left
+        if ((nread = read(fd, buf, nleft)) < 0) {
+            if (errno == EINTR) continue; // Se si verifica una System Call che interrompe ripeti il ciclo
+            else return -1;
+        } else if (nread == 0) break; // Se sono finiti, esci
+        nleft -= nread;
+        buf += nread;
+    }
+    return nleft;
+}
+
+//Scrive esattamente count byte s iterando opportunamente le scritture. Usata solo sui socket bloccanti della replicazione.
+ssize_t full_write(int fd, const void *buf, size_t count) {
+    size_t nleft;
+    ssize_t nwritten;
+    nleft = count;
+    while (nleft > 0) {          //ripeti finchè non ci sono left
+        if ((nwritten = write(fd, buf, nleft)) < 0) {
+            if (errno == EINTR) continue; //Se si verifica una System Call che interrompe ripeti il ciclo
+            else return -1;
+        }
+        nleft -= nwritten;
+        buf += nwritten;
+    }
+    return nleft;
+}
+
+//Handler che cattura il segnale CTRL-C e stampa un messaggio di arrivederci.
+void handler (int sign){
+    if (sign == SIGINT) {
+        printf("\n Uscita.. \n");
+        sleep(2); //aspetta 2 secondi prima della prossima operazione
+        printf("*Grazie per aver utilizzato il nostro servizio*\n");
+        exit(0);
+    }
+}
+
+//Accoda count byte nel buffer di uscita della connessione, verranno inviati da conn_flush()
+int conn_write(CONNECTION *conn, const void *buf, size_t count) {
+    if (conn->out_len + count > OUT_SIZE) return -1;
+    if (conn->out == NULL && (conn->out = pool_alloc(&conn_pool, &conn->worker->cache, OUT_SIZE)) == NULL) return -1;
+    memcpy(conn->out + conn->out_len, buf, count);
+    conn->out_len += count;
+    return 0;
+}
+
+//Mette la connessione in attesa della sincronizzazione del log
+void conn_park(CONNECTION *conn) {
+    if (conn->parked) return;
+    conn->parked = 1;
+    conn->park_prev = NULL;
+    conn->park_next = conn->worker->parked;
+    if (conn->park_next != NULL) conn->park_next->park_prev = conn;
+    conn->worker->parked = conn;
+}
+
+//Toglie la connessione dalla lista di quelle in attesa della sincronizzazione del log
+void conn_unpark(CONNECTION *conn) {
+    if (!conn->parked) return;
+    conn->parked = 0;
+    if (conn->park_prev != NULL) conn->park_prev->park_next = conn->park_next;
+    else conn->worker->parked = conn->park_next;
+    if (conn->park_next != NULL) conn->park_next->park_prev = conn->park_prev;
+}
+
+//Libera lo stato della connessione ed i suoi buffer, restituendoli alla lista del worker
+void conn_free(CONNECTION *conn) {
+    POOL_CACHE *cache = &conn->worker->cache;
+
+    //Le risposte ancora in attesa del log non verranno inviate
+    metric_wait_end(&metrics, &conn->wait, 1);
+    pool_free(&conn_pool, cache, conn->in, MAX_SIZE);
+    pool_free(&conn_pool, cache, conn->out, OUT_SIZE);
+    pool_free(&conn_pool, cache, conn, sizeof(CONNECTION));
+}
+
+//Chiude la connessione e ne libera lo stato
+void conn_close(CONNECTION *conn) {
+    conn_unpark(conn);
+    close(conn->fd); //La close rimuove anche il descrittore dall'istanza epoll
+    conn_free(conn);
+}
+
+//Invia il buffer di uscita finché il socket lo accetta. Se il socket è pieno l'invio riprende al prossimo evento EPOLLOUT.
+int conn_flush(CONNECTION *conn) {
+    ssize_t nwritten;
+
+    //Le risposte alle modifiche partono solo quando il relativo record del log è su disco
+    if (fsync_interval == 0 && conn->commit_lsn > __atomic_load_n(&wal.durable_lsn, __ATOMIC_ACQUIRE)) {
+        conn_park(conn);
+        return 0;
+    }
+    metric_wait_end(&metrics, &conn->wait, 0);
+
+    while (conn->out_off < conn->out_len) {
+        if ((nwritten = write(conn->fd, conn->out + conn->out_off, conn->out_len - conn->out_off)) < 0) {
+            if (errno == EINTR) continue; //Se si verifica una System Call che interrompe ripeti il ciclo
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        conn->out_off += nwritten;
+    }
+    //Sposta in testa i byte non ancora inviati per liberare spazio nel buffer, che torna al pool quando è stato inviato per intero
+    conn->out_len -= conn->out_off;
+    if (conn->out_len > 0) memmove(conn->out, conn->out + conn->out_off, conn->out_len);
+    else if (conn->out != NULL) {
+        pool_free(&conn_pool, &conn->worker->cache, conn->out, OUT_SIZE);
+        conn->out = NULL;
+    }
+    conn->out_off = 0;
+    return 0;
+}
+
+//Come index_probe, sull'indice corrente
+GP_SLOT *index_find(GP_KEY key) {
+    return index_probe(gp_index.slots, gp_index.capacity, key);
+}
+
+//Inizio della modifica di uno slot da parte del writer: il seqlock diventa dispari prima di qualunque scrittura sul GP
+void slot_write_begin(GP_SLOT *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+//Fine della modifica: il seqlock torna pari dopo tutte le scritture sul GP
+void slot_write_end(GP_SLOT *slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+//Copia il GP di uno slot senza lock. Se il writer lo sta modificando la copia viene ripetuta, quindi non è mai parziale.
+void slot_read(GP_SLOT *slot, GP_REQUEST *gp) {
+    unsigned int seq;
+
+    //Un seqlock dispari indica solo una modifica in corso: quelli rimasti dispari da un crash sono riportati pari da store_repair
+    for (;;) {
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) continue;
+        memcpy(gp, &slot->gp, sizeof(GP_REQUEST));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) return;
+    }
+}
+
+/* Cerca un GP senza bloccarsi sulle modifiche. Va chiamata con gp_index.lock acquisito in lettura, che esclude solo la sostituzione
+   della mappatura durante la crescita. Ritorna 1 e copia il GP in gp se la tessera esiste, 0 altrimenti. */
+int index_lookup(GP_KEY key, GP_REQUEST *gp) {
+    size_t i = key_hash(key) & (gp_index.capacity - 1);
+    GP_KEY found;
+
+    /* La scansione legge solo le chiavi, il GP viene copiato con il seqlock solo dallo slot cercato. Il writer scrive la chiave
+       dopo aver reso dispari il seqlock: uno slot che sta occupando viene visto libero oppure già completo, mai a metà. */
+    for (;; i = (i + 1) & (gp_index.capacity - 1)) {
+        found = __atomic_load_n(&gp_index.slots[i].key, __ATOMIC_ACQUIRE);
+        if (found == 0) return 0;
+        if (found == key) {
+            slot_read(&gp_index.slots[i], gp);
+            return 1;
+        }
+    }
+}
+
+//Sincronizza su disco la directory corrente, così la creazione e la rinomina dei file sopravvivono ad un crash
+void sync_dir() {
+    int fd;
+
+    if ((fd = open(".", O_RDONLY | O_DIRECTORY)) < 0) {
+        perror("open() error");
+        return;
+    }
+    if (fsync(fd) < 0) perror("fsync() error");
+    close(fd);
+}
+
+/* Crea il segmento del log con il numero indicato e lo rende il segmento corrente. Viene chiamata senza record accodati o con
+   gp_index.write_lock acquisito, quindi il primo record del segmento è il prossimo record accodato. */
+void wal_open_segment(unsigned long segment) {
+    unsigned long *segment_lsn;
+    char path[64];
+
+    snprintf(path, sizeof(path), WAL_FILE, segment);
+    if ((wal.fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0666)) < 0) {
+        perror("open() error");
+        exit(1);
+    }
+
+    //Posizione dei record nei segmenti, per rileggere quelli non più in memoria
+    pthread_mutex_lock(&wal.lock);
+    if ((segment_lsn = realloc(wal.segment_lsn, (wal.n_segments + 1) * sizeof(unsigned long))) == NULL) {
+        perror("realloc() error");
+        exit(1);
+    }
+    if (wal.n_segments == 0) wal.run_segment = segment;
+    wal.segment_lsn = segment_lsn;
+    wal.segment_lsn[wal.n_segments++] = wal.lsn + 1;
+    wal.segment = segment;
+    pthread_mutex_unlock(&wal.lock);
+    sync_dir();
+}
+
+//Indice in wal.segment_lsn del segmento che contiene il record lsn, accodato dopo l'avvio. Va chiamata con wal.lock acquisito.
+size_t wal_segment_of(unsigned long lsn) {
+    size_t i = wal.n_segments - 1;
+
+    while (i > 0 && wal.segment_lsn[i] > lsn) i--;
+    return i;
+}
+
+//Accoda un record al log. Viene chiamata con gp_index.write_lock acquisito, così l'ordine del log è quello delle modifiche. Ritorna il numero del record.
+unsigned long wal_append(char type, GP_REQUEST *gp) {
+    LOG_RECORD record;
+    unsigned long lsn;
+    char *buf;
+
+    memset(&record, 0, sizeof(LOG_RECORD));
+    record.type = type;
+    record.gp = *gp;
+    record.checksum = log_checksum(&record);
+
+    pthread_mutex_lock(&wal.lock);
+    if (wal.len + sizeof(LOG_RECORD) > wal.cap) {
+        if ((buf = realloc(wal.buf, wal.cap * 2 + 64 * sizeof(LOG_RECORD))) == NULL) {
+            perror("realloc() error");
+            exit(1);
+        }
+        wal.buf = buf;
+        wal.cap = wal.cap * 2 + 64 * sizeof(LOG_RECORD);
+    }
+    memcpy(wal.buf + wal.len, &record, sizeof(LOG_RECORD));
+    wal.len += sizeof(LOG_RECORD);
+    wal.records++;
+    //La scrittura con rilascio rende visibile la modifica dell'indice a chi legge il nuovo numero in log_position
+    lsn = wal.lsn + 1;
+    __atomic_store_n(&wal.lsn, lsn, __ATOMIC_RELEASE);
+    wal.history[lsn % WAL_HISTORY] = record;
+    pthread_cond_broadcast(&wal.pending); //risveglia il thread di group commit ed i thread che inviano le tessere ai ServerVerifica
+    pthread_mutex_unlock(&wal.lock);
+
+    return lsn;
+}
+
+/* Scrive sul segmento corrente i record accodati e li sincronizza su disco: tutti i record accodati dall'ultima sincronizzazione
+   condividono la stessa fdatasync (group commit). Va chiamata con wal.flush_lock acquisito. */
+void wal_commit() {
+    char *buf;
+    size_t len, cap, off = 0;
+    unsigned long lsn, one = 1;
+    ssize_t nwritten;
+    int i;
+
+    //Scambia il buffer con quello di riserva: i worker continuano ad accodare record mentre questi vengono scritti
+    pthread_mutex_lock(&wal.lock);
+    buf = wal.buf;
+    len = wal.len;
+    cap = wal.cap;
+    lsn = wal.lsn;
+    wal.buf = wal.spare;
+    wal.cap = wal.spare_cap;
+    wal.len = 0;
+    pthread_mutex_unlock(&wal.lock);
+
+    while (off < len) {
+        if ((nwritten = write(wal.fd, buf + off, len - off)) < 0) {
+            if (errno == EINTR) continue;
+            perror("write() error"); //Senza il log le modifiche non sarebbero più durevoli
+            exit(1);
+        }
+        off += nwritten;
+    }
+    if (len > 0 && fdatasync(wal.fd) < 0) {
+        perror("fdatasync() error");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&wal.lock);
+    wal.spare = buf;
+    wal.spare_cap = cap;
+    __atomic_store_n(&wal.durable_lsn, lsn, __ATOMIC_RELEASE);
+    if (len > 0) pthread_cond_broadcast(&wal.synced); //Alle repliche vengono inviati solo i record già su disco
+    pthread_mutex_unlock(&wal.lock);
+
+    //Risveglia i worker che hanno risposte in attesa della sincronizzazione
+    if (len > 0 && fsync_interval == 0)
+        for (i = 0; i < n_workers; i++)
+            if (write(workers[i].event_fd, &one, sizeof(one)) < 0) perror("write() error");
+}
+
+//Thread di group commit: con fsync_interval uguale a 0 sincronizza appena ci sono record, altrimenti ogni fsync_interval millisecondi
+void *wal_flusher(void *arg) {
+    for (;;) {
+        pthread_mutex_lock(&wal.lock);
+        while (wal.len == 0) pthread_cond_wait(&wal.pending, &wal.lock);
+        pthread_mutex_unlock(&wal.lock);
+
+        pthread_mutex_lock(&wal.flush_lock);
+        wal_commit();
+        pthread_mutex_unlock(&wal.flush_lock);
+
+        if (fsync_interval > 0) usleep(fsync_interval * 1000);
+    }
+    return NULL;
+}
+
+//Passa ad un nuovo segmento del log. Viene chiamata con gp_index.write_lock acquisito: ritorna il primo segmento con modifiche successive allo stato attuale dell'indice.
+unsigned long wal_rotate() {
+    pthread_mutex_lock(&wal.flush_lock);
+    wal_commit();
+    close(wal.fd);
+    wal_open_segment(wal.segment + 1);
+    pthread_mutex_unlock(&wal.flush_lock);
+
+    pthread_mutex_lock(&wal.lock);
+    wal.records = 0;
+    pthread_mutex_unlock(&wal.lock);
+    return wal.segment;
+}
+
+/* Cancella i segmenti del log precedenti a quello indicato, ormai contenuti nel file dei GP. Va chiamata con gp_index.checkpoint_lock acquisito.
+   I segmenti che una replica o un ServerVerifica deve ancora leggere restano su disco e vengono cancellati da un checkpoint successivo. */
+void wal_trim(unsigned long segment) {
+    WAL_READER *reader;
+    unsigned long needed;
+    char path[64];
+
+    pthread_mutex_lock(&wal.lock);
+    for (reader = wal.readers; reader != NULL; reader = reader->next_reader) {
+        needed = wal.run_segment + wal_segment_of(__atomic_load_n(&reader->next, __ATOMIC_RELAXED));
+        if (needed < segment) segment = needed;
+    }
+    pthread_mutex_unlock(&wal.lock);
+
+    for (; wal.first_segment < segment; wal.first_segment++) {
+        snprintf(path, sizeof(path), WAL_FILE, wal.first_segment);
+        unlink(path);
+    }
+}
+
+/* Mappa in memoria il file dei GP e ne descrive la mappatura in index. Con capacity diverso da 0 il file viene creato vuoto con quel
+   numero di slot. Ritorna -1 in caso di errore. */
+int store_map(GP_INDEX *index, const char *path, size_t capacity) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(path, capacity ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0666)) < 0) {
+        perror("open() error");
+        return -1;
+    }
+    if (store_lock(fd, path) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (capacity && ftruncate(fd, STORE_HEADER_SIZE + capacity * sizeof(GP_SLOT)) < 0) {
+        perror("ftruncate() error");
+        close(fd);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        perror("fstat() error");
+        close(fd);
+        return -1;
+    }
+
+    //Le pagine vengono caricate dal kernel solo quando vengono lette: l'avvio non dipende dalla dimensione del file
+    if ((map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap() error");
+        close(fd);
+        return -1;
+    }
+    index->header = map;
+    index->slots = (GP_SLOT *)((char *)map + STORE_HEADER_SIZE);
+
+    if (capacity) {
+        memcpy(index->header->magic, STORE_MAGIC, sizeof(index->header->magic));
+        index->header->capacity = capacity;
+    } else if (memcmp(index->header->magic, STORE_MAGIC, sizeof(index->header->magic)) != 0 ||
+               st.st_size != STORE_HEADER_SIZE + index->header->capacity * sizeof(GP_SLOT)) {
+        fprintf(stderr, "File %s non valido\n", path);
+        munmap(map, st.st_size);
+        close(fd);
+        return -1;
+    }
+    index->capacity = index->header->capacity;
+    index->fd = fd;
+    return 0;
+}
+
+/* Un seqlock dispari nel file può solo essere stato scritto su disco durante una modifica interrotta da un crash: viene riportato pari
+   all'avvio, prima della riapplicazione del log e prima che esistano lettori, così slot_read non deve mai attendere il writer.
+   Il GP dello slot viene poi riscritto dal record del log della modifica interrotta. */
+void store_repair(GP_INDEX *index) {
+    size_t i, repaired = 0;
+
+    for (i = 0; i < index->capacity; i++) {
+        if (index->slots[i].seq & 1) {
+            index->slots[i].seq++;
+            repaired++;
+        }
+    }
+    if (repaired > 0) printf("Riparati %zu slot rimasti in modifica\n", repaired);
+}
+
+//Rende durevole il contenuto della mappatura e vi registra il checkpoint: il ripristino riparte dal segmento indicato. Va chiamata con gp_index.checkpoint_lock acquisito.
+void store_sync(unsigned long segment, unsigned long count) {
+    //Un checkpoint più recente è già stato registrato durante la crescita dell'indice
+    if (segment < gp_index.header->segment) return;
+
+    //Prima gli slot, poi l'intestazione: il checkpoint viene registrato solo quando i GP che copre sono su disco
+    if (msync(gp_index.header, STORE_HEADER_SIZE + gp_index.capacity * sizeof(GP_SLOT), MS_SYNC) < 0) {
+        perror("msync() error");
+        exit(1);
+    }
+    gp_index.header->segment = segment;
+    gp_index.header->count = count;
+    if (msync(gp_index.header, STORE_HEADER_SIZE, MS_SYNC) < 0) {
+        perror("msync() error");
+        exit(1);
+    }
+}
+
+/* Raddoppia la capacità dell'indice in un nuovo file e reinserisce tutti i GP. Viene chiamata con gp_index.write_lock acquisito:
+   mentre il nuovo file viene riempito i lettori continuano ad usare quello vecchio, il lock in scrittura serve solo a scambiare le mappature. */
+int index_grow() {
+    GP_INDEX old = gp_index, grown;
+    GP_SLOT *slot;
+    size_t i;
+    unsigned long segment, count;
+
+    pthread_mutex_lock(&gp_index.checkpoint_lock);
+    if (store_map(&grown, STORE_FILE ".tmp", old.capacity * 2) < 0) {
+        pthread_mutex_unlock(&gp_index.checkpoint_lock);
+        return -1;
+    }
+
+    //Il nuovo file è ancora privato del writer: i GP vengono copiati senza seqlock, che nel nuovo file partono da 0
+    for (i = 0; i < old.capacity; i++) {
+        if (old.slots[i].key == 0) continue;
+        slot = index_probe(grown.slots, grown.capacity, old.slots[i].key);
+        slot->gp = old.slots[i].gp;
+        slot->key = old.slots[i].key;
+    }
+
+    pthread_rwlock_wrlock(&gp_index.lock);
+    gp_index.header = grown.header;
+    gp_index.slots = grown.slots;
+    gp_index.capacity = grown.capacity;
+    gp_index.fd = grown.fd;
+    pthread_rwlock_unlock(&gp_index.lock);
+
+    /* Il nuovo file sostituisce il vecchio solo dopo essere stato sincronizzato insieme ad un checkpoint.
+       Durante il ripristino il log non è ancora aperto: il nuovo file mantiene il checkpoint di quello vecchio. */
+    if (recovering) {
+        segment = old.header->segment;
+        count = old.header->count;
+    } else {
+        segment = wal_rotate();
+        count = gp_index.count;
+    }
+    store_sync(segment, count);
+    if (rename(STORE_FILE ".tmp", STORE_FILE) < 0) {
+        perror("rename() error");
+        exit(1);
+    }
+    sync_dir();
+    if (!recovering) wal_trim(segment);
+    pthread_mutex_unlock(&gp_index.checkpoint_lock);
+
+    //Dopo lo scambio nessun lettore può più usare la vecchia mappatura
+    munmap(old.header, STORE_HEADER_SIZE + old.capacity * sizeof(GP_SLOT));
+    close(old.fd);
+    return 0;
+}
+
+/* Scrive un GP nell'indice, creandone lo slot se la tessera non esiste. key è la chiave della tessera del GP, diversa da 0.
+   Viene chiamata con gp_index.write_lock acquisito. Ritorna 1 se il GP è nuovo, 0 se ha sostituito quello esistente, -1 in caso di errore. */
+int index_put(GP_KEY key, GP_REQUEST *gp) {
+    GP_SLOT *slot;
+    int added;
+
+    //Il fattore di carico resta sotto il 70%, così le sequenze di scansione sono brevi
+    if ((gp_index.count + 1) * 10 > gp_index.capacity * 7 && index_grow() < 0) return -1;
+
+    slot = index_find(key);
+    added = (slot->key == 0);
+    slot_write_begin(slot);
+    slot->gp = *gp;
+    if (added) __atomic_store_n(&slot->key, key, __ATOMIC_RELAXED);
+    slot_write_end(slot);
+    if (added) gp_index.count++;
+    return added;
+}
+
+//Thread che esegue periodicamente un checkpoint, se dall'ultimo ci sono state modifiche
+void *checkpoint_thread(void *arg) {
+    unsigned long records, segment, count;
+
+    for (;;) {
+        sleep(checkpoint_interval);
+        pthread_mutex_lock(&wal.lock);
+        records = wal.records;
+        pthread_mutex_unlock(&wal.lock);
+        if (records == 0) continue;
+
+        /* Le modifiche sono sospese solo per il cambio di segmento, i lettori mai. La sincronizzazione avviene senza lock:
+           le modifiche successive possono finire su disco prima del checkpoint, ma stanno anche nel nuovo segmento e riapplicarle non cambia il risultato. */
+        pthread_mutex_lock(&gp_index.write_lock);
+        segment = wal_rotate();
+        count = gp_index.count;
+        pthread_mutex_unlock(&gp_index.write_lock);
+
+        pthread_mutex_lock(&gp_index.checkpoint_lock);
+        store_sync(segment, count);
+        wal_trim(segment);
+        pthread_mutex_unlock(&gp_index.checkpoint_lock);
+    }
+    return NULL;
+}
+
+//Applica all'indice un record del log durante il ripristino. Ritorna 1 se il record ha aggiunto un nuovo GP.
+int log_apply(LOG_RECORD *record) {
+    GP_KEY key = id_key(record->gp.ID);
+    GP_SLOT *slot;
+
+    //Il ripristino scrive con il seqlock come le richieste: i seqlock rimasti dispari da un crash sono già stati riportati pari da store_repair
+    if (key == 0) return 0;
+    if (record->type == 'I' || record->type == 'S') {
+        record->gp.ID[ID_SIZE - 1] = 0;
+        if (index_put(key, &record->gp) < 0) exit(1);
+    } else if (record->type == 'R') {
+        slot = index_find(key);
+        if (slot->key != 0) {
+            slot_write_begin(slot);
+            slot->gp.report = record->gp.report;
+            slot_write_end(slot);
+        }
+    }
+    return record->type == 'I';
+}
+
+//Converte un GP del formato STORE_MAGIC_V1
+void gp_from_v1(const GP_V1 *old, GP_REQUEST *gp) {
+    memset(gp, 0, sizeof(GP_REQUEST));
+    memcpy(gp->ID, old->ID, ID_SIZE);
+    gp->report = old->report;
+    gp->start_day = days_from_date(&old->start_date);
+    gp->expire_day = days_from_date(&old->expire_date);
+}
+
+/* Riscrive nel formato attuale un segmento del log del formato STORE_MAGIC_V1. Un segmento il cui primo record ha una checksum valida
+   nel formato attuale è già stato convertito. Ritorna 0, -1 se il segmento non esiste. */
+int wal_upgrade(unsigned long segment) {
+    LOG_RECORD_V1 old;
+    LOG_RECORD record;
+    char path[64], tmp[72];
+    FILE *in, *out;
+
+    snprintf(path, sizeof(path), WAL_FILE, segment);
+    if ((in = fopen(path, "r")) == NULL) return -1;
+    if (fread(&record, sizeof(LOG_RECORD), 1, in) == 1 && record.checksum == log_checksum(&record)) {
+        fclose(in);
+        return 0;
+    }
+    rewind(in);
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((out = fopen(tmp, "w")) == NULL) {
+        perror("fopen() error");
+        exit(1);
+    }
+    //Come nel ripristino, la coda di una scrittura interrotta viene scartata
+    while (fread(&old, sizeof(LOG_RECORD_V1), 1, in) == 1 &&
+           old.checksum == checksum((char *)&old + sizeof(old.checksum), sizeof(LOG_RECORD_V1) - sizeof(old.checksum))) {
+        memset(&record, 0, sizeof(LOG_RECORD));
+        record.type = old.type;
+        gp_from_v1(&old.gp, &record.gp);
+        record.checksum = log_checksum(&record);
+        fwrite(&record, sizeof(LOG_RECORD), 1, out);
+    }
+    fclose(in);
+    if (fflush(out) != 0 || fsync(fileno(out)) < 0 || fclose(out) != 0 || rename(tmp, path) < 0) {
+        perror("wal_upgrade() error");
+        exit(1);
+    }
+    return 0;
+}
+
+/* Converte nel formato attuale il file dei GP dei formati precedenti: STORE_MAGIC_V1, di cui vanno convertiti anche i segmenti del log,
+   e STORE_MAGIC_V2, che ha lo stesso log. Prima i segmenti, poi il file: finché il file non è stato sostituito un crash fa ripartire la
+   conversione dall'inizio, e i segmenti già convertiti vengono saltati. I GP vengono reinseriti in base alla chiave della tessera;
+   quelli con una tessera non alfanumerica, accettata dalle versioni precedenti, non possono essere indicizzati e vengono scartati. */
+void store_upgrade() {
+    STORE_HEADER header;
+    GP_SLOT_V1 *old_v1;
+    GP_SLOT_V2 *old_v2;
+    GP_SLOT *slot;
+    GP_INDEX upgraded;
+    GP_REQUEST gp;
+    GP_KEY key;
+    unsigned long segment, dropped = 0;
+    size_t i, size;
+    void *map;
+    int fd, v1;
+
+    if ((fd = open(STORE_FILE, O_RDONLY)) < 0) return;
+    if (read(fd, &header, sizeof(STORE_HEADER)) != sizeof(STORE_HEADER) ||
+        (!(v1 = memcmp(header.magic, STORE_MAGIC_V1, sizeof(header.magic)) == 0) && memcmp(header.magic, STORE_MAGIC_V2, sizeof(header.magic)) != 0)) {
+        close(fd);
+        return;
+    }
+    printf("Conversione di %s al formato attuale\n", STORE_FILE);
+
+    if (v1) for (segment = header.segment; wal_upgrade(segment) == 0; segment++);
+
+    size = STORE_HEADER_SIZE + header.capacity * (v1 ? sizeof(GP_SLOT_V1) : sizeof(GP_SLOT_V2));
+    if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        perror("mmap() error");
+        exit(1);
+    }
+    old_v1 = (GP_SLOT_V1 *)((char *)map + STORE_HEADER_SIZE);
+    old_v2 = (GP_SLOT_V2 *)((char *)map + STORE_HEADER_SIZE);
+    if (store_map(&upgraded, STORE_FILE ".tmp", header.capacity) < 0) exit(1);
+    for (i = 0; i < header.capacity; i++) {
+        if (v1 && old_v1[i].gp.ID[0] != 0) gp_from_v1(&old_v1[i].gp, &gp);
+        else if (!v1 && old_v2[i].gp.ID[0] != 0) gp = old_v2[i].gp;
+        else continue;
+        if ((key = id_key(gp.ID)) == 0) {
+            printf("GP della tessera non valida %.*s scartato\n", ID_SIZE - 1, gp.ID);
+            dropped++;
+            continue;
+        }
+        slot = index_probe(upgraded.slots, upgraded.capacity, key);
+        slot->gp = gp;
+        slot->key = key;
+    }
+    upgraded.header->segment = header.segment;
+    upgraded.header->count = header.count > dropped ? header.count - dropped : 0;
+
+    if (msync(upgraded.header, STORE_HEADER_SIZE + upgraded.capacity * sizeof(GP_SLOT), MS_SYNC) < 0) {
+        perror("msync() error");
+        exit(1);
+    }
+    munmap(upgraded.header, STORE_HEADER_SIZE + upgraded.capacity * sizeof(GP_SLOT));
+    close(upgraded.fd);
+    munmap(map, size);
+    close(fd);
+    if (rename(STORE_FILE ".tmp", STORE_FILE) < 0) {
+        perror("rename() error");
+        exit(1);
+    }
+    sync_dir();
+}
+
+/* Apre il file dei GP all'avvio e riapplica i segmenti del log successivi all'ultimo checkpoint. Il file non viene letto:
+   l'indice è la mappatura stessa, quindi il tempo di avvio dipende solo dalla lunghezza del log. */
+void storage_recover() {
+    LOG_RECORD record;
+    FILE *fp;
+    unsigned long segment, inserted = 0;
+    char path[64];
+
+    pthread_rwlock_init(&gp_index.lock, NULL);
+    pthread_mutex_init(&gp_index.write_lock, NULL);
+    pthread_mutex_init(&gp_index.checkpoint_lock, NULL);
+    pthread_mutex_init(&wal.lock, NULL);
+    pthread_mutex_init(&wal.flush_lock, NULL);
+    pthread_cond_init(&wal.pending, NULL);
+    pthread_cond_init(&wal.synced, NULL);
+    if ((wal.history = malloc(WAL_HISTORY * sizeof(LOG_RECORD))) == NULL) {
+        perror("malloc() error");
+        exit(1);
+    }
+
+    store_upgrade();
+    if (access(STORE_FILE, F_OK) == 0) {
+        if (store_map(&gp_index, STORE_FILE, 0) < 0) exit(1);
+    } else {
+        if (store_map(&gp_index, STORE_FILE, INDEX_CAPACITY) < 0) exit(1);
+        sync_dir();
+    }
+    store_repair(&gp_index);
+    recovering = 1;
+    gp_index.count = gp_index.header->count;
+    segment = wal.first_segment = gp_index.header->segment;
+
+    //I segmenti precedenti al checkpoint rimasti per una replica prima del riavvio vengono cancellati dal prossimo checkpoint
+    for (;; wal.first_segment--) {
+        if (wal.first_segment == 0) break;
+        snprintf(path, sizeof(path), WAL_FILE, wal.first_segment - 1);
+        if (access(path, F_OK) != 0) break;
+    }
+
+    //I segmenti sono numerati in modo consecutivo: la riapplicazione si ferma al primo segmento mancante
+    for (;; segment++) {
+        snprintf(path, sizeof(path), WAL_FILE, segment);
+        if ((fp = fopen(path, "r")) == NULL) break;
+
+        //Un record incompleto o con checksum errata è la coda di una scrittura interrotta: il resto del segmento viene ignorato
+        while (fread(&record, sizeof(LOG_RECORD), 1, fp) == 1 && record.checksum == log_checksum(&record)) {
+            inserted += log_apply(&record);
+            wal.records++;
+        }
+        fclose(fp);
+    }
+
+    /* Il numero di GP del checkpoint più quelli aggiunti dal log è esatto anche se, prima del crash,
+       il kernel aveva già scritto su disco parte degli slot successivi al checkpoint */
+    gp_index.count = gp_index.header->count + inserted;
+    recovering = 0;
+
+    //Le nuove modifiche vanno in un segmento nuovo, così un'eventuale coda troncata resta alla fine del proprio segmento
+    wal_open_segment(segment);
+}
+
+//Cerca il GP relativo al numero di tessera ricevuto. Ritorna '1' se il GP esiste, '2' se il numero di tessera è inesistente, -1 in caso di errore.
+int lookup_gp(char ID[], GP_REQUEST *gp) {
+    GP_KEY key = id_key(ID);
+    int found = 0;
+
+    //La ricerca avviene solo in memoria e senza attendere il writer: più worker possono leggere contemporaneamente
+    if (key != 0) {
+        pthread_rwlock_rdlock(&gp_index.lock);
+        found = index_lookup(key, gp);
+        pthread_rwlock_unlock(&gp_index.lock);
+    }
+
+    /* Se il numero di tessera sanitaria inviato dall'AppVerifca non esiste invia un report uguale ad 2 al ServerVerifica,
+       che a sua volta aggiornerà l'AppVerifica dell'inesistenza del codice. Il server non stampa nulla: la verifica è il percorso più
+       frequente e l'esito arriva comunque all'AppVerifica. */
+    if (!found) return '2';
+    return '1';
+}
+
+/* Assegna al GP il report ricevuto dall'ASL. Ritorna '0' se l'operazione è avvenuta, '1' se il numero di tessera è inesistente, -1 in caso di errore.
+   In lsn viene restituito il record del log che deve essere su disco prima di confermare la modifica. */
+int update_report(REPORT *package, unsigned long *lsn) {
+    GP_KEY key = id_key(package->ID);
+    GP_SLOT *slot;
+    int report = '0';
+
+    if (key == 0) return '1';
+    pthread_mutex_lock(&gp_index.write_lock);
+    slot = index_find(key);
+
+    if (slot->key == 0) {
+        printf("Numero tessera inesistente, riprova.\n");
+        report = '1';
+    } else {
+        //Assegna il report ricevuto dall'ASL al green pass e registra la modifica nel log. Le scansioni in corso non attendono.
+        slot_write_begin(slot);
+        slot->gp.report = package->report;
+        slot_write_end(slot);
+        *lsn = wal_append('R', &slot->gp);
+    }
+    pthread_mutex_unlock(&gp_index.write_lock);
+    return report;
+}
+
+//Accoda un frame completato con proto_end. Ritorna -1 se il frame non può essere accodato.
+int conn_send(CONNECTION *conn, PROTO_WRITER *w) {
+    if (proto_end(w) < 0) return -1;
+    return conn_write(conn, w->data, w->len);
+}
+
+/* Posizione nel log del primario fino alla quale l'indice è aggiornato: il primario è sempre aggiornato, una replica fino all'ultimo record
+   applicato. Va letta prima di cercare i GP, così i GP inviati contengono almeno le modifiche fino alla posizione. */
+void log_position(LOG_POSITION *position) {
+    if (is_replica) {
+        pthread_mutex_lock(&replica.lock);
+        position->run = replica.primary_run;
+        position->lsn = replica.applied_lsn;
+        pthread_mutex_unlock(&replica.lock);
+    } else {
+        position->run = wal.run_segment;
+        position->lsn = __atomic_load_n(&wal.lsn, __ATOMIC_ACQUIRE);
+    }
+}
+
+//Accoda un MSG_RESULT con l'esito indicato
+int send_result(CONNECTION *conn, unsigned int req_id, char result) {
+    unsigned char buf[PROTO_HEADER_SIZE + 1];
+    PROTO_WRITER w;
+
+    proto_begin(&w, buf, sizeof(buf), MSG_RESULT, req_id);
+    proto_put_u8(&w, result);
+    return conn_send(conn, &w);
+}
+
+//Accoda un MSG_ERROR: la richiesta viene scartata ma la connessione resta aperta
+int send_error(CONNECTION *conn, unsigned int req_id, int code) {
+    unsigned char buf[PROTO_HEADER_SIZE + 2];
+    PROTO_WRITER w;
+
+    proto_begin(&w, buf, sizeof(buf), MSG_ERROR, req_id);
+    proto_put_u8(&w, code);
+    proto_put_u8(&w, PROTO_VERSION);
+    return conn_send(conn, &w);
+}
+
+//Invia un GP richiesto dal ServerVerifica. Ritorna -1 se la richiesta non può essere servita.
+int send_gp(CONNECTION *conn, unsigned int req_id, PROTO_READER *r) {
+    unsigned char buf[PROTO_HEADER_SIZE + 1 + PROTO_GP_SIZE + 16];
+    LOG_POSITION position;
+    PROTO_WRITER w;
+    char ID[ID_SIZE];
+    int report;
+    GP_REQUEST gp;
+
+    proto_get_ID(r, ID);
+    if (r->error) return send_error(conn, req_id, PROTO_ERR_MALFORMED);
+    log_position(&position);
+    if ((report = lookup_gp(ID, &gp)) < 0) report = '3';
+
+    //Accoda il report e, se esiste, il GP richiesto: il ServerVerifica controllerà la validità
+    proto_begin(&w, buf, sizeof(buf), MSG_GP_RESULT, req_id);
+    proto_put_u8(&w, report);
+    if (report == '1') proto_put_gp(&w, &gp);
+    proto_put_position(&w, &position);
+    return conn_send(conn, &w);
+}
+
+//Invia l'esito della ricerca di un blocco di tessere, nello stesso ordine della richiesta. Ritorna -1 se la richiesta non può essere servita.
+int send_gp_batch(CONNECTION *conn, unsigned int req_id, PROTO_READER *r) {
+    unsigned char buf[MAX_RESPONSE];
+    LOG_POSITION position;
+    PROTO_WRITER w;
+    GP_REQUEST empty, gp;
+    char ID[ID_SIZE];
+    GP_KEY key;
+    int i, count;
+
+    count = proto_get_u16(r);
+    if (r->error || count > MAX_BATCH) return send_error(conn, req_id, PROTO_ERR_MALFORMED);
+
+    proto_begin(&w, buf, sizeof(buf), MSG_GP_RESULT_BATCH, req_id);
+    proto_put_u16(&w, count);
+    memset(&empty, 0, sizeof(GP_REQUEST));
+
+    //Un solo lock in lettura per tutto il blocco
+    log_position(&position);
+    pthread_rwlock_rdlock(&gp_index.lock);
+    for (i = 0; i < count; i++) {
+        proto_get_ID(r, ID);
+        if ((key = id_key(ID)) != 0 && index_lookup(key, &gp)) {
+            proto_put_u8(&w, '1');
+            proto_put_gp(&w, &gp);
+        } else {
+            proto_put_u8(&w, '2');
+            proto_put_gp(&w, &empty);
+        }
+    }
+    pthread_rwlock_unlock(&gp_index.lock);
+    proto_put_position(&w, &position);
+
+    if (r->error) return send_error(conn, req_id, PROTO_ERR_MALFORMED);
+    return conn_send(conn, &w);
+}
+
+//Modifica il report di un GP, sotto richiesta dell'ASL. Ritorna -1 se la richiesta non può essere servita.
+int modify_report(CONNECTION *conn, unsigned int req_id, PROTO_READER *r) {
+    unsigned char buf[PROTO_HEADER_SIZE + 1 + 16];
+    LOG_POSITION position = {0, 0};
+    PROTO_WRITER w;
+    REPORT package;
+    int report;
+
+    proto_get_ID(r, package.ID);
+    package.report = proto_get_u8(r);
+    if (r->error) return send_error(conn, req_id, PROTO_ERR_MALFORMED);
+    if ((report = update_report(&package, &position.lsn)) < 0) report = '3';
+    if (report == '0') {
+        position.run = wal.run_segment;
+        conn->commit_lsn = position.lsn;
+    }
+
+    /* Accoda il report per il ServerVerifica, con la posizione del record nel log: il ServerVerifica non mette in cache i GP
+       letti da una replica che non ha ancora applicato il report */
+    proto_begin(&w, buf, sizeof(buf), MSG_RESULT, req_id);
+    proto_put_u8(&w, report);
+    proto_put_position(&w, &position);
+    return conn_send(conn, &w);
+}
+
+/* Funzione che tratta la comunicazione con il CentroVaccinale e salva il GP ricevuto da questo nell'indice dei green pass.
+   L'esito viene inviato quando l'emissione è registrata nel log. Ritorna -1 se la richiesta non può essere servita. */
+int CV_comunication(CONNECTION *conn, unsigned int req_id, PROTO_READER *r) {
+    GP_REQUEST gp;
+    GP_KEY key;
+    int added;
+    char result = '0';
+
+    proto_get_gp(r, &gp);
+    if (r->error || (key = id_key(gp.ID)) == 0) return send_error(conn, req_id, PROTO_ERR_MALFORMED);
+
+    //Quando viene generato un nuovo green pass è valido di defualt
+    gp.report = '1';
+
+    //Inserisce il GP nell'indice (se la tessera esiste già il GP viene sostituito) e registra l'emissione nel log
+    pthread_mutex_lock(&gp_index.write_lock);
+    if ((added = index_put(key, &gp)) < 0) result = '3';
+    else conn->commit_lsn = wal_append(added ? 'I' : 'S', &gp);
+    pthread_mutex_unlock(&gp_index.write_lock);
+
+    return send_result(conn, req_id, result);
+}
+
+/* Salva un blocco di GP inviati dal CentroVaccinale acquisendo una sola volta il lock del writer. Un GP già presente viene sostituito, quindi il
+   CentroVaccinale può ripetere un blocco intero se non ha ricevuto l'esito. Ritorna -1 se la richiesta non può essere servita. */
+int CV_comunication_batch(CONNECTION *conn, unsigned int req_id, PROTO_READER *r) {
+    GP_REQUEST gp[PROTO_MAX_ISSUE_BATCH];
+    GP_KEY key[PROTO_MAX_ISSUE_BATCH];
+    int i, n, added;
+    char result = '0';
+
+    n = proto_get_u16(r);
+    if (r->error || n > PROTO_MAX_ISSUE_BATCH || r->len - r->off < n * PROTO_GP_SIZE) return send_error(conn, req_id, PROTO_ERR_MALFORMED);
+    //Il blocco viene controllato prima di salvarlo: con una tessera non valida non viene salvato nessun GP
+    for (i = 0; i < n; i++) {
+        proto_get_gp(r, &gp[i]);
+        gp[i].report = '1';
+        if ((key[i] = id_key(gp[i].ID)) == 0) return send_error(conn, req_id, PROTO_ERR_MALFORMED);
+    }
+
+    pthread_mutex_lock(&gp_index.write_lock);
+    for (i = 0; i < n && result == '0'; i++) {
+        if ((added = index_put(key[i], &gp[i])) < 0) result = '3';
+        else conn->commit_lsn = wal_append(added ? 'I' : 'S', &gp[i]);
+    }
+    pthread_mutex_unlock(&gp_index.write_lock);
+
+    //L'esito parte quando l'ultimo record del blocco, e quindi tutti i precedenti, è registrato nel log
+    return send_result(conn, req_id, result);
+}
+
+/* Invia ad una replica la copia di tutti i GP dell'indice. Gli slot vengono letti a blocchi con il seqlock, senza fermare il writer;
+   se l'indice cresce durante la copia gli slot cambiano posizione e la copia ricomincia. Ritorna -1 se la replica non è più raggiungibile. */
+int repl_send_snapshot(int fd) {
+    unsigned char frame[PROTO_HEADER_SIZE + 2 + PROTO_MAX_REPL_RECORDS * PROTO_GP_SIZE];
+    GP_REQUEST gp[PROTO_MAX_REPL_RECORDS];
+    PROTO_WRITER w;
+    size_t i = 0, capacity;
+    int count, k;
+
+    pthread_rwlock_rdlock(&gp_index.lock);
+    capacity = gp_index.capacity;
+    pthread_rwlock_unlock(&gp_index.lock);
+
+    while (i < capacity) {
+        pthread_rwlock_rdlock(&gp_index.lock);
+        if (gp_index.capacity != capacity) {
+            capacity = gp_index.capacity;
+            i = 0;
+        }
+        for (count = 0; i < capacity && count < PROTO_MAX_REPL_RECORDS; i++) {
+            slot_read(&gp_index.slots[i], &gp[count]);
+            if (gp[count].ID[0] != 0) count++;
+        }
+        pthread_rwlock_unlock(&gp_index.lock);
+        if (count == 0) continue;
+
+        proto_begin(&w, frame, sizeof(frame), MSG_REPL_SNAPSHOT, 0);
+        proto_put_u16(&w, count);
+        for (k = 0; k < count; k++) proto_put_gp(&w, &gp[k]);
+        if (proto_send(fd, &w) < 0) return -1;
+    }
+    return 0;
+}
+
+//Registra un thread che invierà i record del log a partire dal prossimo record accodato
+void wal_reader_add(WAL_READER *reader) {
+    pthread_mutex_lock(&wal.lock);
+    reader->next = wal.lsn + 1;
+    reader->fd = -1;
+    reader->next_reader = wal.readers;
+    wal.readers = reader;
+    pthread_mutex_unlock(&wal.lock);
+}
+
+//Rimuove il thread dai lettori del log: i segmenti che leggeva possono essere cancellati
+void wal_reader_remove(WAL_READER *reader) {
+    WAL_READER **p;
+
+    pthread_mutex_lock(&wal.lock);
+    for (p = &wal.readers; *p != reader; p = &(*p)->next_reader);
+    *p = reader->next_reader;
+    pthread_mutex_unlock(&wal.lock);
+    if (reader->fd >= 0) close(reader->fd);
+}
+
+/* Legge dal segmento indicato al più max record a partire dal record index del segmento. Ritorna il numero di record letti, -1 se
+   il segmento non è leggibile o contiene un record danneggiato. */
+int wal_read_segment(WAL_READER *reader, unsigned long segment, unsigned long index, LOG_RECORD *records, int max) {
+    char path[64];
+    ssize_t nread;
+    int count, i;
+
+    if (reader->fd < 0 || reader->fd_segment != segment) {
+        if (reader->fd >= 0) close(reader->fd);
+        snprintf(path, sizeof(path), WAL_FILE, segment);
+        if ((reader->fd = open(path, O_RDONLY)) < 0) {
+            perror("open() error");
+            return -1;
+        }
+        reader->fd_segment = segment;
+    }
+    while ((nread = pread(reader->fd, records, max * sizeof(LOG_RECORD), index * sizeof(LOG_RECORD))) < 0)
+        if (errno != EINTR) {
+            perror("pread() error");
+            return -1;
+        }
+    count = nread / sizeof(LOG_RECORD);
+    for (i = 0; i < count; i++) if (records[i].checksum != log_checksum(&records[i])) return -1;
+    return count;
+}
+
+/* Attende per al più timeout secondi che il prossimo record del lettore sia su disco (con durable uguale ad 1) o solo accodato, poi copia
+   in records al più max record a partire da quello. In last viene restituito l'ultimo record disponibile. I record usciti dalla memoria
+   vengono riletti dal loro segmento, quindi un lettore lento o impegnato in una copia completa non perde mai il flusso.
+   Ritorna il numero di record copiati, -1 in caso di errore. */
+int wal_read_history(WAL_READER *reader, int timeout, int durable, LOG_RECORD *records, int max, unsigned long *last) {
+    unsigned long *limit = durable ? &wal.durable_lsn : &wal.lsn;
+    unsigned long next = reader->next, segment, first, end;
+    struct timespec deadline;
+    size_t i;
+    int count;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+    pthread_mutex_lock(&wal.lock);
+    while (*limit < next)
+        if (pthread_cond_timedwait(durable ? &wal.synced : &wal.pending, &wal.lock, &deadline) != 0) break;
+    *last = *limit;
+
+    if (wal.lsn < next + WAL_HISTORY) {
+        for (count = 0; count < max && next + count <= *last; count++)
+            records[count] = wal.history[(next + count) % WAL_HISTORY];
+        pthread_mutex_unlock(&wal.lock);
+        return count;
+    }
+
+    //Un record uscito dalla memoria è su disco dopo la sincronizzazione che lo contiene, che con fsync_interval può essere ancora da fare
+    while (wal.durable_lsn < next)
+        if (pthread_cond_timedwait(&wal.synced, &wal.lock, &deadline) != 0) break;
+    if (wal.durable_lsn < next) {
+        pthread_mutex_unlock(&wal.lock);
+        return 0;
+    }
+    i = wal_segment_of(next);
+    segment = wal.run_segment + i;
+    first = wal.segment_lsn[i];
+    end = i + 1 < wal.n_segments ? wal.segment_lsn[i + 1] : wal.durable_lsn + 1;
+    if (end > wal.durable_lsn + 1) end = wal.durable_lsn + 1;
+    pthread_mutex_unlock(&wal.lock);
+
+    if (max > end - next) max = end - next;
+    return wal_read_segment(reader, segment, next - first, records, max);
+}
+
+/* Thread che serve una replica: invia la copia dei GP e poi i record del log nello stesso ordine in cui sono stati accodati, non appena sono
+   su disco. Senza nuovi record ogni secondo viene inviato un frame vuoto, che permette alla replica di misurare il ritardo. */
+void *replica_sender(void *arg) {
+    int fd = (int)(long)arg, count, i, timeout;
+    unsigned char frame[PROTO_HEADER_SIZE + PROTO_REPL_RECORDS_MAX];
+    LOG_RECORD records[PROTO_MAX_REPL_RECORDS];
+    unsigned long durable;
+    struct timespec now;
+    PROTO_WRITER w;
+    WAL_READER reader;
+    int error;
+
+    /* Le modifiche fino a wal.lsn sono già nell'indice, quindi sono contenute nella copia; quelle successive vengono inviate dopo la copia
+       anche se la copia le contiene già: riapplicarle nello stesso ordine porta la replica allo stesso stato del primario.
+       Durante la copia i record successivi restano leggibili dal log su disco, per quanto la copia duri. */
+    wal_reader_add(&reader);
+    error = repl_send_snapshot(fd) < 0;
+
+    //Il primo frame parte subito dopo la copia, anche vuoto: indica alla replica che la copia è completa
+    for (timeout = 0; !error; timeout = 1) {
+        if ((count = wal_read_history(&reader, timeout, 1, records, PROTO_MAX_REPL_RECORDS, &durable)) < 0) {
+            printf("Log non leggibile, la connessione con la replica viene chiusa\n");
+            break;
+        }
+
+        clock_gettime(CLOCK_REALTIME, &now);
+        proto_begin(&w, frame, sizeof(frame), MSG_REPL_RECORDS, 0);
+        proto_put_u64(&w, reader.next);
+        proto_put_u64(&w, durable);
+        proto_put_u64(&w, now.tv_sec * 1000000000UL + now.tv_nsec);
+        proto_put_u16(&w, count);
+        for (i = 0; i < count; i++) {
+            proto_put_u8(&w, records[i].type);
+            proto_put_gp(&w, &records[i].gp);
+        }
+        proto_put_u64(&w, wal.run_segment);
+        if (proto_send(fd, &w) < 0) break;
+        __atomic_store_n(&reader.next, reader.next + count, __ATOMIC_RELAXED);
+    }
+
+    wal_reader_remove(&reader);
+    printf("Replica scollegata\n");
+    close(fd);
+    return NULL;
+}
+
+/* Invia al ServerVerifica le chiavi di tutte le tessere con un GP. La chiave di uno slot non cambia più dopo l'inserimento, quindi viene letta
+   senza seqlock; se l'indice cresce durante la copia la copia ricomincia. Ritorna -1 se il ServerVerifica non è più raggiungibile. */
+int filter_send_snapshot(int fd) {
+    unsigned char frame[PROTO_HEADER_SIZE + PROTO_FILTER_KEYS_MAX];
+    GP_KEY keys[PROTO_MAX_FILTER_KEYS];
+    PROTO_WRITER w;
+    size_t i = 0, capacity;
+    int count, k;
+
+    pthread_rwlock_rdlock(&gp_index.lock);
+    capacity = gp_index.capacity;
+    pthread_rwlock_unlock(&gp_index.lock);
+
+    while (i < capacity) {
+        pthread_rwlock_rdlock(&gp_index.lock);
+        if (gp_index.capacity != capacity) {
+            capacity = gp_index.capacity;
+            i = 0;
+        }
+        for (count = 0; i < capacity && count < PROTO_MAX_FILTER_KEYS; i++)
+            if ((keys[count] = __atomic_load_n(&gp_index.slots[i].key, __ATOMIC_ACQUIRE)) != 0) count++;
+        pthread_rwlock_unlock(&gp_index.lock);
+        if (count == 0) continue;
+
+        proto_begin(&w, frame, sizeof(frame), MSG_FILTER_KEYS, 0);
+        proto_put_u8(&w, 0);
+        proto_put_u16(&w, count);
+        for (k = 0; k < count; k++) proto_put_u64(&w, keys[k]);
+        if (proto_send(fd, &w) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Thread che tiene aggiornato il filtro delle tessere di un ServerVerifica: invia le chiavi di tutte le tessere e poi quelle dei nuovi GP.
+   Le tessere non vengono mai cancellate, quindi bastano le emissioni ('I'). Le chiavi partono appena l'emissione è accodata al log, senza
+   attendere il disco come le repliche: di solito arrivano prima della conferma al CentroVaccinale, ed una chiave di un'emissione persa
+   in un crash è solo un falso positivo del filtro. */
+void *filter_sender(void *arg) {
+    int fd = (int)(long)arg, count, n, i, timeout;
+    unsigned char frame[PROTO_HEADER_SIZE + PROTO_FILTER_KEYS_MAX];
+    LOG_RECORD records[PROTO_MAX_FILTER_KEYS];
+    unsigned long last;
+    PROTO_WRITER w;
+    WAL_READER reader;
+    int error;
+
+    //Le emissioni avvenute durante la copia restano leggibili dal log su disco, per quanto la copia duri
+    wal_reader_add(&reader);
+    error = filter_send_snapshot(fd) < 0;
+
+    for (timeout = 0; !error; timeout = 1) {
+        //Senza i record mancanti il filtro perderebbe delle tessere: il ServerVerifica si ricollegherà ricevendo una nuova copia
+        if ((count = wal_read_history(&reader, timeout, 0, records, PROTO_MAX_FILTER_KEYS, &last)) < 0) {
+            printf("Log non leggibile, la connessione con il ServerVerifica viene chiusa\n");
+            break;
+        }
+        for (i = n = 0; i < count; i++) if (records[i].type == 'I') n++;
+
+        proto_begin(&w, frame, sizeof(frame), MSG_FILTER_KEYS, 0);
+        proto_put_u8(&w, 1);
+        proto_put_u16(&w, n);
+        for (i = 0; i < count; i++) if (records[i].type == 'I') proto_put_u64(&w, id_key(records[i].gp.ID));
+        if (proto_send(fd, &w) < 0) break;
+        __atomic_store_n(&reader.next, reader.next + count, __ATOMIC_RELAXED);
+    }
+
+    wal_reader_remove(&reader);
+    printf("ServerVerifica scollegato dal flusso delle tessere\n");
+    close(fd);
+    return NULL;
+}
+
+/* Passa la connessione di una replica o di un ServerVerifica abbonato alle tessere ad un thread dedicato: il flusso delle modifiche
+   usa un socket bloccante, fuori dall'istanza epoll del worker */
+void subscriber_accept(CONNECTION *conn) {
+    int fd = conn->fd, enable = 1, filter = (conn->subscription == MSG_FILTER_SUBSCRIBE);
+    pthread_t tid;
+
+    epoll_ctl(conn->worker->epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    conn_unpark(conn);
+    conn_free(conn);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    //Ogni sincronizzazione del log produce un frame piccolo, che deve partire subito senza attendere l'algoritmo di Nagle
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    if (pthread_create(&tid, NULL, filter ? filter_sender : replica_sender, (void *)(long)fd) != 0) {
+        perror("pthread_create() error");
+        close(fd);
+        return;
+    }
+    pthread_detach(tid);
+    if (filter) printf("ServerVerifica collegato, invio delle tessere con un GP\n");
+    else printf("Replica collegata, invio della copia dei GP\n");
+}
+
+//Applica un record ricevuto dal primario e lo registra nel log della replica. Viene chiamata con gp_index.write_lock acquisito. Ritorna -1 in caso di errore.
+int replica_apply(char type, GP_REQUEST *gp) {
+    GP_KEY key = id_key(gp->ID);
+    GP_SLOT *slot;
+    int added;
+
+    if (key == 0) return 0;     //il primario salva solo tessere valide
+    if (type == 'R') {
+        slot = index_find(key);
+        if (slot->key != 0) {
+            slot_write_begin(slot);
+            slot->gp.report = gp->report;
+            slot_write_end(slot);
+            wal_append('R', &slot->gp);
+        }
+        return 0;
+    }
+    if ((added = index_put(key, gp)) < 0) return -1;
+    wal_append(added ? 'I' : 'S', gp);
+    return 0;
+}
+
+//Apre la connessione della replica verso il primario. Ritorna il descrittore, -1 se il primario non è raggiungibile.
+int replica_connect() {
+    int socket_fd;
+
+    if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+        perror("socket() error");
+        return -1;
+    }
+    if (connect(socket_fd, (struct sockaddr *)&replica.primary.addr, sizeof(replica.primary.addr)) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+/* Thread della replica: si collega al primario, riceve la copia dei GP e poi applica le modifiche nello stesso ordine del primario.
+   Se la connessione cade la replica continua a servire le letture con i GP che ha e si ricollega ricevendo una nuova copia. */
+void *replica_thread(void *arg) {
+    unsigned char payload[PROTO_REPL_RECORDS_MAX], buf[PROTO_HEADER_SIZE];
+    unsigned long first, primary_lsn, sent, run;
+    struct timespec now;
+    FRAME_HEADER h;
+    PROTO_READER r;
+    PROTO_WRITER w;
+    GP_REQUEST gp;
+    int fd, count, i, error;
+    char type;
+
+    for (;; sleep(1)) {
+        if ((fd = replica_connect()) < 0) continue;
+        proto_begin(&w, buf, sizeof(buf), MSG_REPL_SUBSCRIBE, 0);
+        error = proto_send(fd, &w) < 0;
+        if (!error) printf("Collegata al primario %s:%d, ricezione della copia dei GP\n", replica.primary.host, replica.primary.port);
+
+        while (!error && proto_recv(fd, &h, payload, sizeof(payload)) == 0) {
+            proto_reader(&r, payload, h.length);
+            if (h.type == MSG_REPL_SNAPSHOT) {
+                count = proto_get_u16(&r);
+                pthread_mutex_lock(&gp_index.write_lock);
+                for (i = 0; i < count && !error; i++) {
+                    proto_get_gp(&r, &gp);
+                    error = r.error || replica_apply('S', &gp) < 0;
+                }
+                pthread_mutex_unlock(&gp_index.write_lock);
+            } else if (h.type == MSG_REPL_RECORDS) {
+                first = proto_get_u64(&r);
+                primary_lsn = proto_get_u64(&r);
+                sent = proto_get_u64(&r);
+                count = proto_get_u16(&r);
+                pthread_mutex_lock(&gp_index.write_lock);
+                for (i = 0; i < count && !error; i++) {
+                    type = proto_get_u8(&r);
+                    proto_get_gp(&r, &gp);
+                    error = r.error || replica_apply(type, &gp) < 0;
+                }
+                pthread_mutex_unlock(&gp_index.write_lock);
+                run = h.version >= 4 ? proto_get_u64(&r) : 0;
+
+                //Il primo frame di record indica che la copia è completa
+                clock_gettime(CLOCK_REALTIME, &now);
+                pthread_mutex_lock(&replica.lock);
+                replica.connected = 1;
+                replica.primary_run = run;
+                replica.applied_lsn = first + count - 1;
+                replica.primary_lsn = primary_lsn;
+                replica.lag_ns = now.tv_sec * 1000000000L + now.tv_nsec - (long)sent;
+                replica.last_frame = now.tv_sec;
+                if (!replica.synced) {
+                    replica.synced = 1;
+                    pthread_cond_broadcast(&replica.ready);
+                    printf("Copia dei GP ricevuta (%zu green pass)\n", gp_index.count);
+                }
+                pthread_mutex_unlock(&replica.lock);
+            } else error = 1;
+            error = error || r.error;
+        }
+        close(fd);
+
+        pthread_mutex_lock(&replica.lock);
+        if (replica.connected) printf("Connessione con il primario interrotta, nuovo tentativo tra 1 secondo\n");
+        replica.connected = 0;
+        pthread_mutex_unlock(&replica.lock);
+    }
+    return NULL;
+}
+
+//Thread della replica che stampa periodicamente il ritardo rispetto al primario
+void *replica_status_thread(void *arg) {
+    long silent;
+
+    for (;;) {
+        sleep(REPL_STATUS_INTERVAL);
+        pthread_mutex_lock(&replica.lock);
+        silent = time(NULL) - replica.last_frame;
+        if (!replica.connected || silent > 2)
+            printf("Replica: nessun dato dal primario %s:%d da %ld secondi, %lu record applicati\n",
+                   replica.primary.host, replica.primary.port, silent, replica.applied_lsn);
+        else
+            printf("Replica: %lu record applicati, ritardo %lu record, %.3f ms\n", replica.applied_lsn,
+                   replica.primary_lsn - replica.applied_lsn, replica.lag_ns > 0 ? replica.lag_ns / 1e6 : 0.0);
+        pthread_mutex_unlock(&replica.lock);
+    }
+    return NULL;
+}
+
+//Operazione misurata corrispondente al tipo di richiesta, -1 per i tipi non misurati
+int request_op(unsigned int type) {
+    int op;
+
+    for (op = 0; op < N_REQ; op++) if (req_types[op] == type) return op;
+    return -1;
+}
+
+//Registra la latenza di una richiesta. Se la risposta deve attendere la sincronizzazione del log viene registrata da conn_flush quando parte.
+void request_end(CONNECTION *conn, int op, long start, int error) {
+    if (!error && fsync_interval == 0 && conn->commit_lsn > __atomic_load_n(&wal.durable_lsn, __ATOMIC_ACQUIRE))
+        metric_wait_add(&metrics, &conn->wait, op, start);
+    else metric_end(&metrics, op, start, error);
+}
+
+//Interpreta il frame all'inizio del buffer di ingresso. Ritorna i byte consumati, 0 se bisogna attendere altri dati, -1 in caso di errore.
+ssize_t handle_request(CONNECTION *conn) {
+    FRAME_HEADER h;
+    PROTO_READER r;
+    ssize_t size;
+    long start;
+    int result, op;
+
+    //Il frame deve essere arrivato per intero. Un'intestazione non valida rende illeggibile il resto del flusso: la connessione viene chiusa.
+    if ((size = proto_parse_header(conn->in, conn->in_len, &h)) <= 0) return size;
+    if (size > MAX_SIZE) {
+        printf("Dato non valido\n\n");
+        return -1;
+    }
+    if (conn->in_len < size) return 0;
+    proto_reader(&r, conn->in + PROTO_HEADER_SIZE, h.length);
+
+    /*
+        Il tipo del frame indica la richiesta, le connessioni possono trasportare più richieste di tipo diverso.
+        MSG_GP_ISSUE e MSG_GP_ISSUE_BATCH arrivano dal CentroVaccinale, MSG_REPL_SUBSCRIBE da una replica, gli altri tipi dal ServerVerifica.
+        Dopo MSG_REPL_SUBSCRIBE o MSG_FILTER_SUBSCRIBE la connessione trasporta solo il flusso delle modifiche.
+        Una replica accetta solo letture: le modifiche arrivano dal primario.
+    */
+    if (h.version < PROTO_MIN_VERSION) result = send_error(conn, h.req_id, PROTO_ERR_VERSION);
+    else if (is_replica && (h.type == MSG_GP_ISSUE || h.type == MSG_GP_ISSUE_BATCH || h.type == MSG_REPORT_UPDATE))
+        result = send_error(conn, h.req_id, PROTO_ERR_READONLY);
+    else if (h.type == MSG_REPL_SUBSCRIBE || h.type == MSG_FILTER_SUBSCRIBE) {
+        conn->subscription = h.type;
+        result = 0;
+    }
+    else if ((op = request_op(h.type)) < 0) result = send_error(conn, h.req_id, PROTO_ERR_TYPE);
+    else {
+        start = metric_start(&metrics, op);
+        if (op == REQ_CV_COMUNICATION) result = CV_comunication(conn, h.req_id, &r);
+        else if (op == REQ_CV_COMUNICATION_BATCH) result = CV_comunication_batch(conn, h.req_id, &r);
+        else if (op == REQ_SEND_GP) result = send_gp(conn, h.req_id, &r);
+        else if (op == REQ_SEND_GP_BATCH) result = send_gp_batch(conn, h.req_id, &r);
+        else result = modify_report(conn, h.req_id, &r);
+        request_end(conn, op, start, result < 0);
+    }
+
+    if (result < 0) return -1;
+    return size;
+}
+
+//Gestisce gli eventi epoll di una connessione. Ritorna -1 quando la connessione deve essere chiusa, 1 quando va passata ad un thread del flusso delle modifiche.
+int conn_event(CONNECTION *conn) {
+    ssize_t nread, consumed = 0;
+    int eof = 0;
+
+    if (conn->in == NULL && (conn->in = pool_alloc(&conn_pool, &conn->worker->cache, MAX_SIZE)) == NULL) return -1;
+
+    //In modalità edge-triggered il socket va svuotato completamente, altrimenti non arriveranno nuove notifiche
+    for (;;) {
+        //Elabora le richieste complete presenti nel buffer, finché c'è spazio per le risposte
+        while (!conn->subscription && conn->out_len + MAX_RESPONSE <= OUT_SIZE && (consumed = handle_request(conn)) > 0) {
+            conn->in_len -= consumed;
+            memmove(conn->in, conn->in + consumed, conn->in_len);
+        }
+        if (consumed < 0) return -1;
+        if (conn->subscription) return conn_flush(conn) < 0 ? -1 : 1;
+
+        //Con il buffer di uscita pieno si smette di leggere finché il client non ha ricevuto le risposte (evento EPOLLOUT)
+        if (conn->out_len + MAX_RESPONSE > OUT_SIZE) {
+            if (conn_flush(conn) < 0) return -1;
+            if (conn->out_len + MAX_RESPONSE > OUT_SIZE) return 0;
+            continue;
+        }
+        if (eof) break;
+        if (conn->in_len == MAX_SIZE) return -1; //Richiesta più grande del buffer, non valida
+
+        if ((nread = read(conn->fd, conn->in + conn->in_len, MAX_SIZE - conn->in_len)) < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        if (nread == 0) eof = 1;
+        conn->in_len += nread;
+    }
+
+    //Il buffer di ingresso svuotato torna al pool finché non arrivano altri dati
+    if (conn->in_len == 0) {
+        pool_free(&conn_pool, &conn->worker->cache, conn->in, MAX_SIZE);
+        conn->in = NULL;
+    }
+    if (conn_flush(conn) < 0) return -1;
+
+    //La connessione si chiude quando il client l'ha chiusa e le risposte sono state inviate per intero
+    if (conn->out_len == 0 && eof) return -1;
+    return 0;
+}
+
+//Riprende le connessioni in attesa del log i cui record sono ormai su disco
+void resume_parked(WORKER *worker) {
+    CONNECTION *conn, *next;
+    unsigned long count, durable_lsn;
+    int result;
+
+    if (read(worker->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) perror("read() error");
+
+    durable_lsn = __atomic_load_n(&wal.durable_lsn, __ATOMIC_ACQUIRE);
+    for (conn = worker->parked; conn != NULL; conn = next) {
+        next = conn->park_next;
+        if (conn->commit_lsn > durable_lsn) continue;
+        conn_unpark(conn);
+        if ((result = conn_event(conn)) < 0) conn_close(conn);
+        else if (result > 0) subscriber_accept(conn);
+    }
+}
+
+//Ciclo di un worker: attende gli eventi sulle connessioni assegnate e le serve senza mai bloccarsi su un singolo client
+void *worker_loop(void *arg) {
+    WORKER *worker = arg;
+    struct epoll_event events[MAX_EVENTS];
+    CONNECTION *conn;
+    int n, i, result, wake;
+
+    for (;;) {
+        if ((n = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, -1)) < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait() error");
+            exit(1);
+        }
+        for (i = 0, wake = 0; i < n; i++) {
+            if ((conn = events[i].data.ptr) == NULL) {
+                wake = 1;
+                continue;
+            }
+            if ((events[i].events & EPOLLERR) || (result = conn_event(conn)) < 0) conn_close(conn);
+            else if (result > 0) subscriber_accept(conn);
+        }
+        /* Le connessioni in attesa del log restano nell'istanza epoll, quindi lo stesso giro può contenere anche un loro evento:
+           vengono riprese dopo tutti gli eventi del giro, così nessun evento successivo punta ad una connessione già liberata */
+        if (wake) resume_parked(worker);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    int listen_fd, connect_fd, epoll_fd, opt, n, i, next = 0, enable = 1, port = 1025, admin_port = -1, retry = -1;
+    const char *directory = NULL;
+    char *colon;
+    struct sockaddr_in serv_addr;
+    struct epoll_event ev, events[MAX_EVENTS];
+    CONNECTION *conn;
+    POOL_CACHE accept_cache = {0}; //oggetti liberi del pool usati dal thread principale, i worker liberano le connessioni nelle proprie liste
+    pthread_t tid;
+    signal(SIGINT,handler); //Cattura il segnale
+    signal(SIGPIPE, SIG_IGN); //Un client che chiude la connessione durante una write non deve terminare l'intero server
+
+    //Di default viene avviato un worker per ogni core disponibile
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((opt = getopt(argc, argv, "w:f:c:p:d:R:a:")) != -1) {
+        switch (opt) {
+        case 'R':
+            //Replica del primario indicato come host:porta
+            if ((colon = strrchr(optarg, ':')) == NULL) {
+                fprintf(stderr, "Primario non valido, atteso host:porta\n");
+                exit(1);
+            }
+            *colon = 0;
+            if (shard_node_init(&replica.primary, optarg, atoi(colon + 1)) < 0) {
+                fprintf(stderr, "Primario %s:%s non valido\n", optarg, colon + 1);
+                exit(1);
+            }
+            is_replica = 1;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'd':
+            directory = optarg;
+            break;
+        case 'w':
+            n_workers = atoi(optarg);
+            break;
+        case 'f':
+            fsync_interval = atoi(optarg);
+            break;
+        case 'c':
+            checkpoint_interval = atoi(optarg);
+            break;
+        case 'a':
+            admin_port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-w numero worker] [-f millisecondi tra le sincronizzazioni del log] [-c secondi tra i checkpoint]"
+                    " [-p porta] [-d directory dei dati] [-R host:porta del primario, avvia una replica]"
+                    " [-a porta delle metriche, predefinita porta + %d, 0 per disattivarle]\n", argv[0], ADMIN_PORT_OFFSET);
+            exit(1);
+        }
+    }
+    if (n_workers < 1) n_workers = 1;
+    if (n_workers > MAX_WORKER) n_workers = MAX_WORKER;
+
+    //Ogni istanza (shard) ha i propri file: più istanze sulla stessa macchina usano directory e porte diverse
+    if (directory != NULL && chdir(directory) < 0) {
+        perror("chdir() error");
+        exit(1);
+    }
+
+    //Apre il file dei green pass e riapplica il log prima di accettare richieste
+    storage_recover();
+    printf("Caricati %zu green pass\n", gp_index.count);
+
+    //Le metriche sono esposte solo sulla macchina locale, ogni istanza sulla propria porta
+    metrics_init(&metrics, req_names, N_REQ);
+    if (admin_port < 0) admin_port = port + ADMIN_PORT_OFFSET;
+    if (admin_port > 0) metrics_listen(&metrics, admin_port);
+
+    //Creazione dei worker, ognuno con la propria istanza epoll
+    pool_init(&conn_pool, NULL, 0);
+    for (i = 0; i < n_workers; i++) {
+        if ((workers[i].epoll_fd = epoll_create1(0)) < 0) {
+            perror("epoll_create1() error");
+            exit(1);
+        }
+
+        //L'eventfd notifica al worker la sincronizzazione del log, si riconosce per data.ptr nullo
+        if ((workers[i].event_fd = eventfd(0, EFD_NONBLOCK)) < 0) {
+            perror("eventfd() error");
+            exit(1);
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (epoll_ctl(workers[i].epoll_fd, EPOLL_CTL_ADD, workers[i].event_fd, &ev) < 0) {
+            perror("epoll_ctl() error");
+            exit(1);
+        }
+        if (pthread_create(&workers[i].tid, NULL, worker_loop, &workers[i]) != 0) {
+            perror("pthread_create() error");
+            exit(1);
+        }
+    }
+
+    //Thread di group commit del log e thread dei checkpoint
+    if (pthread_create(&tid, NULL, wal_flusher, NULL) != 0) {
+        perror("pthread_create() error");
+        exit(1);
+    }
+    if (checkpoint_interval > 0 && pthread_create(&tid, NULL, checkpoint_thread, NULL) != 0) {
+        perror("pthread_create() error");
+        exit(1);
+    }
+
+    /* Una replica accetta connessioni solo dopo aver ricevuto la prima copia dei GP dal primario: prima risponderebbe che le tessere
+       non esistono. Il ServerVerifica nel frattempo invia le letture al primario. */
+    if (is_replica) {
+        if (pthread_create(&tid, NULL, replica_thread, NULL) != 0 || pthread_create(&tid, NULL, replica_status_thread, NULL) != 0) {
+            perror("pthread_create() error");
+            exit(1);
+        }
+        printf("In attesa della copia dei GP dal primario %s:%d\n", replica.primary.host, replica.primary.port);
+        pthread_mutex_lock(&replica.lock);
+        while (!replica.synced) pthread_cond_wait(&replica.ready, &replica.lock);
+        pthread_mutex_unlock(&replica.lock);
+    }
+
+    //Creazione del socket
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket() error");
+        exit(1);
+    }
+
+    //Permette di riavviare il server senza attendere il TIME_WAIT delle connessioni precedenti
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt() error");
+        exit(1);
+    }
+
+    //Valorizzazione strutture
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons(port);
+
+    //Assegnazione della porta al server
+    if (bind(listen_fd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("bind() error");
+        exit(1);
+    }
+
+    //Mette il socket in ascolto in attesa di nuove connessioni
+    if (listen(listen_fd, 1024) < 0) {
+        perror("listen() error");
+        exit(1);
+    }
+
+    //Il thread principale si occupa solo di accettare le connessioni
+    if ((epoll_fd = epoll_create1(0)) < 0) {
+        perror("epoll_create1() error");
+        exit(1);
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0) {
+        perror("epoll_ctl() error");
+        exit(1);
+    }
+
+    printf("In attesa di nuovi dati sulla porta %d (%d worker%s)\n\n", port, n_workers, is_replica ? ", replica in sola lettura" : "");
+
+    for (;;) {
+        if ((n = epoll_wait(epoll_fd, events, MAX_EVENTS, retry)) < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait() error");
+            exit(1);
+        }
+
+        /* Accetta tutte le connessioni in coda, il socket di ascolto è edge-triggered. Dopo un errore come descrittori esauriti le connessioni
+           rimaste in coda non producono un'altra notifica: la epoll_wait successiva attende al più ACCEPT_RETRY_MS e la coda viene ripresa */
+        for (;;) {
+            if ((connect_fd = accept4(listen_fd, (struct sockaddr *)NULL, NULL, SOCK_NONBLOCK)) < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    retry = -1;
+                    break;
+                }
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                perror("accept() error");
+                retry = ACCEPT_RETRY_MS;
+                break;
+            }
+
+            if ((conn = pool_alloc(&conn_pool, &accept_cache, sizeof(CONNECTION))) == NULL) {
+                perror("malloc() error");
+                close(connect_fd);
+                continue;
+            }
+            memset(conn, 0, sizeof(CONNECTION));
+            conn->fd = connect_fd;
+            conn->worker = &workers[next];
+
+            //Assegna la connessione ai worker a turno
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = conn;
+            if (epoll_ctl(workers[next].epoll_fd, EPOLL_CTL_ADD, connect_fd, &ev) < 0) {
+                perror("epoll_ctl() error");
+                close(connect_fd);
+                pool_free(&conn_pool, &accept_cache, conn, sizeof(CONNECTION));
+                continue;
+            }
+            next = (next + 1) % n_workers;
+        }
+    }
+    exit(0);
 }
\ No newline at end of file
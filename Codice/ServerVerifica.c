@@ -1,3 +1,4 @@
+#define _GNU_SOURCE     // necessario per accept4()
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,36 +7,307 @@
 #include <netdb.h>     
 #include <sys/types.h>
 #include <sys/socket.h> //Libreria C per i socket.
+#include <netinet/tcp.h> // contiene l'opzione TCP_NODELAY
 #include <arpa/inet.h>  // contiene le definizioni per le operazioni Internet.
+#include <pthread.h>    // libreria C per i thread POSIX
 #include <time.h>
 #include <signal.h>     //consente l'utilizzo delle funzioni per la gestione dei segnali fra processi.
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>  //attesa prima di ritentare l'accept nel ciclo epoll
+#include <sys/resource.h> //limite dei descrittori aperti
+#include <linux/io_uring.h> //strutture e costanti di io_uring, usato tramite le system call senza liburing
+#include "Protocollo.h" //frame e strutture condivise da tutti i programmi
+#include "Instradamento.h" //suddivisione delle tessere tra le istanze del ServerVaccinale
+#include "Allocatore.h" //allocatore a slab dello stato delle connessioni dei cicli di eventi
+#include "Metriche.h"   //latenze e contatori delle richieste esposti sulla porta di amministrazione
 
 #define MAX_SIZE 1024  //dimensione max massima del buf
-#define WELCOME_SIZE 108
-#define ID_SIZE 11    //dim della tessera sanitaria
-#define ACK_SIZE 64
-#define ASL_ACK 39
-
-//Permette di salvare una data, formata dai campi: giorno, mese ed anno
+#define MAX_BACKEND 64  //numero massimo di connessioni persistenti verso ogni istanza del ServerVaccinale
+#define MAX_BATCH 128   //numero massimo di tessere in una richiesta di verifica a blocchi
+#define CACHE_SHARDS 16 //partizioni della cache dei GP, ognuna con il proprio lock
+#define FLIGHT_SHARDS 16  //partizioni delle richieste in volo al ServerVaccinale, ognuna con il proprio lock
+#define FLIGHT_BUCKETS 256 //liste di collisione di ogni partizione delle richieste in volo
+#define REPORT_SLOTS 4096  //posizioni dei report dell'ASL ricordate per ogni shard con repliche
+#define DAY_CHECK_INTERVAL 60 //secondi massimi tra due controlli dell'ora da parte del thread del giorno corrente
+#define MAX_SESSION_SCANS MAX_BATCH //tessere di una sessione dell'AppVerifica verificate insieme
+#define FILTER_BITS_PER_KEY 10 //bit del filtro delle tessere per ogni tessera prevista: circa l'1% di falsi positivi
+#define FILTER_HASHES 7        //bit impostati da ogni tessera nel proprio blocco del filtro
+#define CLIENT_IN 2048  //buffer di ricezione di una sessione gestita da un ciclo di eventi
+#define CLIENT_IN_SINGLE 256 //buffer di ricezione iniziale: basta per il MSG_HELLO e le tessere di una connessione senza sessione
+#define CLIENT_OUT 8192 //buffer di invio di una connessione gestita da un ciclo di eventi, presente solo mentre ci sono esiti da inviare
+#define LOOP_ARENA (4 * 1024 * 1024) //memoria del pool di ogni ciclo registrata in io_uring, i buffer ricavati da qui usano READ_FIXED e WRITE_FIXED
+#define RING_ENTRIES 256 //SQE dell'anello di io_uring di ogni ciclo di eventi
+#define ADMIN_PORT 9026 //porta locale delle metriche
+#define ACCEPT_RETRY_MS 100 //attesa prima di ritentare l'accept dopo un errore come descrittori o memoria esauriti
+
+#define WELCOME_TEXT "*Benvenuto nel server di verifica*\nInserisci il numero di tessera sanitaria per verificare la sua validità."
+#define SESSION_TEXT "sessione aperta, le tessere vengono ricevute sulla stessa connessione"
+#define ACK_TEXT "numero di tessera correttamente ricevuto"
+
+//Gestione delle connessioni dei client: un thread per connessione, oppure cicli di eventi su epoll o io_uring
+#define IO_THREAD 0
+#define IO_EPOLL 1
+#define IO_URING 2
+
+//Operazioni di un ciclo di eventi, nei bit bassi di user_data (o di epoll_data) insieme al puntatore alla connessione
+#define OP_ACCEPT 1
+#define OP_EVENT 2
+#define OP_CLOSE 3
+#define OP_PEEK 4
+#define OP_READ 5
+#define OP_WRITE 6
+#define OP_RETRY 7 //l'attesa dopo un errore dell'accept è terminata
+#define OP_MASK 7
+
+//Stato di una connessione gestita da un ciclo di eventi
+#define CLIENT_PEEK 0       //in attesa del primo frame, letto senza consumarlo per decidere chi gestisce la connessione
+#define CLIENT_HELLO 1      //il primo frame è il MSG_HELLO di un'AppVerifica, non ancora consumato
+#define CLIENT_SINGLE 2     //ogni tessera riceve MSG_ACK e MSG_RESULT
+#define CLIENT_SESSION 3    //ogni tessera riceve solo MSG_RESULT
+
+//Intestazioni precedenti al kernel 6.1
+#ifndef IORING_SETUP_DEFER_TASKRUN
+#define IORING_SETUP_SINGLE_ISSUER (1U << 12)
+#define IORING_SETUP_DEFER_TASKRUN (1U << 13)
+#endif
+#ifndef IORING_ACCEPT_MULTISHOT
+#define IORING_ACCEPT_MULTISHOT (1U << 0)
+#endif
+
+//Esito della ricerca di una tessera in una risposta a blocchi
 typedef struct {
-    int day;
-    int month;
-    int year;
-} DATE;
-
-//Pacchetto inviato dal centro vaccinale al server vaccinale contentente il numero di tessera sanitaria dell'utente, la data di inizio e fine validità del GP
+    char report;
+    GP_REQUEST gp;
+} SV_BATCH_ITEM;
+
+//Richiesta inviata al ServerVaccinale ed in attesa di risposta
+typedef struct PENDING {
+    unsigned int req_id;
+    unsigned char type;                     //tipo del frame di richiesta, MSG_*
+    int shard;                              //shard a cui è destinata la richiesta
+    int replica;                            //1 se la richiesta è una lettura e può essere servita da una replica dello shard
+    REPORT package;
+    char report;                            //esito ricevuto dal ServerVaccinale, '3' se la comunicazione è fallita
+    GP_REQUEST gp;
+    LOG_POSITION position;                  //posizione nel log del primario inviata con la risposta, zero se assente
+    int count;                              //per le richieste a blocchi: numero di tessere in ids, esiti ricevuti in items
+    char (*ids)[ID_SIZE];
+    SV_BATCH_ITEM *items;
+    void (*complete)(struct PENDING *);     //chiamata quando la risposta è arrivata
+    void *arg;
+    struct PENDING *next;
+} PENDING;
+
+//Connessione persistente verso un'istanza del ServerVaccinale, condivisa da tutte le richieste in volo
 typedef struct {
+    SHARD_NODE *node;
+    int fd;                     //-1 se la connessione non è attiva
+    unsigned int next_req_id;
+    PENDING *head, *tail;       //richieste inviate su questa connessione in attesa di risposta
+    pthread_mutex_t lock;       //protegge fd, next_req_id e la lista delle richieste in volo
+    pthread_mutex_t write_lock; //serializza gli invii sul socket
+    long retry_at;              //per le repliche: istante prima del quale non si ritenta la connessione dopo un errore
+} BACKEND;
+
+//Permette ad un thread di attendere il completamento di una richiesta
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+} WAITER;
+
+//Verifica di una tessera in attesa di essere raggruppata con le altre in una richiesta a blocchi
+typedef struct LOOKUP {
     char ID[ID_SIZE];
     char report;
-    DATE start_date;
-    DATE expire_date;
-} GP_REQUEST;
-
-//Pacchetto inviato dall'ASL contenente il numero di tessera sanitaria di un green pass ed il suo referto di validità
-typedef struct  {
+    GP_REQUEST gp;
+    LOG_POSITION position;
+    void (*complete)(struct LOOKUP *);  //chiamata dal thread che riceve l'esito del blocco
+    void *arg;
+    int queued;     //1 finché la richiesta è nella coda del batcher
+    int scans;      //verifiche che attendono l'esito, compresa quella che ha inviato la richiesta
+    struct LOOKUP *next;
+} LOOKUP;
+
+//Blocco di verifiche inviato al ServerVaccinale con un'unica richiesta
+typedef struct {
+    PENDING pending;
+    LOOKUP *lookups[MAX_BATCH];
+    char ids[MAX_BATCH][ID_SIZE];
+    SV_BATCH_ITEM items[MAX_BATCH];
+} BATCH;
+
+/* Verifica di una tessera divisa in fasi (verify_start, verify_continue, verify_result), così le tessere di una sessione vengono verificate
+   insieme. Quando arriva l'esito del ServerVaccinale viene chiamata notify, oppure, se notify è NULL, viene risvegliato il thread in attesa. */
+typedef struct SCAN {
     char ID[ID_SIZE];
+    unsigned int req_id;    //richiesta dell'AppVerifica a cui va inviato l'esito
+    GP_KEY key;
     char report;
-} REPORT;
+    GP_REQUEST gp;
+    unsigned long generation;
+    LOG_POSITION position;  //posizione nel log del primario fino alla quale è aggiornato chi ha risposto
+    long start;             //istante della richiesta al ServerVaccinale, 0 se la tessera è stata verificata senza contattarlo
+    long received;          //istante di ricezione della tessera, per la latenza di receive_ID
+    int waiting;            //1 se la tessera è in attesa dell'esito del ServerVaccinale
+    int primary;            //1 se la tessera è già stata cercata sul primario dello shard
+    LOOKUP lookup;          //richiesta tramite il batcher
+    PENDING pending;        //richiesta singola, senza batcher o verso il primario
+    WAITER waiter;
+    void (*notify)(struct SCAN *);
+    void *arg;
+    struct SCAN *next;      //verifica successiva della stessa connessione
+    struct SCAN *next_done; //verifiche completate da riprendere nel ciclo di eventi
+    int flight;             //per la verifica che ha inviato la richiesta: replica della richiesta in volo
+    struct SCAN *next_flight;   //richiesta in volo successiva nella stessa lista di collisione
+    struct SCAN *followers;     //verifiche della stessa tessera in attesa della stessa risposta
+    struct SCAN *next_follower;
+} SCAN;
+
+//Coda delle verifiche da raggruppare, una per ogni shard, svuotata dal relativo thread batcher
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    LOOKUP *head, *tail;
+    int len;        //verifiche che attendono le richieste in coda
+    int joined;     //verifiche unite dall'ultimo blocco a richieste già inviate: contano per il riempimento come prima dell'unione
+    int shard;
+} LOOKUP_QUEUE;
+
+//Partizione delle richieste in volo al ServerVaccinale: una verifica della stessa tessera attende la risposta già richiesta
+typedef struct {
+    pthread_mutex_t lock;
+    SCAN *buckets[FLIGHT_BUCKETS];
+} FLIGHT_SHARD;
+
+/* Posizioni nel log dei report dell'ASL di uno shard. Ogni tessera usa l'elemento scelto dall'hash della chiave, che contiene la posizione
+   più recente dei report delle tessere che lo condividono: una collisione fa solo scartare qualche GP in più dalla cache */
+typedef struct {
+    pthread_mutex_t lock;
+    LOG_POSITION *positions;    //REPORT_SLOTS elementi, NULL se lo shard non ha repliche
+} REPORT_MARKS;
+
+//Elemento della cache dei GP
+typedef struct {
+    GP_KEY key;         //chiave della tessera, confrontata con una sola operazione
+    char used;
+    char referenced;    //bit di riferimento dell'algoritmo CLOCK
+    GP_REQUEST gp;
+    long expires;       //istante di scadenza in nanosecondi (CLOCK_MONOTONIC)
+    int next;           //elemento successivo nella stessa lista di collisione, -1 alla fine
+} CACHE_ENTRY;
+
+//Partizione della cache: tabella hash con liste di collisione ed eliminazione con l'algoritmo CLOCK
+typedef struct {
+    pthread_mutex_t lock;
+    CACHE_ENTRY *entries;
+    int *buckets;               //primo elemento di ogni lista di collisione
+    int capacity, n_buckets, used;
+    int hand;                   //lancetta dell'algoritmo CLOCK
+    unsigned long generation;   //incrementata ad ogni invalidazione
+} CACHE_SHARD;
+
+//Contatori della cache, aggiornati in modo atomico
+typedef struct {
+    unsigned long hits, misses, evictions, invalidations;
+    unsigned long saved_ns;     //latenza risparmiata stimata, in nanosecondi
+    unsigned long miss_ns;      //media mobile della latenza di una richiesta al ServerVaccinale
+} CACHE_STATS;
+
+//Anello di io_uring mappato in memoria, usato solo dal thread del proprio ciclo di eventi
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned tail;      //coda locale degli SQE, pubblicata al kernel da ring_enter
+    unsigned queued;    //SQE preparati e non ancora inviati al kernel
+    int fixed;          //1 se i buffer delle connessioni sono registrati (READ_FIXED e WRITE_FIXED)
+    int multishot;      //1 se l'accept multishot è supportato
+} RING;
+
+//Connessione di un'AppVerifica gestita da un ciclo di eventi
+typedef struct CLIENT {
+    int fd;                     //-1 se la connessione è libera
+    int state;                  //CLIENT_*
+    int reading, writing;       //io_uring: lettura o scrittura in corso
+    int readable, writable;     //epoll: il socket può essere letto o scritto senza bloccare
+    int closing;                //1 dopo la chiusura dell'AppVerifica o un frame non valido: non vengono letti altri frame
+    int failed;                 //1 dopo un errore sul socket: gli esiti non vengono più inviati
+    int reject;                 //1 se dopo gli esiti delle tessere precedenti va inviato un MSG_ERROR per il frame reject_req
+    unsigned int reject_req;
+    unsigned char *in, *out;    //buffer del pool del ciclo, out è NULL quando non ci sono esiti da inviare
+    size_t in_size;             //CLIENT_IN_SINGLE, oppure CLIENT_IN per le sessioni ed i frame più grandi
+    size_t in_len, out_off, out_len;
+    SCAN *head, *tail;          //verifiche nell'ordine di arrivo delle tessere
+    int scans;                  //verifiche in coda
+    struct LOOP *loop;
+    struct CLIENT *next;        //connessioni chiuse, liberate alla fine del giro del ciclo
+    struct CLIENT *next_dirty;  //connessioni con verifiche completate, da aggiornare
+} CLIENT;
+
+//Ciclo di eventi: gestisce con un solo thread le connessioni delle AppVerifica, le verifiche vengono completate dai thread del ServerVaccinale
+typedef struct LOOP {
+    int id, mode;
+    int listen_fd, event_fd, poll_fd;
+    int timer_fd;               //epoll: timer che riattiva il socket in ascolto dopo un errore dell'accept
+    struct __kernel_timespec retry; //io_uring: attesa prima di ripetere l'accept dopo un errore
+    RING ring;
+    POOL pool;                  //connessioni, verifiche e buffer del ciclo, i primi slab sono nell'area registrata in io_uring
+    POOL_CACHE cache;           //lista del pool usata dal thread del ciclo, l'unico che alloca e libera
+    unsigned char *arena;       //LOOP_ARENA byte
+    int clients;                //connessioni aperte, letto dal thread delle statistiche
+    CLIENT *released;           //connessioni chiuse durante il giro, non più usate da eventi ancora da elaborare
+    pthread_mutex_t lock;       //protegge done
+    SCAN *done;                 //verifiche completate, da riprendere nel thread del ciclo
+    unsigned long event;        //valore letto dall'eventfd
+} LOOP;
+
+/* Filtro di Bloom a blocchi delle tessere con un GP, tenuto aggiornato dai ServerVaccinale: una tessera assente dal filtro non ha sicuramente
+   un GP. Ogni tessera imposta FILTER_HASHES bit in un solo blocco di 512 bit, quindi una verifica legge una sola linea di cache.
+   Le tessere non vengono mai cancellate, quindi i bit impostati restano validi anche dopo una nuova copia. */
+typedef struct {
+    unsigned long *bits;
+    size_t mask;                //numero di blocchi meno 1, i blocchi sono una potenza di 2
+    int ready[MAX_SHARDS];      //1 quando il filtro contiene tutte le tessere dello shard e ne riceve le nuove emissioni
+    unsigned long keys;         //chiavi ricevute dai ServerVaccinale, comprese quelle ripetute da una nuova copia
+    unsigned long negatives;    //tessere inesistenti riconosciute senza contattare il ServerVaccinale
+} TESSERA_FILTER;
+
+SHARD_MAP shard_map;        //istanze del ServerVaccinale e instradamento delle tessere
+BACKEND *shard_backends[MAX_SHARDS]; //n_backends connessioni per ogni nodo dello shard, quelle del nodo k partono da k * n_backends
+int n_backends = 4;
+unsigned int next_backend;
+LOOKUP_QUEUE lookup_queues[MAX_SHARDS];
+int max_batch = 32;         //numero massimo di verifiche raggruppate in una richiesta
+int max_wait = 200;         //microsecondi di attesa massima per completare un blocco
+CACHE_SHARD cache_shards[CACHE_SHARDS];
+CACHE_STATS cache_stats;
+REPORT_MARKS report_marks[MAX_SHARDS];
+int cache_size = 65536;     //numero massimo di GP nella cache, 0 per disattivarla
+int cache_ttl = 30;         //secondi di validità di un GP nella cache
+int stats_interval = 60;    //secondi tra due stampe dei contatori
+TESSERA_FILTER filter;
+FLIGHT_SHARD flight_shards[FLIGHT_SHARDS];
+unsigned long coalesced;    //verifiche che hanno atteso la risposta di una richiesta già in volo per la stessa tessera
+long filter_size = 1048576; //tessere per cui è dimensionato il filtro, 0 per disattivarlo
+int today;                  //giorno corrente, aggiornato da day_thread a mezzanotte e letto atomicamente dalle verifiche
+int io_mode = IO_URING;     //gestione delle connessioni, io_uring ripiega su epoll se non è disponibile
+int n_loops = 1;            //cicli di eventi, ognuno con il proprio thread ed il proprio socket in ascolto
+int max_clients = 131072;   //connessioni gestite da ogni ciclo di eventi, le altre vengono gestite da un thread
+LOOP *loops;                //cicli di eventi, NULL con un thread per connessione
+
+//Richieste misurate: le scansioni dell'AppVerifica, in ogni modalità di gestione delle connessioni, ed i report dell'ASL
+enum { REQ_RECEIVE_ID, REQ_RECEIVE_REPORT, N_REQ };
+const char *const req_names[N_REQ] = {"receive_ID", "receive_report"};
+METRICS metrics;
 
 //Legge esattamente count byte s iterando opportunamente le letture. Legge anche se viene interrotta da una System Call.
 ssize_t full_read(int fd, void *buf, size_t count) {
@@ -46,7 +318,7 @@ ssize_t full_read(int fd, void *buf, size_t count) {
         if ((nread = read(fd, buf, nleft)) < 0) {
             if (errno == EINTR)
             continue; // Se si verifica una System Call che interrompe ripeti il ciclo
-            else exit(nread);
+            else return -1; //Le connessioni sono gestite da thread: un errore non deve terminare il server
         } else if (nread == 0) break; // Se sono finiti, esci
         nleft -= nread;
         buf += nread;
@@ -64,7 +336,7 @@ ssize_t full_write(int fd, const void *buf, size_t count) {
     while (nleft > 0) {          //repeat finchè non ci sono left
         if ((nwritten = write(fd, buf, nleft)) < 0) {
             if (errno == EINTR) continue; //Se si verifica una System Call che interrompe ripeti il ciclo
-            else exit(nwritten); //Se non è una System Call, esci con un errore
+            else return -1; //Se non è una System Call, ritorna un errore
         }
         nleft -= nwritten;
         buf += nwritten;
@@ -84,257 +356,1875 @@ void handler (int sign){
     }
 }
 
-//Estrae la data corrente del sistema, verrà usata per fare le operazioni di verifica GP
-void create_current_date(DATE *start_date) {
-    time_t ticks;
-    ticks = time(NULL);
+/* Giorno corrente secondo l'ora locale della macchina, numerato come i giorni di validità dei GP. In next_midnight viene restituito
+   l'istante della prossima mezzanotte locale, che tiene conto dei cambi dell'ora legale. */
+int current_day(time_t *next_midnight) {
+    time_t ticks = time(NULL);
+    struct tm tm_date;
+    DATE date;
+
+    localtime_r(&ticks, &tm_date);  //localtime_r perché viene chiamata anche dal thread del giorno corrente
+    date.day = tm_date.tm_mday;
+    date.month = tm_date.tm_mon + 1;
+    date.year = tm_date.tm_year + 1900;
+
+    tm_date.tm_mday++;
+    tm_date.tm_hour = tm_date.tm_min = tm_date.tm_sec = 0;
+    tm_date.tm_isdst = -1;
+    *next_midnight = mktime(&tm_date);
+    return days_from_date(&date);
+}
 
-    //Dichiarazione strutture per la conversione della data da stringa ad intero
-    struct tm *s_date = localtime(&ticks);
-    s_date->tm_mon += 1;           
-    s_date->tm_year += 1900;       
+/* Thread che aggiorna today alla mezzanotte locale: le verifiche leggono solo un intero, senza chiamare time() e localtime().
+   L'attesa è spezzata in intervalli di DAY_CHECK_INTERVAL secondi, così anche una correzione dell'orologio della macchina
+   viene recepita entro un minuto. */
+void *day_thread(void *arg) {
+    time_t next_midnight, now;
 
-    //Assegnamo i valori ai parametri di ritorno
-    start_date->day = s_date->tm_mday ;
-    start_date->month = s_date->tm_mon;
-    start_date->year = s_date->tm_year;
+    for (;;) {
+        __atomic_store_n(&today, current_day(&next_midnight), __ATOMIC_RELAXED);
+        while ((now = time(NULL)) < next_midnight) sleep(next_midnight - now < DAY_CHECK_INTERVAL ? next_midnight - now : DAY_CHECK_INTERVAL);
+    }
+    return NULL;
 }
 
- /* Funzione usata per la scansione del GP. Riceve un numero di tessera sanitaria
-  dall'App Verifica, chiede al ServerVaccinale il report e dopo aver
-   fatto delle procedure di verifica, comunica l'esito all'App Verifica*/
-char verify_ID(char ID[]) {
-    int socket_fd, welcome_size, package_size;
-    struct sockaddr_in server_addr;
-    char buf[MAX_SIZE], report, start_bit;
-    GP_REQUEST gp;
-    DATE current_date;
+//Istante corrente in nanosecondi, usato per le scadenze della cache e per misurare le latenze
+long now_ns() {
+    struct timespec ts;
 
-    //Valorizziamo start_bit a 0 per far capire al ServerVaccinale che la comunicazione è con il ServerVerifica
-    start_bit = '0';
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+//Rimuove dalla lista delle richieste in volo quella con il req_id indicato. Viene chiamata con backend->lock acquisito.
+PENDING *pending_remove(BACKEND *backend, unsigned int req_id) {
+    PENDING *p, *prev = NULL;
+
+    //Il ServerVaccinale risponde di norma nell'ordine di invio, quindi la richiesta cercata è quasi sempre la prima della lista
+    for (p = backend->head; p != NULL; prev = p, p = p->next) {
+        if (p->req_id != req_id) continue;
+        if (prev == NULL) backend->head = p->next;
+        else prev->next = p->next;
+        if (backend->tail == p) backend->tail = prev;
+        return p;
+    }
+    return NULL;
+}
+
+//Thread che riceve le risposte del ServerVaccinale su una connessione persistente. Le risposte possono arrivare in qualunque ordine.
+void *backend_reader(void *arg) {
+    BACKEND *backend = arg;
+    FRAME_HEADER h;
+    PROTO_READER r;
+    PENDING *p, *failed;
+    unsigned char buf[2 * (PROTO_HEADER_SIZE + 2 + MAX_BATCH * (1 + PROTO_GP_SIZE) + 16)];
+    size_t len = 0, off;
+    ssize_t nread, size = 0;
+    int fd, i;
+
+    pthread_mutex_lock(&backend->lock);
+    fd = backend->fd;
+    pthread_mutex_unlock(&backend->lock);
+
+    for (;;) {
+        //Una sola read può contenere più risposte
+        if ((nread = read(fd, buf + len, sizeof(buf) - len)) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (nread == 0) break;
+        len += nread;
+
+        //Ogni frame indica la propria lunghezza, quindi le risposte di dimensione diversa possono essere interpretate una dopo l'altra
+        for (off = 0; (size = proto_parse_header(buf + off, len - off, &h)) > 0 && size <= len - off; off += size) {
+            pthread_mutex_lock(&backend->lock);
+            p = pending_remove(backend, h.req_id);
+            pthread_mutex_unlock(&backend->lock);
+            if (p == NULL) continue;
+
+            proto_reader(&r, buf + off + PROTO_HEADER_SIZE, h.length);
+            if (h.type == MSG_GP_RESULT && p->type == MSG_GP_LOOKUP) {
+                p->report = proto_get_u8(&r);
+                if (p->report == '1') proto_get_gp(&r, &p->gp);
+            } else if (h.type == MSG_RESULT && p->type == MSG_REPORT_UPDATE) {
+                p->report = proto_get_u8(&r);
+            } else if (h.type == MSG_GP_RESULT_BATCH && p->type == MSG_GP_LOOKUP_BATCH) {
+                //L'esito 'B' indica che tutti gli esiti del blocco sono in p->items
+                p->report = (proto_get_u16(&r) == p->count) ? 'B' : '3';
+                for (i = 0; i < p->count && p->report == 'B'; i++) {
+                    p->items[i].report = proto_get_u8(&r);
+                    proto_get_gp(&r, &p->items[i].gp);
+                }
+            } else r.error = 1; //MSG_ERROR oppure risposta inattesa
+            //Un ServerVaccinale di una versione precedente non invia la posizione, che resta zero
+            if (!r.error && h.version >= 4) proto_get_position(&r, &p->position);
+            if (r.error) p->report = '3';
+            p->complete(p);
+        }
+        //Un frame non valido o più grande del buffer rende illeggibile il resto del flusso
+        if (size < 0 || size > sizeof(buf)) break;
+        len -= off;
+        memmove(buf, buf + off, len);
+    }
+
+    //La connessione è caduta: tutte le richieste in volo su di essa falliscono, la prossima richiesta riaprirà la connessione
+    pthread_mutex_lock(&backend->lock);
+    backend->fd = -1;
+    failed = backend->head;
+    backend->head = backend->tail = NULL;
+    pthread_mutex_unlock(&backend->lock);
+
+    //shutdown sblocca un eventuale invio in corso, la close avviene quando nessun thread sta più scrivendo sul socket
+    shutdown(fd, SHUT_RDWR);
+    pthread_mutex_lock(&backend->write_lock);
+    close(fd);
+    pthread_mutex_unlock(&backend->write_lock);
+
+    while ((p = failed) != NULL) {
+        failed = p->next;
+        p->report = '3';
+        p->complete(p);
+    }
+    return NULL;
+}
+
+//Apre una connessione persistente verso l'istanza del ServerVaccinale del backend. Viene chiamata con backend->lock acquisito.
+int backend_connect(BACKEND *backend) {
+    int socket_fd, enable = 1;
+    pthread_t tid;
 
     //Creazione del descrittore del socket
     if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket error");
-        exit(1);
+        return -1;
     }
 
-    //Valorizzazione struttura
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(1025);
+    //Le richieste sono piccole e vanno inviate subito, senza attendere l'algoritmo di Nagle
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
 
-     //Conversione dell’indirizzo IP, preso in input come stringa in un indirizzo di rete in network order.
-    if (inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr) <= 0) {
-        perror("inet_pton error");
-        exit(1);
+    //Connessione con il server, l'indirizzo è stato risolto al caricamento del file di instradamento
+    if (connect(socket_fd, (struct sockaddr *)&backend->node->addr, sizeof(backend->node->addr)) < 0) {
+        fprintf(stderr, "connect() error: %s:%d: %s\n", backend->node->host, backend->node->port, strerror(errno));
+        close(socket_fd);
+        return -1;
     }
 
-    //Connessione con il server
-    if (connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect() error");
-        exit(1);
+    backend->fd = socket_fd;
+
+    //Un thread dedicato riceve le risposte di questa connessione e completa le richieste in volo
+    if (pthread_create(&tid, NULL, backend_reader, backend) != 0) {
+        perror("pthread_create() error");
+        backend->fd = -1;
+        close(socket_fd);
+        return -1;
     }
+    pthread_detach(tid);
+    return 0;
+}
 
-    //Invia un bit di valore 0 al ServerVaccinale per informarlo che la comunicazione deve avvenire con il ServerVerifica
-    if (full_write(socket_fd, &start_bit, sizeof(char)) < 0) {
+/* Invia una richiesta allo shard p->shard su una delle sue connessioni persistenti. Quando arriva la risposta viene chiamata p->complete().
+   Le letture vengono distribuite a turno sulle repliche dello shard, se ne ha, e le modifiche vanno sempre al primario.
+   Se la replica scelta non è raggiungibile, o non ha ancora ricevuto la copia dei GP, la lettura viene servita dal primario. */
+void backend_submit(PENDING *p) {
+    SHARD *shard = &shard_map.shards[p->shard];
+    BACKEND *backend;
+    unsigned char buf[PROTO_HEADER_SIZE + 2 + MAX_BATCH * PROTO_ID_SIZE];
+    PROTO_WRITER w;
+    unsigned int turn = __atomic_fetch_add(&next_backend, 1, __ATOMIC_RELAXED);
+    int fd, i, node = 0, sent = 0;
+
+    if (p->replica && shard->n_nodes > 1) {
+        node = 1 + turn % (shard->n_nodes - 1);
+        turn /= shard->n_nodes - 1;
+    }
+    for (;;) {
+        backend = &shard_backends[p->shard][node * n_backends + turn % n_backends];
+        pthread_mutex_lock(&backend->lock);
+        if (backend->fd >= 0) break;
+        if (node == 0 || now_ns() >= backend->retry_at) {
+            if (backend_connect(backend) == 0) break;
+            backend->retry_at = now_ns() + 1000000000L;
+        }
+        pthread_mutex_unlock(&backend->lock);
+        if (node == 0) {
+            p->report = '3';
+            p->complete(p);
+            return;
+        }
+        node = 0;
+    }
+    fd = backend->fd;
+    p->req_id = backend->next_req_id++;
+    p->next = NULL;
+    if (backend->tail == NULL) backend->head = p;
+    else backend->tail->next = p;
+    backend->tail = p;
+    pthread_mutex_unlock(&backend->lock);
+
+    proto_begin(&w, buf, sizeof(buf), p->type, p->req_id);
+    if (p->type == MSG_GP_LOOKUP_BATCH) {
+        proto_put_u16(&w, p->count);
+        for (i = 0; i < p->count; i++) proto_put_ID(&w, p->ids[i]);
+    } else {
+        proto_put_ID(&w, p->package.ID);
+        if (p->type == MSG_REPORT_UPDATE) proto_put_u8(&w, p->package.report);
+    }
+
+    //L'invio avviene solo se la connessione su cui la richiesta è stata registrata è ancora attiva
+    pthread_mutex_lock(&backend->write_lock);
+    pthread_mutex_lock(&backend->lock);
+    sent = (backend->fd == fd);
+    pthread_mutex_unlock(&backend->lock);
+    if (sent && proto_send(fd, &w) < 0) {
         perror("full_write() error");
-        exit(1);
+        shutdown(fd, SHUT_RDWR); //Il thread lettore si accorgerà della chiusura e farà fallire le richieste in volo
     }
+    pthread_mutex_unlock(&backend->write_lock);
+}
 
-    start_bit = '1';
+//Completamento di una richiesta sincrona: risveglia il thread in attesa
+void wake_waiter(PENDING *p) {
+    WAITER *waiter = p->arg;
 
-    //Invia un bit di valore 1 al ServerVaccinale per informarlo che deve verificare il green pass
-    if (full_write(socket_fd, &start_bit, sizeof(char)) < 0) {
-        perror("full_write() error");
-        exit(1);
+    pthread_mutex_lock(&waiter->lock);
+    waiter->done = 1;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+}
+
+/* Invia una richiesta al ServerVaccinale ed attende la risposta. Con replica uguale ad 1 una lettura può essere servita da una replica.
+   In position, se non è NULL, viene restituita la posizione nel log inviata con la risposta. Ritorna il report ricevuto, '3' se la comunicazione è fallita. */
+char backend_call(unsigned char type, REPORT *package, GP_REQUEST *gp, LOG_POSITION *position, int replica) {
+    WAITER waiter = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+    PENDING p;
+
+    memset(&p, 0, sizeof(PENDING));
+    p.type = type;
+    p.shard = shard_of(&shard_map, package->ID);
+    p.replica = replica;
+    p.package = *package;
+    p.complete = wake_waiter;
+    p.arg = &waiter;
+    backend_submit(&p);
+
+    pthread_mutex_lock(&waiter.lock);
+    while (!waiter.done) pthread_cond_wait(&waiter.cond, &waiter.lock);
+    pthread_mutex_unlock(&waiter.lock);
+
+    if (gp != NULL) *gp = p.gp;
+    if (position != NULL) *position = p.position;
+    return p.report;
+}
+
+//Completamento di una richiesta a blocchi: distribuisce gli esiti alle singole verifiche e le risveglia
+void batch_complete(PENDING *p) {
+    BATCH *batch = p->arg;
+    LOOKUP *lookup;
+    int i;
+
+    for (i = 0; i < p->count; i++) {
+        lookup = batch->lookups[i];
+        if (p->report == 'B') {
+            lookup->report = batch->items[i].report;
+            lookup->gp = batch->items[i].gp;
+            lookup->position = p->position;
+        } else lookup->report = '3';
+        lookup->complete(lookup);
     }
+    free(batch);
+}
 
-    //Invia il numero di tessera sanitaria ricevuto dall'AppVerifica al SeverVaccinale
-    if (full_write(socket_fd, ID, ID_SIZE)) {
-        perror("full_write() error");
-        exit(1);
+/* Thread batcher: raggruppa le verifiche concorrenti in richieste a blocchi. Un blocco parte quando contiene max_batch verifiche
+   oppure quando sono passati max_wait microsecondi dall'arrivo della prima; sotto carico i blocchi si riempiono senza attese.
+   Ogni shard ha il proprio batcher, quindi un blocco contiene solo tessere della stessa istanza del ServerVaccinale. */
+void *batcher_thread(void *arg) {
+    LOOKUP_QUEUE *queue = arg;
+    struct timespec deadline;
+    BATCH *batch;
+    LOOKUP *lookup;
+    int count;
+
+    for (;;) {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->len == 0) pthread_cond_wait(&queue->cond, &queue->lock);
+
+        if (queue->len + queue->joined < max_batch && max_wait > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += max_wait * 1000L;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+            while (queue->len + queue->joined < max_batch)
+                if (pthread_cond_timedwait(&queue->cond, &queue->lock, &deadline) != 0) break;
+        }
+
+        //Estrae dalla coda al più max_batch verifiche
+        if ((batch = malloc(sizeof(BATCH))) == NULL) {
+            pthread_mutex_unlock(&queue->lock);
+            perror("malloc() error");
+            sleep(1);
+            continue;
+        }
+        for (count = 0; count < max_batch && (lookup = queue->head) != NULL; count++) {
+            queue->head = lookup->next;
+            batch->lookups[count] = lookup;
+            memcpy(batch->ids[count], lookup->ID, ID_SIZE);
+            lookup->queued = 0;
+            queue->len -= lookup->scans;
+        }
+        if (queue->head == NULL) queue->tail = NULL;
+        queue->joined = 0;
+        pthread_mutex_unlock(&queue->lock);
+
+        memset(&batch->pending, 0, sizeof(PENDING));
+        batch->pending.type = MSG_GP_LOOKUP_BATCH;
+        batch->pending.shard = queue->shard;
+        batch->pending.replica = 1;
+        batch->pending.count = count;
+        batch->pending.ids = batch->ids;
+        batch->pending.items = batch->items;
+        batch->pending.complete = batch_complete;
+        batch->pending.arg = batch;
+        backend_submit(&batch->pending);
     }
+    return NULL;
+}
 
-    //Riceve report dal ServerVaccinale
-    if (full_read(socket_fd, &report, sizeof(char)) < 0) {
-        perror("full_read() error");
-        exit(1);
+/* Accoda al batcher la richiesta del GP di una tessera, senza attendere l'esito: più richieste accodate insieme finiscono nello stesso blocco.
+   Quando arriva l'esito viene chiamata complete */
+void lookup_submit(LOOKUP *lookup, char ID[], void (*complete)(LOOKUP *), void *arg) {
+    LOOKUP_QUEUE *queue = &lookup_queues[shard_of(&shard_map, ID)];
+
+    memset(lookup, 0, sizeof(LOOKUP));
+    memcpy(lookup->ID, ID, ID_SIZE);
+    lookup->ID[ID_SIZE - 1] = 0;
+    lookup->complete = complete;
+    lookup->arg = arg;
+    lookup->queued = 1;
+    lookup->scans = 1;
+
+    pthread_mutex_lock(&queue->lock);
+    if (queue->tail == NULL) queue->head = lookup;
+    else queue->tail->next = lookup;
+    queue->tail = lookup;
+    queue->len++;
+    //Il batcher va svegliato per la prima verifica del blocco e quando il blocco è pieno
+    if (queue->len == 1 || queue->len + queue->joined >= max_batch) pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/* Un'altra verifica attende l'esito della richiesta e conta per il riempimento del blocco come se avesse inviato la propria richiesta:
+   le verifiche unite ad una richiesta in volo non fanno attendere max_wait al blocco successivo, che senza di loro non si riempirebbe */
+void lookup_follow(LOOKUP *lookup) {
+    LOOKUP_QUEUE *queue = &lookup_queues[shard_of(&shard_map, lookup->ID)];
+
+    pthread_mutex_lock(&queue->lock);
+    if (lookup->queued) {
+        lookup->scans++;
+        queue->len++;
+    } else queue->joined++;
+    if (queue->len > 0 && queue->len + queue->joined >= max_batch) pthread_cond_signal(&queue->cond);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+//Alloca le partizioni della cache, ognuna con cache_size / CACHE_SHARDS elementi
+void cache_init() {
+    CACHE_SHARD *shard;
+    int i, j;
+
+    for (i = 0; i < CACHE_SHARDS; i++) {
+        shard = &cache_shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        shard->capacity = (cache_size + CACHE_SHARDS - 1) / CACHE_SHARDS;
+        for (shard->n_buckets = 1; shard->n_buckets < shard->capacity; shard->n_buckets *= 2);
+        if ((shard->entries = calloc(shard->capacity, sizeof(CACHE_ENTRY))) == NULL || (shard->buckets = malloc(shard->n_buckets * sizeof(int))) == NULL) {
+            perror("malloc() error");
+            exit(1);
+        }
+        for (j = 0; j < shard->n_buckets; j++) shard->buckets[j] = -1;
+    }
+}
+
+//Ritorna l'elemento della partizione con la chiave indicata, -1 se non è presente. Viene chiamata con shard->lock acquisito.
+int cache_find(CACHE_SHARD *shard, unsigned long hash, GP_KEY key) {
+    int i;
+
+    for (i = shard->buckets[(hash / CACHE_SHARDS) & (shard->n_buckets - 1)]; i >= 0; i = shard->entries[i].next)
+        if (shard->entries[i].key == key) return i;
+    return -1;
+}
+
+//Rimuove un elemento dalla sua lista di collisione e lo libera. Viene chiamata con shard->lock acquisito.
+void cache_remove(CACHE_SHARD *shard, int index) {
+    int *link = &shard->buckets[(key_hash(shard->entries[index].key) / CACHE_SHARDS) & (shard->n_buckets - 1)];
+
+    while (*link != index) link = &shard->entries[*link].next;
+    *link = shard->entries[index].next;
+    shard->entries[index].used = 0;
+    shard->used--;
+}
+
+/* Cerca il GP nella cache. Ritorna 1 se è presente e non scaduto. In caso contrario restituisce in generation la generazione
+   della partizione, da passare a cache_insert dopo la richiesta al ServerVaccinale. */
+int cache_lookup(GP_KEY key, GP_REQUEST *gp, unsigned long *generation) {
+    unsigned long hash = key_hash(key);
+    CACHE_SHARD *shard = &cache_shards[hash % CACHE_SHARDS];
+    int i, hit = 0;
+
+    pthread_mutex_lock(&shard->lock);
+    if ((i = cache_find(shard, hash, key)) >= 0) {
+        if (shard->entries[i].expires > now_ns()) {
+            shard->entries[i].referenced = 1;
+            *gp = shard->entries[i].gp;
+            hit = 1;
+        } else cache_remove(shard, i);
+    }
+    *generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+
+    if (hit) {
+        __atomic_fetch_add(&cache_stats.hits, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&cache_stats.saved_ns, __atomic_load_n(&cache_stats.miss_ns, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    } else __atomic_fetch_add(&cache_stats.misses, 1, __ATOMIC_RELAXED);
+    return hit;
+}
+
+/* Inserisce nella cache il GP ricevuto dal ServerVaccinale. Se nel frattempo la partizione è stata invalidata da un report dell'ASL
+   il GP potrebbe essere precedente alla modifica, quindi non viene inserito. */
+void cache_insert(GP_KEY key, GP_REQUEST *gp, unsigned long generation) {
+    unsigned long hash = key_hash(key);
+    CACHE_SHARD *shard = &cache_shards[hash % CACHE_SHARDS];
+    CACHE_ENTRY *entry;
+    long now = now_ns();
+    int i, *bucket;
+
+    pthread_mutex_lock(&shard->lock);
+    if (shard->generation != generation) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+
+    if ((i = cache_find(shard, hash, key)) < 0) {
+        //Algoritmo CLOCK: la lancetta salta gli elementi letti di recente (azzerandone il bit) e libera il primo non referenziato o scaduto
+        while (shard->used == shard->capacity) {
+            entry = &shard->entries[shard->hand];
+            if (entry->referenced && entry->expires > now) entry->referenced = 0;
+            else {
+                cache_remove(shard, shard->hand);
+                __atomic_fetch_add(&cache_stats.evictions, 1, __ATOMIC_RELAXED);
+            }
+            shard->hand = (shard->hand + 1) % shard->capacity;
+        }
+        for (i = shard->hand; shard->entries[i].used; i = (i + 1) % shard->capacity);
+
+        entry = &shard->entries[i];
+        memset(entry, 0, sizeof(CACHE_ENTRY));
+        entry->key = key;
+        entry->used = 1;
+        bucket = &shard->buckets[(hash / CACHE_SHARDS) & (shard->n_buckets - 1)];
+        entry->next = *bucket;
+        *bucket = i;
+        shard->used++;
     }
+    shard->entries[i].gp = *gp;
+    shard->entries[i].expires = now + cache_ttl * 1000000000L;
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//Elimina dalla cache il GP con la chiave indicata ed impedisce l'inserimento dei GP richiesti prima dell'invalidazione
+void cache_invalidate(GP_KEY key) {
+    unsigned long hash = key_hash(key);
+    CACHE_SHARD *shard = &cache_shards[hash % CACHE_SHARDS];
+    int i;
+
+    if (cache_size == 0) return;
+    pthread_mutex_lock(&shard->lock);
+    if ((i = cache_find(shard, hash, key)) >= 0) cache_remove(shard, i);
+    shard->generation++;
+    pthread_mutex_unlock(&shard->lock);
+    __atomic_fetch_add(&cache_stats.invalidations, 1, __ATOMIC_RELAXED);
+}
+
+//Generazione corrente della partizione della cache che contiene la chiave, da passare a cache_insert
+unsigned long cache_generation(GP_KEY key) {
+    CACHE_SHARD *shard = &cache_shards[key_hash(key) % CACHE_SHARDS];
+    unsigned long generation;
 
-    if (report == '1') {
-        //Ricezione dell'esito della verifica dal ServerVaccinale, se 0 non valido se 1 valido
-        if (full_read(socket_fd, &gp, sizeof(GP_REQUEST)) < 0) {
-            perror("full_read() error");
+    pthread_mutex_lock(&shard->lock);
+    generation = shard->generation;
+    pthread_mutex_unlock(&shard->lock);
+    return generation;
+}
+
+//Alloca le posizioni dei report degli shard con repliche: solo una replica può rispondere con un GP precedente ad un report
+void report_marks_init() {
+    int i;
+
+    for (i = 0; i < shard_map.n_shards; i++) {
+        pthread_mutex_init(&report_marks[i].lock, NULL);
+        if (shard_map.shards[i].n_nodes > 1 && (report_marks[i].positions = calloc(REPORT_SLOTS, sizeof(LOG_POSITION))) == NULL) {
+            perror("calloc() error");
             exit(1);
         }
+    }
+}
+
+//Ritorna 1 se la posizione a precede la posizione b nel log del primario
+int position_before(const LOG_POSITION *a, const LOG_POSITION *b) {
+    return a->run < b->run || (a->run == b->run && a->lsn < b->lsn);
+}
+
+//Registra la posizione nel log di un report confermato dal primario. Va chiamata prima dell'invalidazione che segue la modifica.
+void report_mark(char ID[], GP_KEY key, LOG_POSITION *position) {
+    REPORT_MARKS *marks = &report_marks[shard_of(&shard_map, ID)];
+    LOG_POSITION *mark;
+
+    if (marks->positions == NULL) return;
+    pthread_mutex_lock(&marks->lock);
+    mark = &marks->positions[key_hash(key) % REPORT_SLOTS];
+    if (position_before(mark, position)) *mark = *position;
+    pthread_mutex_unlock(&marks->lock);
+}
+
+/* Ritorna 1 se chi ha risposto dalla posizione indicata aveva già applicato tutti i report confermati per la tessera. Una replica in ritardo
+   può rispondere con il GP precedente ad un report anche dopo la conferma: il GP viene usato per la verifica ma non messo in cache. */
+int report_applied(char ID[], GP_KEY key, LOG_POSITION *position) {
+    REPORT_MARKS *marks = &report_marks[shard_of(&shard_map, ID)];
+    int applied;
+
+    if (marks->positions == NULL) return 1;
+    pthread_mutex_lock(&marks->lock);
+    applied = !position_before(position, &marks->positions[key_hash(key) % REPORT_SLOTS]);
+    pthread_mutex_unlock(&marks->lock);
+    return applied;
+}
+
+//Aggiorna la media mobile della latenza di una richiesta al ServerVaccinale, usata per stimare il tempo risparmiato dalla cache
+void cache_miss_latency(long elapsed) {
+    unsigned long avg = __atomic_load_n(&cache_stats.miss_ns, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&cache_stats.miss_ns, avg ? avg - avg / 8 + elapsed / 8 : elapsed, __ATOMIC_RELAXED);
+}
+
+//Alloca il filtro delle tessere con FILTER_BITS_PER_KEY bit per ognuna delle filter_size tessere previste
+void filter_init() {
+    size_t blocks;
+
+    for (blocks = 1; blocks * 512 < filter_size * FILTER_BITS_PER_KEY; blocks *= 2);
+    if ((filter.bits = calloc(blocks * 8, sizeof(unsigned long))) == NULL) {
+        perror("calloc() error");
+        exit(1);
+    }
+    filter.mask = blocks - 1;
+}
+
+//Ritorna il blocco del filtro della chiave ed in bits le posizioni dei suoi bit nel blocco, 9 bit per ognuna
+unsigned long *filter_block(GP_KEY key, unsigned long *bits) {
+    unsigned long hash = key_hash(key);
+
+    *bits = key_hash(hash);
+    return &filter.bits[(hash & filter.mask) * 8];
+}
+
+//Aggiunge una tessera al filtro. I bit vengono impostati in modo atomico, le verifiche leggono il filtro senza lock
+void filter_add(GP_KEY key) {
+    unsigned long bits, *block = filter_block(key, &bits);
+    int i;
+
+    for (i = 0; i < FILTER_HASHES; i++, bits >>= 9)
+        __atomic_fetch_or(&block[(bits & 511) / 64], 1UL << (bits & 63), __ATOMIC_RELAXED);
+}
+
+/* Ritorna 1 se la tessera sicuramente non ha un GP, 0 se potrebbe averlo o se il filtro del suo shard non è completo.
+   Un falso positivo costa solo la richiesta al ServerVaccinale, che risponde comunque tessera inesistente. */
+int filter_absent(char ID[], GP_KEY key) {
+    unsigned long bits, *block;
+    int i;
+
+    if (filter_size == 0 || !__atomic_load_n(&filter.ready[shard_of(&shard_map, ID)], __ATOMIC_ACQUIRE)) return 0;
+    block = filter_block(key, &bits);
+    for (i = 0; i < FILTER_HASHES; i++, bits >>= 9)
+        if ((__atomic_load_n(&block[(bits & 511) / 64], __ATOMIC_RELAXED) & (1UL << (bits & 63))) == 0) {
+            __atomic_fetch_add(&filter.negatives, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    return 0;
+}
 
+/* Thread che riceve dal primario di uno shard le tessere con un GP: prima la copia di tutte le tessere, poi quelle dei nuovi GP appena la loro
+   emissione è accodata al log, senza attendere il disco: una tessera di un'emissione persa in un crash è solo un falso positivo, che costa
+   una richiesta al ServerVaccinale. Finché la copia non è completa, o se la connessione cade, le tessere dello shard vengono cercate sul ServerVaccinale. */
+void *filter_thread(void *arg) {
+    int shard = (int)(long)arg, socket_fd, count, i, phase, error;
+    unsigned long received;
+    SHARD_NODE *primary = &shard_map.shards[shard].nodes[0];
+    unsigned char payload[PROTO_FILTER_KEYS_MAX], buf[PROTO_HEADER_SIZE];
+    FRAME_HEADER h;
+    PROTO_READER r;
+    PROTO_WRITER w;
+
+    for (;; sleep(1)) {
+        if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+            perror("socket() error");
+            continue;
+        }
+        if (connect(socket_fd, (struct sockaddr *)&primary->addr, sizeof(primary->addr)) < 0) {
+            close(socket_fd);
+            continue;
+        }
+        proto_begin(&w, buf, sizeof(buf), MSG_FILTER_SUBSCRIBE, 0);
+        error = proto_send(socket_fd, &w) < 0;
+        received = 0;
+
+        while (!error && proto_recv(socket_fd, &h, payload, sizeof(payload)) == 0) {
+            //Un ServerVaccinale di una versione precedente non conosce il filtro: le tessere dello shard vengono sempre cercate su di esso
+            if (h.type == MSG_ERROR) {
+                printf("Il ServerVaccinale %s:%d non invia le tessere, filtro non disponibile per lo shard %d\n", primary->host, primary->port, shard);
+                close(socket_fd);
+                return NULL;
+            }
+            proto_reader(&r, payload, h.length);
+            phase = proto_get_u8(&r);
+            count = proto_get_u16(&r);
+            for (i = 0; i < count && !r.error; i++) filter_add(proto_get_u64(&r));
+            __atomic_fetch_add(&filter.keys, i, __ATOMIC_RELAXED);
+            received += i;
+            error = r.error || h.type != MSG_FILTER_KEYS;
+
+            //Il primo frame delle nuove emissioni indica che la copia è completa
+            if (!error && phase == 1 && !filter.ready[shard]) {
+                __atomic_store_n(&filter.ready[shard], 1, __ATOMIC_RELEASE);
+                printf("Filtro delle tessere dello shard %d completo (%lu tessere)\n", shard, received);
+            }
+        }
         close(socket_fd);
 
-        //Funzione per ricavare la data corrente
-        create_current_date(&current_date);
+        if (filter.ready[shard]) printf("Flusso delle tessere dello shard %d interrotto, le tessere vengono cercate sul ServerVaccinale\n", shard);
+        __atomic_store_n(&filter.ready[shard], 0, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+//Thread che stampa periodicamente i contatori della cache e del filtro delle tessere
+void *stats_thread(void *arg) {
+    unsigned long hits, misses, negatives, memory;
+    LOOP *loop_list;
+    int i, clients;
 
-        if (current_date.year > gp.expire_date.year) report = '0';
-        if (report == '1' && current_date.month > gp.expire_date.month) report = '0';
-        if (report == '1' && current_date.day > gp.expire_date.day) report = '0';
-        if (report == '1' && gp.report == '0') report = '0'; //Se il Green Pass è valido temporalmente MA il report è negativo, allora il GP non è valido
+    for (;;) {
+        sleep(stats_interval);
+        if ((loop_list = __atomic_load_n(&loops, __ATOMIC_ACQUIRE)) != NULL) {
+            for (i = clients = 0, memory = 0; i < n_loops; i++) {
+                clients += __atomic_load_n(&loop_list[i].clients, __ATOMIC_RELAXED);
+                memory += __atomic_load_n(&loop_list[i].pool.used, __ATOMIC_RELAXED);
+            }
+            printf("Cicli di eventi: %d connessioni aperte, %lu KiB di memoria per connessioni, verifiche e buffer\n", clients, memory / 1024);
+        }
+        if ((negatives = __atomic_load_n(&filter.negatives, __ATOMIC_RELAXED)) > 0)
+            printf("Filtro: %lu chiavi ricevute, %lu tessere inesistenti riconosciute senza contattare il ServerVaccinale\n",
+                   __atomic_load_n(&filter.keys, __ATOMIC_RELAXED), negatives);
+        if (__atomic_load_n(&coalesced, __ATOMIC_RELAXED) > 0)
+            printf("Richieste unite: %lu verifiche hanno atteso la risposta già richiesta per la stessa tessera\n", __atomic_load_n(&coalesced, __ATOMIC_RELAXED));
+        hits = __atomic_load_n(&cache_stats.hits, __ATOMIC_RELAXED);
+        misses = __atomic_load_n(&cache_stats.misses, __ATOMIC_RELAXED);
+        if (hits + misses == 0) continue;
+        printf("Cache: %lu hit, %lu miss (%.1f%% hit), %lu eliminazioni, %lu invalidazioni, %.3f s risparmiati\n",
+               hits, misses, 100.0 * hits / (hits + misses), __atomic_load_n(&cache_stats.evictions, __ATOMIC_RELAXED),
+               __atomic_load_n(&cache_stats.invalidations, __ATOMIC_RELAXED), __atomic_load_n(&cache_stats.saved_ns, __ATOMIC_RELAXED) / 1e9);
     }
+    return NULL;
+}
 
-    return report;
+//Esito del ServerVaccinale per una tessera: la verifica prosegue nel ciclo che l'ha avviata, oppure nel thread in attesa
+void scan_done(SCAN *scan) {
+    if (scan->notify != NULL) {
+        scan->notify(scan);
+        return;
+    }
+    pthread_mutex_lock(&scan->waiter.lock);
+    scan->waiter.done = 1;
+    pthread_cond_signal(&scan->waiter.cond);
+    pthread_mutex_unlock(&scan->waiter.lock);
 }
 
-//Funzione per la gestione della comunicazione con l'utente
-void receive_ID(int connect_fd) {
-    char report, buf[MAX_SIZE], ID[ID_SIZE];
-    int index, welcome_size, package_size;
-
-    //Stampa un messaggo di benvenuto da inviare all'AppVerifica quando si collega ServerVerifica.
-    snprintf(buf, WELCOME_SIZE, "*Benvenuto nel server di verifica*\nInserisci il numero di tessera sanitaria per verificare la suà validità.");
-    buf[WELCOME_SIZE - 1] = 0;
-    if(full_write(connect_fd, buf, WELCOME_SIZE) < 0) {
-        perror("full_write() error");
-        exit(1);
+//Partizione e lista di collisione delle richieste in volo per la tessera con la chiave indicata
+SCAN **flight_bucket(GP_KEY key, FLIGHT_SHARD **shard) {
+    unsigned long hash = key_hash(key);
+
+    *shard = &flight_shards[hash % FLIGHT_SHARDS];
+    return &(*shard)->buckets[(hash / FLIGHT_SHARDS) % FLIGHT_BUCKETS];
+}
+
+/* Se è già in volo una richiesta dello stesso tipo per la stessa tessera la verifica ne attende la risposta e ritorna 1, altrimenti la verifica
+   diventa la richiesta in volo e ritorna 0. Così un gruppo con la stessa tessera o i tentativi ripetuti di un dispositivo raggiungono
+   il ServerVaccinale una volta sola. */
+int flight_join(SCAN *scan, int replica) {
+    FLIGHT_SHARD *shard;
+    SCAN **bucket = flight_bucket(scan->key, &shard), *leader;
+
+    pthread_mutex_lock(&shard->lock);
+    for (leader = *bucket; leader != NULL && (leader->key != scan->key || leader->flight != replica); leader = leader->next_flight);
+    if (leader != NULL) {
+        /* La risposta può essere precedente ad un report dell'ASL arrivato dopo l'invio della richiesta: la verifica usa la generazione
+           della cache letta da chi ha inviato la richiesta, così cache_insert scarta il GP */
+        scan->generation = leader->generation;
+        scan->next_follower = leader->followers;
+        leader->followers = scan;
+        if (replica && max_batch > 1) lookup_follow(&leader->lookup);
+    } else {
+        scan->flight = replica;
+        scan->followers = NULL;
+        scan->next_flight = *bucket;
+        *bucket = scan;
     }
+    pthread_mutex_unlock(&shard->lock);
 
-    //Riceve il numero di codice fiscale dall'AppVerica
-    if(full_read(connect_fd, ID, ID_SIZE) < 0) {
-        perror("full_read error");
-        exit(1);
+    if (leader != NULL) __atomic_fetch_add(&coalesced, 1, __ATOMIC_RELAXED);
+    return leader != NULL;
+}
+
+//Toglie dalle richieste in volo quelle per la tessera indicata (o solo scan, se non è NULL). Le verifiche già in attesa ricevono comunque la risposta.
+SCAN *flight_remove(GP_KEY key, SCAN *scan) {
+    FLIGHT_SHARD *shard;
+    SCAN **p = flight_bucket(key, &shard), *followers = NULL;
+
+    pthread_mutex_lock(&shard->lock);
+    while (*p != NULL) {
+        if ((*p)->key == key && (scan == NULL || *p == scan)) *p = (*p)->next_flight;
+        else p = &(*p)->next_flight;
+    }
+    if (scan != NULL) {
+        followers = scan->followers;
+        scan->followers = NULL;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return followers;
+}
+
+//Risposta del ServerVaccinale per la richiesta in volo di scan: viene consegnata anche alle verifiche della stessa tessera in attesa
+void flight_done(SCAN *scan) {
+    SCAN *follower, *next;
+
+    for (follower = flight_remove(scan->key, scan); follower != NULL; follower = next) {
+        next = follower->next_follower;
+        follower->report = scan->report;
+        follower->gp = scan->gp;
+        follower->position = scan->position;
+        scan_done(follower);
     }
+    scan_done(scan);
+}
 
-    //Notifica all'utente la corretta ricezione dei dati che aveva inviato.
-    snprintf(buf, ACK_SIZE, "numero di tessera correttamente ricevuto");
-    buf[ACK_SIZE - 1] = 0;
-    if(full_write(connect_fd, buf, ACK_SIZE) < 0) {
+//Completamento della richiesta a blocchi di una tessera
+void scan_lookup_done(LOOKUP *lookup) {
+    SCAN *scan = lookup->arg;
+
+    scan->report = lookup->report;
+    scan->gp = lookup->gp;
+    scan->position = lookup->position;
+    flight_done(scan);
+}
+
+//Completamento della richiesta singola di una tessera
+void scan_pending_done(PENDING *p) {
+    SCAN *scan = p->arg;
+
+    scan->report = p->report;
+    scan->gp = p->gp;
+    scan->position = p->position;
+    flight_done(scan);
+}
+
+/* Richiede il GP della tessera al ServerVaccinale senza attendere l'esito. Con replica uguale ad 1 la richiesta passa dal batcher, se attivo,
+   e può essere servita da una replica; altrimenti va al primario dello shard. */
+void scan_request(SCAN *scan, int replica) {
+    scan->waiting = 1;
+    scan->waiter.done = 0;
+    if (flight_join(scan, replica)) return;
+    if (replica && max_batch > 1) {
+        lookup_submit(&scan->lookup, scan->ID, scan_lookup_done, scan);
+        return;
+    }
+    memset(&scan->pending, 0, sizeof(PENDING));
+    scan->pending.type = MSG_GP_LOOKUP;
+    scan->pending.shard = shard_of(&shard_map, scan->ID);
+    scan->pending.replica = replica;
+    memcpy(scan->pending.package.ID, scan->ID, ID_SIZE);
+    scan->pending.complete = scan_pending_done;
+    scan->pending.arg = scan;
+    backend_submit(&scan->pending);
+}
+
+/* Prima fase della verifica di scan->ID: le tessere non valide, assenti dal filtro o presenti nella cache vengono verificate subito,
+   per le altre viene richiesto il GP al ServerVaccinale e scan->waiting resta ad 1 fino all'esito */
+void verify_start(SCAN *scan) {
+    scan->ID[ID_SIZE - 1] = 0;
+    scan->start = 0;
+    scan->waiting = 0;
+    scan->primary = 0;
+
+    //Una tessera non alfanumerica non può esistere, viene rifiutata senza contattare il ServerVaccinale
+    if ((scan->key = id_key(scan->ID)) == 0) {
+        scan->report = '2';
+        return;
+    }
+
+    /* Una tessera assente dal filtro non ha un GP: la scansione di una tessera sconosciuta non raggiunge il ServerVaccinale. Le nuove tessere
+       arrivano al filtro appena l'emissione è accodata al log, di solito prima della conferma inviata al CentroVaccinale */
+    if (filter_absent(scan->ID, scan->key)) {
+        scan->report = '2';
+        return;
+    }
+
+    //Le tessere scansionate di recente vengono verificate senza contattare il ServerVaccinale
+    if (cache_size > 0 && cache_lookup(scan->key, &scan->gp, &scan->generation)) {
+        scan->report = '1';
+        return;
+    }
+
+    //Richiede il GP al ServerVaccinale: le verifiche concorrenti vengono raggruppate in un'unica richiesta a blocchi
+    scan->start = now_ns();
+    if (scan->notify == NULL) {
+        pthread_mutex_init(&scan->waiter.lock, NULL);
+        pthread_cond_init(&scan->waiter.cond, NULL);
+    }
+    scan_request(scan, 1);
+}
+
+//Prosegue la verifica dopo l'esito del ServerVaccinale. Ritorna 1 se è stata avviata un'altra richiesta, 0 se la verifica è completa
+int verify_continue(SCAN *scan) {
+    scan->waiting = 0;
+
+    //Una replica in ritardo non conosce ancora i GP appena emessi: una tessera inesistente per la replica viene cercata sul primario
+    if (scan->report == '2' && !scan->primary && shard_map.shards[shard_of(&shard_map, scan->ID)].n_nodes > 1) {
+        scan->primary = 1;
+        scan_request(scan, 0);
+        return 1;
+    }
+    if (cache_size > 0 && scan->report == '1') {
+        cache_miss_latency(now_ns() - scan->start);
+        if (report_applied(scan->ID, scan->key, &scan->position)) cache_insert(scan->key, &scan->gp, scan->generation);
+    }
+    return 0;
+}
+
+//Esito della verifica completa da inviare all'AppVerifica
+char verify_result(SCAN *scan) {
+    int day, valid;
+
+    if (scan->report != '1') return scan->report;
+
+    /* Il GP è valido se il giorno corrente cade tra inizio e scadenza ed il report non è negativo. Con la sottrazione senza segno
+       un giorno precedente all'inizio diventa un numero enorme, così l'intervallo si controlla con un solo confronto. */
+    day = __atomic_load_n(&today, __ATOMIC_RELAXED);
+    valid = ((unsigned int)(day - scan->gp.start_day) <= (unsigned int)(scan->gp.expire_day - scan->gp.start_day)) & (scan->gp.report != '0');
+    return valid ? '1' : '0';
+}
+
+//Attende la fine della verifica avviata con verify_start da un thread (notify uguale a NULL) e ne ritorna l'esito
+char verify_end(SCAN *scan) {
+    while (scan->waiting) {
+        pthread_mutex_lock(&scan->waiter.lock);
+        while (!scan->waiter.done) pthread_cond_wait(&scan->waiter.cond, &scan->waiter.lock);
+        pthread_mutex_unlock(&scan->waiter.lock);
+        verify_continue(scan);
+    }
+    return verify_result(scan);
+}
+
+ /* Funzione usata per la scansione del GP. Riceve un numero di tessera sanitaria
+  dall'App Verifica, chiede al ServerVaccinale il report e dopo aver
+   fatto delle procedure di verifica, comunica l'esito all'App Verifica*/
+char verify_ID(char ID[]) {
+    SCAN scan;
+
+    memcpy(scan.ID, ID, ID_SIZE);
+    scan.notify = NULL;
+    verify_start(&scan);
+    return verify_end(&scan);
+}
+
+//Messaggio da mostrare all'AppVerifica per l'esito di una verifica
+const char *scan_text(char report) {
+    if (report == '1') return "GP valido";
+    if (report == '0') return "GP non valido, uscita";
+    if (report == '3') return "Servizio non disponibile, riprova";
+    return "Numero tessera inesistente";
+}
+
+//Invia un frame contenente solo un testo (MSG_WELCOME o MSG_ACK). Ritorna -1 in caso di errore.
+int send_text(int connect_fd, unsigned char type, unsigned int req_id, const char *text) {
+    unsigned char buf[PROTO_HEADER_SIZE + MAX_SIZE];
+    PROTO_WRITER w;
+
+    proto_begin(&w, buf, sizeof(buf), type, req_id);
+    proto_put_text(&w, text);
+    return proto_send(connect_fd, &w);
+}
+
+//Invia un MSG_RESULT con l'esito ed il messaggio da mostrare al client. Ritorna -1 in caso di errore.
+int send_result(int connect_fd, unsigned int req_id, char result, const char *text) {
+    unsigned char buf[PROTO_HEADER_SIZE + 1 + MAX_SIZE];
+    PROTO_WRITER w;
+
+    proto_begin(&w, buf, sizeof(buf), MSG_RESULT, req_id);
+    proto_put_u8(&w, result);
+    proto_put_text(&w, text);
+    return proto_send(connect_fd, &w);
+}
+
+//Invia un MSG_ERROR al client che ha inviato un frame non gestito. Ritorna -1 in caso di errore.
+int send_error(int connect_fd, unsigned int req_id, int code) {
+    unsigned char buf[PROTO_HEADER_SIZE + 2];
+    PROTO_WRITER w;
+
+    proto_begin(&w, buf, sizeof(buf), MSG_ERROR, req_id);
+    proto_put_u8(&w, code);
+    proto_put_u8(&w, PROTO_VERSION);
+    return proto_send(connect_fd, &w);
+}
+
+//Funzione per la gestione della comunicazione con l'utente
+void receive_ID(int connect_fd, unsigned int req_id) {
+    unsigned char payload[MAX_SIZE];
+    char report, ID[ID_SIZE];
+    int n;
+    long start;
+    FRAME_HEADER h;
+    PROTO_READER r;
+
+    //Invia un messaggo di benvenuto all'AppVerifica quando si collega ServerVerifica.
+    if (send_text(connect_fd, MSG_WELCOME, req_id, WELCOME_TEXT) < 0) {
         perror("full_write() error");
-        exit(1);
+        return;
     }
 
-    //Funzione che invia il numero di tessera sanitaria al ServerVaccinale, riceve l'esito da questo e lo invia al clientS
-    report = verify_ID(ID);
+    //La connessione può trasportare più tessere: l'AppVerifica in modalità batch le invia una dopo l'altra senza attendere le risposte
+    for (n = 0; ; n++) {
+        //Riceve il numero di codice fiscale dall'AppVerica, la chiusura della connessione termina la sessione
+        if (proto_recv(connect_fd, &h, payload, sizeof(payload)) < 0) {
+            if (n == 0) perror("full_read error");
+            return;
+        }
+        if (h.type != MSG_SCAN) {
+            send_error(connect_fd, h.req_id, PROTO_ERR_TYPE);
+            return;
+        }
+        start = metric_start(&metrics, REQ_RECEIVE_ID);
+        proto_reader(&r, payload, h.length);
+        proto_get_ID(&r, ID);
 
-    //Invia il report di validità del green pass all'App di verifica
-    if (report == '1') {
-        strcpy(buf, "GP valido");
-        if(full_write(connect_fd, buf, ASL_ACK) < 0) {
+        //Notifica all'utente la corretta ricezione dei dati che aveva inviato.
+        if (send_text(connect_fd, MSG_ACK, h.req_id, ACK_TEXT) < 0) {
             perror("full_write() error");
-            exit(1);
+            metric_end(&metrics, REQ_RECEIVE_ID, start, 1);
+            return;
         }
-    } else if (report == '0') {
-        strcpy(buf, "GP non valido, uscita");
-        if(full_write(connect_fd, buf, ASL_ACK) < 0) {
+
+        //Funzione che invia il numero di tessera sanitaria al ServerVaccinale, riceve l'esito da questo e lo invia al clientS
+        report = verify_ID(ID);
+
+        //Invia il report di validità del green pass all'App di verifica
+        if (send_result(connect_fd, h.req_id, report, scan_text(report)) < 0) {
             perror("full_write() error");
-            exit(1);
+            metric_end(&metrics, REQ_RECEIVE_ID, start, 1);
+            return;
         }
-    } else {
-        strcpy(buf, "Numero tessera inesistente");
-        if(full_write(connect_fd, buf, ASL_ACK) < 0) {
+        metric_end(&metrics, REQ_RECEIVE_ID, start, report == '3');
+    }
+}
+
+/* Sessione dell'AppVerifica (MSG_HELLO con HELLO_SESSION): il benvenuto e l'ack vengono inviati una sola volta, poi ogni MSG_SCAN riceve solo
+   il MSG_RESULT. Le tessere arrivate con una stessa lettura vengono verificate insieme: le richieste al ServerVaccinale partono tutte prima
+   di attendere gli esiti, quindi finiscono negli stessi blocchi. Gli esiti partono nell'ordine delle richieste con un'unica write. */
+void scan_session(int connect_fd, unsigned int req_id) {
+    unsigned char in[PROTO_HEADER_SIZE + MAX_SIZE + MAX_SESSION_SCANS * (PROTO_HEADER_SIZE + PROTO_ID_SIZE)];
+    unsigned char out[MAX_SESSION_SCANS * (PROTO_HEADER_SIZE + 1 + 64)];
+    SCAN *scans;
+    FRAME_HEADER h;
+    PROTO_READER r;
+    PROTO_WRITER w;
+    size_t len = 0, off, out_len;
+    ssize_t nread, size = 0;
+    int count, i;
+    char report;
+
+    if (send_text(connect_fd, MSG_WELCOME, req_id, WELCOME_TEXT) < 0
+        || send_text(connect_fd, MSG_ACK, req_id, SESSION_TEXT) < 0) {
+        perror("full_write() error");
+        return;
+    }
+    if ((scans = malloc(MAX_SESSION_SCANS * sizeof(SCAN))) == NULL) {
+        perror("malloc() error");
+        return;
+    }
+
+    for (;;) {
+        //Avvia la verifica di tutte le tessere già ricevute per intero
+        for (count = 0, off = 0; count < MAX_SESSION_SCANS && (size = proto_parse_header(in + off, len - off, &h)) > 0 && size <= len - off; off += size, count++) {
+            //Un frame diverso da MSG_SCAN chiude la sessione dopo gli esiti delle tessere precedenti
+            if (h.type != MSG_SCAN) break;
+            proto_reader(&r, in + off + PROTO_HEADER_SIZE, h.length);
+            proto_get_ID(&r, scans[count].ID);
+            scans[count].req_id = h.req_id;
+            scans[count].notify = NULL;
+            scans[count].received = metric_start(&metrics, REQ_RECEIVE_ID);
+            verify_start(&scans[count]);
+        }
+
+        if (count == 0) {
+            if (size > 0 && size <= len) {
+                send_error(connect_fd, h.req_id, PROTO_ERR_TYPE);
+                break;
+            }
+            //Un frame non valido o più grande del buffer rende illeggibile il resto del flusso
+            if (size < 0 || size > sizeof(in)) break;
+            if ((nread = read(connect_fd, in + len, sizeof(in) - len)) < 0) {
+                if (errno == EINTR) continue;
+                break;
+            }
+            if (nread == 0) break; //L'AppVerifica ha chiuso la sessione
+            len += nread;
+            continue;
+        }
+
+        for (i = 0, out_len = 0; i < count; i++) {
+            report = verify_end(&scans[i]);
+            metric_end(&metrics, REQ_RECEIVE_ID, scans[i].received, report == '3');
+            proto_begin(&w, out + out_len, sizeof(out) - out_len, MSG_RESULT, scans[i].req_id);
+            proto_put_u8(&w, report);
+            proto_put_text(&w, scan_text(report));
+            out_len += proto_end(&w);
+        }
+        if (full_write(connect_fd, out, out_len) != 0) {
             perror("full_write() error");
-            exit(1);
+            break;
         }
+        len -= off;
+        memmove(in, in + off, len);
+    }
+    free(scans);
+}
+
+//Inoltra al ServerVaccinale il report ricevuto dall'ASL. Ritorna '0' se l'operazione è avvenuta, '1' se il numero di tessera è inesistente, '3' in caso di errore.
+char send_report(REPORT package) {
+    char report;
+    GP_REQUEST gp;
+    LOG_POSITION position;
+    unsigned long generation;
+    GP_KEY key;
+
+    package.ID[ID_SIZE - 1] = 0;
+    if ((key = id_key(package.ID)) == 0 || filter_absent(package.ID, key)) return '1';
+
+    /* La cache viene invalidata prima e dopo la modifica: una scansione concorrente che ha letto il report precedente
+       non può reinserirlo, quindi una sospensione non viene mai servita dalla cache */
+    cache_invalidate(key);
+
+    //La modifica viaggia sulle stesse connessioni persistenti usate per le scansioni, verso il primario dello shard
+    report = backend_call(MSG_REPORT_UPDATE, &package, NULL, &position, 0);
+
+    /* Una scansione che legge la generazione dopo l'invalidazione può ancora ricevere il GP precedente da una replica in ritardo:
+       la posizione del report, registrata prima dell'invalidazione, impedisce di metterlo in cache finché la replica non applica il report */
+    if (report == '0' && cache_size > 0) report_mark(package.ID, key, &position);
+    cache_invalidate(key);
+
+    //Le scansioni successive alla modifica non attendono una richiesta partita prima, che potrebbe riportare il report precedente
+    flight_remove(key, NULL);
+
+    /* Le scansioni sono servite dalle repliche, che ricevono la modifica con un certo ritardo: il GP aggiornato viene letto dal primario
+       e messo in cache, così le scansioni successive non devono attendere che le repliche applichino il report */
+    if (report == '0' && cache_size > 0 && shard_map.shards[shard_of(&shard_map, package.ID)].n_nodes > 1) {
+        generation = cache_generation(key);
+        if (backend_call(MSG_GP_LOOKUP, &package, &gp, &position, 0) == '1' && report_applied(package.ID, key, &position))
+            cache_insert(key, &gp, generation);
+    }
+    return report;
+}
+
+//Gestisce il MSG_REPORT_UPDATE inviato dall'ASL, già ricevuto in payload
+void receive_report(int connect_fd, unsigned int req_id, PROTO_READER *r) {
+    REPORT package;
+    char report;
+    const char *text;
+    long start = metric_start(&metrics, REQ_RECEIVE_REPORT);
+
+    //Legge i dati del pacchetto REPORT inviato dall'ASL
+    proto_get_ID(r, package.ID);
+    package.report = proto_get_u8(r);
+    if (r->error) {
+        printf("Dato non valido\n");
+        send_error(connect_fd, req_id, PROTO_ERR_MALFORMED);
+        metric_end(&metrics, REQ_RECEIVE_REPORT, start, 1);
+        return;
+    }
+
+    report = send_report(package);
+
+    if (report == '1') text = "Numero tessera inesistente";
+    else if (report == '3') text = "Servizio non disponibile, riprova";
+    else text = "*Operazione avvenuta*";
+    if (send_result(connect_fd, req_id, report, text) < 0) {
+        perror("full_write() error");
+        report = '3';
+    }
+    metric_end(&metrics, REQ_RECEIVE_REPORT, start, report == '3');
+}
+
+//Thread che gestisce la connessione di un client. Sostituisce il figlio della fork: così tutte le connessioni condividono il pool verso il ServerVaccinale
+void *client_thread(void *arg) {
+    int connect_fd = (int)(long)arg, enable = 1;
+    unsigned char payload[MAX_SIZE];
+    FRAME_HEADER h;
+    PROTO_READER r;
+
+    /*
+        Il primo frame ricevuto dal ServerVerifica indica il client.
+        MSG_REPORT_UPDATE arriva dall'ASL e contiene già il report, può essere seguito da altri report.
+        MSG_HELLO arriva dall'AppVerifica, che attende il benvenuto prima di inviare la tessera, oppure apre una sessione di più tessere.
+    */
+    if (proto_recv(connect_fd, &h, payload, sizeof(payload)) < 0) {
+        perror("full_read() error");
+        close(connect_fd);
+        return NULL;
+    }
+
+    //Con più richieste sulla stessa connessione l'ack ed il risultato non devono attendere l'algoritmo di Nagle
+    setsockopt(connect_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+    proto_reader(&r, payload, h.length);
+    if (h.version < PROTO_MIN_VERSION) {
+        printf("Versione del protocollo non supportata\n");
+        send_error(connect_fd, h.req_id, PROTO_ERR_VERSION);
+    } else if (h.type == MSG_REPORT_UPDATE) {
+        //Riceve informazioni dall'ASL, che in modalità batch invia più report sulla stessa connessione
+        do {
+            proto_reader(&r, payload, h.length);
+            receive_report(connect_fd, h.req_id, &r);
+        } while (proto_recv(connect_fd, &h, payload, sizeof(payload)) == 0 && h.type == MSG_REPORT_UPDATE);
+    } else if (h.type == MSG_HELLO && proto_get_u8(&r) == ROLE_APP_VERIFICA) {
+        //Riceve informazioni dall'AppVerifica. Il MSG_HELLO delle versioni precedenti non contiene la modalità
+        if (proto_get_u8(&r) == HELLO_SESSION) scan_session(connect_fd, h.req_id);
+        else receive_ID(connect_fd, h.req_id);
+    }    else {
+        printf("Client non riconosciuto\n");
+        send_error(connect_fd, h.req_id, PROTO_ERR_TYPE);
     }
 
     close(connect_fd);
+    return NULL;
 }
 
-char send_report(REPORT package) {
-    int socket_fd;
-    struct sockaddr_in server_addr;
-    char start_bit, buf[MAX_SIZE], report;
+//Avvia il thread che gestisce la connessione connect_fd
+void client_spawn(int connect_fd) {
+    pthread_t tid;
 
-    start_bit = '0';
+    if (pthread_create(&tid, NULL, client_thread, (void *)(long)connect_fd) != 0) {
+        perror("pthread_create() error");
+        close(connect_fd);
+        return;
+    }
+    pthread_detach(tid);
+}
 
-    //Creazione del descrittore del socket
-    if ((socket_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-        perror("socket() error");
-        exit(1);
+//Ritorna 1 se i byte ricevuti contengono per intero il MSG_HELLO di un'AppVerifica, che può essere gestita dal ciclo di eventi
+int hello_app(const unsigned char *data, size_t len) {
+    FRAME_HEADER h;
+    ssize_t size = proto_parse_header(data, len, &h);
+
+    return size > PROTO_HEADER_SIZE && (size_t)size <= len && h.type == MSG_HELLO && h.version >= PROTO_MIN_VERSION
+           && data[PROTO_HEADER_SIZE] == ROLE_APP_VERIFICA;
+}
+
+//Completamento di una verifica avviata da un ciclo di eventi: viene accodata al ciclo, che la riprende nel proprio thread
+void loop_scan_done(SCAN *scan) {
+    LOOP *loop = ((CLIENT *)scan->arg)->loop;
+    unsigned long one = 1;
+    int wake;
+
+    pthread_mutex_lock(&loop->lock);
+    wake = (loop->done == NULL);
+    scan->next_done = loop->done;
+    loop->done = scan;
+    pthread_mutex_unlock(&loop->lock);
+
+    //Il ciclo viene risvegliato solo dalla prima verifica completata, le successive vengono riprese insieme
+    if (wake && write(loop->event_fd, &one, sizeof(one)) < 0) perror("write() error");
+}
+
+//Errore sul socket: gli esiti non vengono più inviati e la connessione viene chiusa appena le verifiche in corso sono terminate
+void client_fail(CLIENT *client) {
+    client->failed = 1;
+    client->closing = 1;
+    client->out_off = client->out_len = 0;
+    if (client->reading) shutdown(client->fd, SHUT_RDWR); //La lettura in corso termina subito
+}
+
+//Prende dal pool il buffer di invio, se la connessione non lo ha già. Ritorna -1 se la memoria è esaurita.
+int client_out(CLIENT *client) {
+    if (client->out == NULL && (client->out = pool_alloc(&client->loop->pool, &client->loop->cache, CLIENT_OUT)) == NULL) {
+        perror("malloc() error");
+        return -1;
     }
+    return 0;
+}
 
-    //Valorizzazione struttura
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(1025);
+//Sposta i byte ricevuti nel buffer di CLIENT_IN byte. Va chiamata senza letture in corso. Ritorna -1 se la memoria è esaurita.
+int client_grow(CLIENT *client) {
+    LOOP *loop = client->loop;
+    unsigned char *in;
 
-    //Conversione dell'indirizzo IP dal formato dotted decimal a stringa di bit
-    if (inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr) <= 0) {
-        perror("inet_pton() error");
-        exit(1);
+    if ((in = pool_alloc(&loop->pool, &loop->cache, CLIENT_IN)) == NULL) {
+        perror("malloc() error");
+        return -1;
     }
+    memcpy(in, client->in, client->in_len);
+    pool_free(&loop->pool, &loop->cache, client->in, client->in_size);
+    client->in = in;
+    client->in_size = CLIENT_IN;
+    return 0;
+}
 
-    //Effettua connessione con il server
-    if (connect(socket_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        perror("connect() error");
-        exit(1);
+//Accoda al buffer di invio un frame con un testo. Ritorna -1 se il buffer non ha abbastanza spazio.
+int client_text(CLIENT *client, unsigned char type, unsigned int req_id, const char *text) {
+    PROTO_WRITER w;
+
+    if (client_out(client) < 0) return -1;
+    proto_begin(&w, client->out + client->out_len, CLIENT_OUT - client->out_len, type, req_id);
+    proto_put_text(&w, text);
+    if (proto_end(&w) < 0) return -1;
+    client->out_len += w.len;
+    return 0;
+}
+
+/* Avvia la verifica delle tessere ricevute per intero, finché la connessione ha posto per altre verifiche. Il primo frame è il MSG_HELLO,
+   a cui risponde il benvenuto (ed in una sessione l'ack della sessione). Un frame diverso da MSG_SCAN chiude la connessione dopo gli esiti
+   delle tessere precedenti, come in receive_ID e scan_session. */
+void client_parse(CLIENT *client) {
+    FRAME_HEADER h;
+    PROTO_READER r;
+    SCAN *scan;
+    ssize_t size;
+    size_t off = 0, need = 0;
+
+    while (!client->closing && client->state != CLIENT_PEEK && client->scans < MAX_SESSION_SCANS) {
+        if ((size = proto_parse_header(client->in + off, client->in_len - off, &h)) < 0 || size > CLIENT_IN) {
+            client->closing = 1; //Un frame non valido o più grande del buffer rende illeggibile il resto del flusso
+            break;
+        }
+        if (size == 0 || (size_t)size > client->in_len - off) {
+            need = size;
+            break;
+        }
+        proto_reader(&r, client->in + off + PROTO_HEADER_SIZE, h.length);
+
+        if (client->state == CLIENT_HELLO) {
+            //Il ruolo è già stato controllato da hello_app. Il MSG_HELLO delle versioni precedenti non contiene la modalità
+            proto_get_u8(&r);
+            client->state = proto_get_u8(&r) == HELLO_SESSION ? CLIENT_SESSION : CLIENT_SINGLE;
+            client_text(client, MSG_WELCOME, h.req_id, WELCOME_TEXT);
+            if (client->state == CLIENT_SESSION) client_text(client, MSG_ACK, h.req_id, SESSION_TEXT);
+            off += size;
+            continue;
+        }
+        if (h.type != MSG_SCAN) {
+            client->closing = 1;
+            client->reject = 1;
+            client->reject_req = h.req_id;
+            break;
+        }
+        if ((scan = pool_alloc(&client->loop->pool, &client->loop->cache, sizeof(SCAN))) == NULL) {
+            perror("malloc() error");
+            client_fail(client);
+            break;
+        }
+        proto_get_ID(&r, scan->ID);
+        scan->req_id = h.req_id;
+        scan->notify = loop_scan_done;
+        scan->arg = client;
+        scan->next = NULL;
+        scan->received = metric_start(&metrics, REQ_RECEIVE_ID);
+        if (client->tail == NULL) client->head = scan;
+        else client->tail->next = scan;
+        client->tail = scan;
+        client->scans++;
+        verify_start(scan);
+        off += size;
     }
+    client->in_len -= off;
+    memmove(client->in, client->in + off, client->in_len);
 
-    //Invia un bit di valore 0 al ServerVaccinale per informarlo che deve comunicare con il ServerVaccinale
-    if (full_write(socket_fd, &start_bit, sizeof(char)) < 0) {
-        perror("full_write() error");
-        exit(1);
+    //Un frame che non entra nel buffer iniziale viene ricevuto nel buffer di CLIENT_IN byte
+    if (need > client->in_size && !client->reading && !client->failed && client_grow(client) < 0) client_fail(client);
+}
+
+/* Primo frame letto senza consumarlo: ritorna 1 se è il MSG_HELLO di un'AppVerifica, che resta al ciclo. Una sessione passa subito al buffer
+   di CLIENT_IN byte, così la prima lettura riceve per intero le tessere inviate insieme al MSG_HELLO. */
+int client_hello(CLIENT *client, size_t len) {
+    FRAME_HEADER h;
+
+    if (!hello_app(client->in, len)) return 0;
+    client->state = CLIENT_HELLO;
+    proto_parse_header(client->in, len, &h);
+    if (h.length >= 2 && client->in[PROTO_HEADER_SIZE + 1] == HELLO_SESSION && client_grow(client) < 0) client_fail(client);
+    return 1;
+}
+
+//Accoda al buffer di invio gli esiti delle verifiche completate, nell'ordine di arrivo delle tessere, finché il buffer ha spazio
+void client_flush(CLIENT *client) {
+    SCAN *scan;
+    PROTO_WRITER w;
+    size_t len;
+    char report;
+
+    //Senza scritture in corso i byte già inviati vengono eliminati dal buffer, che torna al pool quando è vuoto
+    if (!client->writing && client->out_off > 0) {
+        client->out_len -= client->out_off;
+        memmove(client->out, client->out + client->out_off, client->out_len);
+        client->out_off = 0;
+    }
+    if (!client->writing && client->out_len == 0 && client->out != NULL) {
+        pool_free(&client->loop->pool, &client->loop->cache, client->out, CLIENT_OUT);
+        client->out = NULL;
     }
 
-    //Invia un bit di valore 0 al ServerVaccinale per informarlo che deve modificare il report del green pass
-    if (full_write(socket_fd, &start_bit, sizeof(char)) < 0) {
-        perror("full_write() error");
-        exit(1);
+    while ((scan = client->head) != NULL && !scan->waiting) {
+        if (!client->failed && client_out(client) < 0) client_fail(client);
+        report = '3'; //L'esito di una connessione fallita non viene inviato
+        if (!client->failed) {
+            report = verify_result(scan);
+            len = client->out_len;
+            if (client->state == CLIENT_SINGLE && client_text(client, MSG_ACK, scan->req_id, ACK_TEXT) < 0) break;
+            proto_begin(&w, client->out + client->out_len, CLIENT_OUT - client->out_len, MSG_RESULT, scan->req_id);
+            proto_put_u8(&w, report);
+            proto_put_text(&w, scan_text(report));
+            if (proto_end(&w) < 0) {
+                client->out_len = len;
+                break;
+            }
+            client->out_len += w.len;
+        }
+        metric_end(&metrics, REQ_RECEIVE_ID, scan->received, report == '3');
+        client->head = scan->next;
+        if (client->head == NULL) client->tail = NULL;
+        client->scans--;
+        pool_free(&client->loop->pool, &client->loop->cache, scan, sizeof(SCAN));
     }
 
-    //Invia il pacchetto appena ricevuto dall'ASL al ServerVaccinale
-    if (full_write(socket_fd, &package, sizeof(REPORT)) < 0) {
-        perror("full_write() error");
-        exit(1);
+    if (client->head == NULL && client->reject && !client->failed && client_out(client) == 0) {
+        proto_begin(&w, client->out + client->out_len, CLIENT_OUT - client->out_len, MSG_ERROR, client->reject_req);
+        proto_put_u8(&w, PROTO_ERR_TYPE);
+        proto_put_u8(&w, PROTO_VERSION);
+        if (proto_end(&w) >= 0) {
+            client->out_len += w.len;
+            client->reject = 0;
+        }
     }
+}
 
-    //Riceve il report dal ServerVerifica
-    if (full_read(socket_fd, &report, sizeof(report)) < 0) {
-        perror("full_read() error");
-        exit(1);
+//Ritorna 1 se la connessione può leggere altri frame
+int client_can_read(CLIENT *client) {
+    return !client->closing && client->scans < MAX_SESSION_SCANS && client->in_len < client->in_size;
+}
+
+//Ritorna 1 se la connessione può essere chiusa: nessuna operazione sul socket o verifica in corso e tutti gli esiti inviati
+int client_finished(CLIENT *client) {
+    return !client->reading && !client->writing && client->head == NULL
+           && (client->failed || (client->closing && !client->reject && client->out_off == client->out_len));
+}
+
+/* Nuova connessione accettata dal ciclo. Ritorna NULL se il ciclo ha già max_clients connessioni, che viene gestita da un thread,
+   oppure se la memoria è esaurita e la connessione viene chiusa. */
+CLIENT *client_open(LOOP *loop, int fd) {
+    CLIENT *client;
+
+    if (loop->clients >= max_clients) {
+        if (loop->mode == IO_EPOLL) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        client_spawn(fd);
+        return NULL;
     }
+    if ((client = pool_alloc(&loop->pool, &loop->cache, sizeof(CLIENT))) == NULL
+        || (client->in = pool_alloc(&loop->pool, &loop->cache, CLIENT_IN_SINGLE)) == NULL) {
+        perror("malloc() error");
+        pool_free(&loop->pool, &loop->cache, client, sizeof(CLIENT));
+        close(fd);
+        return NULL;
+    }
+    __atomic_store_n(&loop->clients, loop->clients + 1, __ATOMIC_RELAXED);
+    client->fd = fd;
+    client->state = CLIENT_PEEK;
+    client->reading = client->writing = client->readable = client->writable = 0;
+    client->closing = client->failed = client->reject = 0;
+    client->out = NULL;
+    client->in_size = CLIENT_IN_SINGLE;
+    client->in_len = client->out_off = client->out_len = 0;
+    client->head = client->tail = NULL;
+    client->scans = 0;
+    client->loop = loop;
+    client->next_dirty = NULL;
+    return client;
+}
+
+/* Libera i buffer della connessione, il cui socket è già stato chiuso o ceduto ad un thread. La connessione viene liberata da loop_reclaim
+   alla fine del giro: gli eventi epoll dello stesso giro la riconoscono come chiusa da fd uguale a -1. */
+void client_release(LOOP *loop, CLIENT *client) {
+    pool_free(&loop->pool, &loop->cache, client->in, client->in_size);
+    pool_free(&loop->pool, &loop->cache, client->out, CLIENT_OUT);
+    client->fd = -1;
+    client->next = loop->released;
+    loop->released = client;
+    __atomic_store_n(&loop->clients, loop->clients - 1, __ATOMIC_RELAXED);
+}
 
-    close(socket_fd);
+//Restituisce al pool le connessioni chiuse durante il giro del ciclo
+void loop_reclaim(LOOP *loop) {
+    CLIENT *client;
 
-    return report;
+    while ((client = loop->released) != NULL) {
+        loop->released = client->next;
+        pool_free(&loop->pool, &loop->cache, client, sizeof(CLIENT));
+    }
 }
 
-void receive_report(int connect_fd) {
-    REPORT package;
-    char report, buf[MAX_SIZE];
+//Cede la connessione ad un thread: il primo frame non è il MSG_HELLO di un'AppVerifica (ad esempio un report dell'ASL) oppure non è arrivato per intero
+void client_handoff(LOOP *loop, CLIENT *client) {
+    if (loop->mode == IO_EPOLL) {
+        epoll_ctl(loop->poll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+        fcntl(client->fd, F_SETFL, fcntl(client->fd, F_GETFL) & ~O_NONBLOCK);
+    }
+    client_spawn(client->fd);
+    client_release(loop, client);
+}
+
+/* Crea l'anello di io_uring del ciclo. Con i kernel che lo supportano l'anello ha un solo thread che invia le richieste ed i completamenti
+   vengono elaborati solo quando il ciclo li attende. Ritorna -1 se io_uring non è disponibile. */
+int ring_init(RING *ring, unsigned cq_entries) {
+    struct io_uring_params p;
+    size_t sq_size, cq_size;
+    unsigned char *sq, *cq;
+    unsigned i;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = cq_entries;
+    if ((ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p)) < 0 && errno == EINVAL) {
+        //I kernel precedenti al 6.1 non conoscono SINGLE_ISSUER e DEFER_TASKRUN
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+        p.cq_entries = cq_entries;
+        ring->fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    }
+    if (ring->fd < 0) return -1;
 
+    //Senza FAST_POLL (kernel 5.7) le letture sui socket verrebbero eseguite da thread del kernel: epoll è più efficiente
+    if (!(p.features & IORING_FEAT_FAST_POLL) || !(p.features & IORING_FEAT_NODROP)) {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
 
-    //Legge i dati del pacchetto REPORT inviato dall'ASL
-    if (full_read(connect_fd, &package, sizeof(REPORT)) < 0) {
-        perror("full_read() error");
-        exit(1);
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cq_size > sq_size) sq_size = cq_size;
+    if ((sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING)) == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) cq = sq;
+    else if ((cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+    ring->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
     }
 
-    report = send_report(package);
+    ring->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring->sq_entries = p.sq_entries;
+    ring->tail = *ring->sq_tail;
+    ring->queued = 0;
+    ring->multishot = 1;
+
+    //L'SQE i occupa sempre la posizione i dell'anello
+    for (i = 0; i < p.sq_entries; i++) ring->sq_array[i] = i;
+    return 0;
+}
 
-    if (report == '1') {
-        strcpy(buf, "Numero tessera inesistente");
-        if(full_write(connect_fd, buf, ASL_ACK) < 0) {
-            perror("full_write() error");
+/* Pubblica al kernel gli SQE preparati e, se wait è 1, attende almeno un completamento. Una sola system call invia tutte le operazioni
+   preparate durante l'ultimo giro del ciclo e riceve i nuovi completamenti. */
+void ring_enter(RING *ring, int wait) {
+    int ret;
+
+    __atomic_store_n(ring->sq_tail, ring->tail, __ATOMIC_RELEASE);
+    do {
+        ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret < 0 && errno != EINTR) {
+            perror("io_uring_enter() error");
             exit(1);
         }
-    } else {
-        strcpy(buf, "*Operazione avvenuta*");
-        if(full_write(connect_fd, buf, ASL_ACK) < 0) {
-            perror("full_write() error");
+    } while (ret < 0);
+    ring->queued -= ret;
+}
+
+//Ritorna un SQE azzerato, garantendo che ne restino liberi almeno free compreso quello ritornato (per le operazioni collegate)
+struct io_uring_sqe *ring_sqe(RING *ring, unsigned free) {
+    struct io_uring_sqe *sqe;
+
+    if (ring->sq_entries - (ring->tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) < free) ring_enter(ring, 0);
+    sqe = &ring->sqes[ring->tail & *ring->sq_mask];
+    ring->tail++;
+    ring->queued++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+//Prepara un'operazione di io_uring su fd
+struct io_uring_sqe *ring_prep(RING *ring, unsigned free, int opcode, int fd, void *buf, unsigned len, unsigned long user_data) {
+    struct io_uring_sqe *sqe = ring_sqe(ring, free);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+//Accetta le nuove connessioni: l'accept multishot produce un completamento per ogni connessione senza essere ripetuto
+void uring_accept(LOOP *loop) {
+    struct io_uring_sqe *sqe = ring_prep(&loop->ring, 1, IORING_OP_ACCEPT, loop->listen_fd, NULL, 0, OP_ACCEPT);
+
+    if (loop->ring.multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+//Ripete l'accept dopo ACCEPT_RETRY_MS millisecondi, quando un errore come descrittori o memoria esauriti lo ha interrotto
+void uring_retry(LOOP *loop) {
+    loop->retry.tv_sec = 0;
+    loop->retry.tv_nsec = ACCEPT_RETRY_MS * 1000000L;
+    ring_prep(&loop->ring, 1, IORING_OP_TIMEOUT, -1, &loop->retry, 1, OP_RETRY);
+}
+
+//Attende sull'eventfd le verifiche completate dai thread del ServerVaccinale
+void uring_event(LOOP *loop) {
+    ring_prep(&loop->ring, 1, IORING_OP_READ, loop->event_fd, &loop->event, sizeof(loop->event), OP_EVENT);
+}
+
+/* Avvia le operazioni necessarie alla connessione: l'invio degli esiti accodati e la lettura di altri frame. Se servono entrambe la lettura
+   è collegata alla scrittura (IOSQE_IO_LINK) e parte quando gli esiti sono stati inviati, con un solo invio al kernel.
+   Se la scrittura è parziale la lettura collegata viene annullata e ripetuta dopo il resto della scrittura. */
+void uring_arm(LOOP *loop, CLIENT *client) {
+    RING *ring = &loop->ring;
+    struct io_uring_sqe *write = NULL;
+
+    if (!client->writing && client->out_off < client->out_len) {
+        write = ring_prep(ring, 2, ring->fixed && pool_in_arena(&loop->pool, client->out) ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, client->fd, client->out + client->out_off,
+                          client->out_len - client->out_off, (unsigned long)client | OP_WRITE);
+        client->writing = 1;
+    }
+    if (!client->reading && client_can_read(client)) {
+        if (write != NULL) write->flags |= IOSQE_IO_LINK;
+        ring_prep(ring, 1, ring->fixed && pool_in_arena(&loop->pool, client->in) ? IORING_OP_READ_FIXED : IORING_OP_READ, client->fd,
+                  client->in + client->in_len, client->in_size - client->in_len, (unsigned long)client | OP_READ);
+        client->reading = 1;
+    }
+    if (client_finished(client)) {
+        ring_prep(ring, 1, IORING_OP_CLOSE, client->fd, NULL, 0, OP_CLOSE);
+        client_release(loop, client);
+    }
+}
+
+/* epoll: legge e scrive finché il socket lo permette senza bloccare. Con le notifiche edge-triggered il socket viene letto o scritto
+   fino ad EAGAIN, oppure finché la connessione non ha più spazio: in quel caso readable resta ad 1 e la lettura riprende dopo gli esiti. */
+void epoll_io(LOOP *loop, CLIENT *client) {
+    ssize_t n;
+    int progress;
+
+    if (client->state == CLIENT_PEEK) {
+        if (!client->readable) return;
+        while ((n = recv(client->fd, client->in, client->in_size, MSG_PEEK)) < 0 && errno == EINTR);
+        if (n < 0 && errno == EAGAIN) {
+            client->readable = 0;
+            return;
+        }
+        if (n <= 0 || !client_hello(client, n)) {
+            if (n > 0) client_handoff(loop, client);
+            else {
+                close(client->fd);
+                client_release(loop, client);
+            }
+            return;
+        }
+    }
+
+    do {
+        progress = 0;
+        client_parse(client);
+        client_flush(client);
+        if (client->writable && client->out_off < client->out_len) {
+            if ((n = write(client->fd, client->out + client->out_off, client->out_len - client->out_off)) > 0) {
+                client->out_off += n;
+                progress = 1;
+            } else if (n < 0 && errno == EAGAIN) client->writable = 0;
+            else if (n < 0 && errno == EINTR) progress = 1;
+            else {
+                perror("write() error");
+                client_fail(client);
+            }
+        }
+        if (client->readable && client_can_read(client)) {
+            if ((n = read(client->fd, client->in + client->in_len, client->in_size - client->in_len)) > 0) client->in_len += n;
+            else if (n == 0) client->closing = 1;
+            else if (errno == EAGAIN) client->readable = 0;
+            else if (errno != EINTR) client_fail(client);
+            if (n >= 0 || errno == EINTR) progress = 1;
+        }
+    } while (progress);
+
+    if (client_finished(client)) {
+        close(client->fd);
+        client_release(loop, client);
+    }
+}
+
+//Aggiorna una connessione dopo un evento: avvia le verifiche dei frame ricevuti, accoda gli esiti completati ed avvia le operazioni sul socket
+void client_update(LOOP *loop, CLIENT *client) {
+    if (loop->mode == IO_EPOLL) {
+        epoll_io(loop, client);
+        return;
+    }
+    client_parse(client);
+    client_flush(client);
+    uring_arm(loop, client);
+}
+
+/* Riprende le verifiche completate dai thread del ServerVaccinale. Una verifica che deve essere ripetuta sul primario resta in attesa,
+   le connessioni con verifiche completate vengono aggiornate una sola volta, così gli esiti partono con un'unica scrittura. */
+void loop_resume(LOOP *loop) {
+    SCAN *scan, *next;
+    CLIENT *client, *dirty = NULL;
+
+    pthread_mutex_lock(&loop->lock);
+    scan = loop->done;
+    loop->done = NULL;
+    pthread_mutex_unlock(&loop->lock);
+
+    for (; scan != NULL; scan = next) {
+        next = scan->next_done;
+        if (verify_continue(scan)) continue;
+        client = scan->arg;
+        if (client->next_dirty == NULL) {
+            client->next_dirty = dirty == NULL ? client : dirty; //L'ultima connessione della lista punta a sé stessa
+            dirty = client;
+        }
+    }
+    while ((client = dirty) != NULL) {
+        dirty = client->next_dirty == client ? NULL : client->next_dirty;
+        client->next_dirty = NULL;
+        client_update(loop, client);
+    }
+}
+
+//Elabora un completamento di io_uring
+void uring_complete(LOOP *loop, unsigned long data, int res, unsigned int flags) {
+    CLIENT *client = (CLIENT *)(data & ~(unsigned long)OP_MASK);
+
+    switch (data & OP_MASK) {
+    case OP_ACCEPT:
+        if (res >= 0) {
+            if ((client = client_open(loop, res)) != NULL) {
+                //Il primo frame viene letto senza consumarlo: se non è di un'AppVerifica la connessione passa ad un thread
+                ring_prep(&loop->ring, 1, IORING_OP_RECV, client->fd, client->in, client->in_size, (unsigned long)client | OP_PEEK)->msg_flags = MSG_PEEK;
+            }
+        } else if (res == -EINVAL && loop->ring.multishot) loop->ring.multishot = 0; //Kernel precedente al 5.19
+        else if (res != -EINTR && res != -ECONNABORTED && res != -EAGAIN) {
+            //Un errore come descrittori o memoria esauriti è temporaneo: il server resta attivo e l'accept riparte dopo un'attesa
+            errno = -res;
+            perror("accept() error");
+            if (!(flags & IORING_CQE_F_MORE)) uring_retry(loop);
+            break;
+        }
+        if (!(flags & IORING_CQE_F_MORE)) uring_accept(loop);
+        break;
+    case OP_RETRY:
+        uring_accept(loop);
+        break;
+    case OP_EVENT:
+        loop_resume(loop);
+        uring_event(loop);
+        break;
+    case OP_CLOSE:
+        break;
+    case OP_PEEK:
+        if (res > 0 && client_hello(client, res)) client_update(loop, client); else if (res > 0) client_handoff(loop, client);
+        else {
+            ring_prep(&loop->ring, 1, IORING_OP_CLOSE, client->fd, NULL, 0, OP_CLOSE);
+            client_release(loop, client);
+        }
+        break;
+    case OP_READ:
+        client->reading = 0;
+        if (res > 0) client->in_len += res;
+        else if (res == 0) client->closing = 1;
+        else if (res != -ECANCELED && res != -EINTR && res != -EAGAIN) client_fail(client);
+        client_update(loop, client);
+        break;
+    case OP_WRITE:
+        client->writing = 0;
+        if (res > 0) {
+            if (!client->failed) client->out_off += res;
+        } else if (res != -EINTR && res != -EAGAIN && !client->failed) {
+            errno = res < 0 ? -res : EPIPE;
+            perror("write() error");
+            client_fail(client);
+        }
+        client_update(loop, client);
+        break;
+    }
+}
+
+/* Ciclo di eventi su io_uring: ogni giro invia al kernel tutte le operazioni preparate ed attende i completamenti con una sola system call.
+   L'area da cui il pool ricava i primi buffer è registrata una volta sola, così il kernel non li mappa ad ogni lettura e scrittura. */
+int uring_loop(LOOP *loop) {
+    RING *ring = &loop->ring;
+    struct io_uring_cqe *cqe;
+    struct iovec iov;
+    unsigned head;
+
+    if (ring_init(ring, 4 * max_clients + 64) < 0) return -1;
+    iov.iov_base = loop->arena;
+    iov.iov_len = LOOP_ARENA;
+    ring->fixed = (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0);
+    if ((loop->event_fd = eventfd(0, 0)) < 0) {
+        perror("eventfd() error");
+        exit(1);
+    }
+    printf("Ciclo di eventi %d: io_uring%s\n", loop->id, ring->fixed ? ", buffer registrati" : "");
+
+    uring_accept(loop);
+    uring_event(loop);
+    for (;;) {
+        ring_enter(ring, 1);
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+            head++;
+            //Il completamento viene copiato prima di liberarne la posizione, così l'elaborazione può inviare altre operazioni
+            __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+            uring_complete(loop, cqe->user_data, cqe->res, cqe->flags);
+        }
+        loop_reclaim(loop);
+    }
+}
+
+//Ciclo di eventi su epoll, usato quando io_uring non è disponibile
+void epoll_loop(LOOP *loop) {
+    struct epoll_event events[64], ev;
+    struct itimerspec retry = {{0, 0}, {0, ACCEPT_RETRY_MS * 1000000L}};
+    CLIENT *client;
+    unsigned long data, expirations;
+    int n, i, fd;
+
+    if ((loop->poll_fd = epoll_create1(0)) < 0 || (loop->event_fd = eventfd(0, EFD_NONBLOCK)) < 0 ||
+        (loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) < 0) {
+        perror("epoll_create1() error");
+        exit(1);
+    }
+    fcntl(loop->listen_fd, F_SETFL, fcntl(loop->listen_fd, F_GETFL) | O_NONBLOCK);
+    ev.events = EPOLLIN;
+    ev.data.u64 = OP_ACCEPT;
+    epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, loop->listen_fd, &ev);
+    ev.data.u64 = OP_EVENT;
+    epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, loop->event_fd, &ev);
+    ev.data.u64 = OP_RETRY;
+    epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, loop->timer_fd, &ev);
+    printf("Ciclo di eventi %d: epoll\n", loop->id);
+
+    for (;;) {
+        if ((n = epoll_wait(loop->poll_fd, events, 64, -1)) < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait() error");
             exit(1);
         }
+        for (i = 0; i < n; i++) {
+            data = events[i].data.u64;
+            client = (CLIENT *)(data & ~(unsigned long)OP_MASK);
+            if (data == OP_ACCEPT) {
+                while ((fd = accept4(loop->listen_fd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                    if ((client = client_open(loop, fd)) == NULL) continue;
+                    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                    ev.data.u64 = (unsigned long)client | OP_READ;
+                    epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, fd, &ev);
+                }
+                /* Un errore come descrittori o memoria esauriti è temporaneo: il socket in ascolto, che segnalerebbe subito di nuovo
+                   le connessioni in coda, viene disattivato e riattivato dal timer dopo ACCEPT_RETRY_MS millisecondi */
+                if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED) {
+                    perror("accept() error");
+                    ev.events = 0;
+                    ev.data.u64 = OP_ACCEPT;
+                    epoll_ctl(loop->poll_fd, EPOLL_CTL_MOD, loop->listen_fd, &ev);
+                    timerfd_settime(loop->timer_fd, 0, &retry, NULL);
+                }
+            } else if (data == OP_RETRY) {
+                if (read(loop->timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    ev.events = EPOLLIN;
+                    ev.data.u64 = OP_ACCEPT;
+                    epoll_ctl(loop->poll_fd, EPOLL_CTL_MOD, loop->listen_fd, &ev);
+                }
+            } else if (data == OP_EVENT) {
+                if (read(loop->event_fd, &loop->event, sizeof(loop->event)) > 0) loop_resume(loop);
+            } else if (client->fd >= 0) {
+                //Una connessione chiusa durante lo stesso giro non riceve più eventi
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) client->readable = 1;
+                if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) client->writable = 1;
+                epoll_io(loop, client);
+            }
+        }
+        loop_reclaim(loop);
     }
 }
 
-int main() {
-    int listen_fd, connect_fd;
+//Thread di un ciclo di eventi: usa io_uring se disponibile, altrimenti epoll
+void *loop_thread(void *arg) {
+    LOOP *loop = arg;
+
+    pthread_mutex_init(&loop->lock, NULL);
+
+    if (loop->mode == IO_URING && uring_loop(loop) < 0) {
+        if (loop->id == 0) printf("io_uring non disponibile (%s), uso epoll\n", strerror(errno));
+        loop->mode = IO_EPOLL;
+    }
+    epoll_loop(loop);
+    return NULL;
+}
+
+//Crea il socket in ascolto sulla porta del ServerVerifica. Ogni ciclo di eventi ha il proprio, il kernel distribuisce le connessioni (SO_REUSEPORT)
+int listen_socket() {
     struct sockaddr_in serv_addr;
-    pid_t pid;
-    char start_bit;
+    int listen_fd, enable = 1;
 
-    signal(SIGINT,handler); //Cattura il segnale CTRL-C
     //Creazione descrizione del socket
     if ((listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
         perror("socket() error");
         exit(1);
     }
 
+    //Permette di riavviare il server senza attendere il TIME_WAIT delle connessioni precedenti
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+        perror("setsockopt() error");
+        exit(1);
+    }
+
+    //Le connessioni accettate ereditano TCP_NODELAY: gli esiti non devono attendere l'algoritmo di Nagle
+    setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
     //Valorizzazione strutture
     serv_addr.sin_family = AF_INET;
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -351,42 +2241,191 @@ int main() {
         perror("listen() error");
         exit(1);
     }
+    return listen_fd;
+}
 
-    for (;;) {
-    printf("In attesa di Green Pass\n");
+int main(int argc, char **argv) {
+    int listen_fd, connect_fd, opt, i, j, admin_port = ADMIN_PORT;
+    const char *routing = NULL;
+    pthread_t tid;
+    time_t next_midnight;
+    struct rlimit limit;
+    LOOP *loop_list;
+
+    signal(SIGINT,handler); //Cattura il segnale CTRL-C
+    signal(SIGPIPE, SIG_IGN); //Un client che chiude la connessione durante una write non deve terminare l'intero server
+
+    while ((opt = getopt(argc, argv, "c:b:t:m:l:i:r:f:I:w:C:a:")) != -1) {
+        switch (opt) {
+        case 'r':
+            routing = optarg;
+            break;
+        case 'c':
+            n_backends = atoi(optarg);
+            break;
+        case 'b':
+            max_batch = atoi(optarg);
+            break;
+        case 't':
+            max_wait = atoi(optarg);
+            break;
+        case 'm':
+            cache_size = atoi(optarg);
+            break;
+        case 'l':
+            cache_ttl = atoi(optarg);
+            break;
+        case 'i':
+            stats_interval = atoi(optarg);
+            break;
+        case 'f':
+            filter_size = atol(optarg);
+            break;
+        case 'I':
+            if (strcmp(optarg, "thread") == 0) io_mode = IO_THREAD;
+            else if (strcmp(optarg, "epoll") == 0) io_mode = IO_EPOLL;
+            else io_mode = IO_URING;
+            break;
+        case 'w':
+            n_loops = atoi(optarg);
+            break;
+        case 'C':
+            max_clients = atoi(optarg);
+            break;
+        case 'a':
+            admin_port = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-c connessioni verso il ServerVaccinale] [-b verifiche per blocco] [-t microsecondi di attesa per blocco]"
+                    " [-m GP nella cache] [-l secondi di validità nella cache] [-i secondi tra le statistiche] [-f tessere previste nel filtro, 0 per disattivarlo]"
+                    " [-r file di instradamento, predefinito " SHARD_CONFIG "] [-I uring|epoll|thread gestione delle connessioni]"
+                    " [-w cicli di eventi] [-C connessioni per ciclo di eventi] [-a porta delle metriche, 0 per disattivarle]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (n_backends < 1) n_backends = 1;
+    if (n_backends > MAX_BACKEND) n_backends = MAX_BACKEND;
+    if (max_batch < 1) max_batch = 1;
+    if (max_batch > MAX_BATCH) max_batch = MAX_BATCH;
+    if (cache_size < 0) cache_size = 0;
+    if (filter_size < 0) filter_size = 0;
+    if (n_loops < 1) n_loops = 1;
+    if (max_clients < 1) max_clients = 1;
+
+    //Ogni connessione di un'AppVerifica occupa un descrittore: il limite viene alzato al massimo consentito
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
+    if (shard_map_load(&shard_map, routing) < 0) exit(1);
+    printf("Tessere suddivise tra %d shard del ServerVaccinale\n", shard_map.n_shards);
 
-        //Accetta una nuova connessione
-        if ((connect_fd = accept(listen_fd, (struct sockaddr *)NULL, NULL)) < 0) {
-            perror("accept() error");
+    //Le connessioni verso il ServerVaccinale vengono aperte alla prima richiesta e restano aperte
+    for (i = 0; i < shard_map.n_shards; i++) {
+        if ((shard_backends[i] = calloc(shard_map.shards[i].n_nodes * n_backends, sizeof(BACKEND))) == NULL) {
+            perror("calloc() error");
             exit(1);
         }
+        for (j = 0; j < shard_map.shards[i].n_nodes * n_backends; j++) {
+            shard_backends[i][j].node = &shard_map.shards[i].nodes[j / n_backends];
+            shard_backends[i][j].fd = -1;
+            pthread_mutex_init(&shard_backends[i][j].lock, NULL);
+            pthread_mutex_init(&shard_backends[i][j].write_lock, NULL);
+        }
+    }
 
-        //Creazione del figlio;
-        if ((pid = fork()) < 0) {
-            perror("fork() error");
+    //Il giorno corrente è valorizzato prima di accettare connessioni, il thread lo aggiorna alle mezzanotti successive
+    today = current_day(&next_midnight);
+    if (pthread_create(&tid, NULL, day_thread, NULL) != 0) {
+        perror("pthread_create() error");
+        exit(1);
+    }
+    pthread_detach(tid);
+
+    if (cache_size > 0) {
+        cache_init();
+        report_marks_init();
+    }
+    for (i = 0; i < FLIGHT_SHARDS; i++) pthread_mutex_init(&flight_shards[i].lock, NULL);
+
+    //Il filtro di ogni shard viene riempito dal primario: fino ad allora le tessere dello shard vengono cercate sul ServerVaccinale
+    if (filter_size > 0) filter_init();
+    for (i = 0; filter_size > 0 && i < shard_map.n_shards; i++) {
+        if (pthread_create(&tid, NULL, filter_thread, (void *)(long)i) != 0) {
+            perror("pthread_create() error");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
+    //Le metriche sono esposte solo sulla macchina locale
+    metrics_init(&metrics, req_names, N_REQ);
+    if (admin_port > 0) metrics_listen(&metrics, admin_port);
+    if (stats_interval > 0) {
+        if (pthread_create(&tid, NULL, stats_thread, NULL) != 0) {
+            perror("pthread_create() error");
             exit(1);
         }
+        pthread_detach(tid);
+    }
 
-        if (pid == 0) {
-            close(listen_fd);
+    //Con max_batch uguale a 1 le verifiche vengono inviate singolarmente, senza batcher
+    for (i = 0; max_batch > 1 && i < shard_map.n_shards; i++) {
+        pthread_mutex_init(&lookup_queues[i].lock, NULL);
+        pthread_cond_init(&lookup_queues[i].cond, NULL);
+        lookup_queues[i].shard = i;
+        if (pthread_create(&tid, NULL, batcher_thread, &lookup_queues[i]) != 0) {
+            perror("pthread_create() error");
+            exit(1);
+        }
+        pthread_detach(tid);
+    }
 
-            /*
-                Il ServerVerifica riceve un bit come primo messaggio, che può essere 0 o 1, siccome abbiamo due connessioni differenti.
-                Quando riceve 1 il figlio gestirà la connessione con l'ASL.
-                Quando riceve 0 il figlio gestirà la connessione con l'AppVerifica.
-            */
-            if (full_read(connect_fd, &start_bit, sizeof(char)) < 0) {
-                perror("full_read() error");
+    /* Con i cicli di eventi le connessioni delle AppVerifica vengono gestite senza un thread per connessione: ogni ciclo ha il proprio
+       socket in ascolto ed un solo thread, le altre connessioni (ASL) passano comunque ad un thread */
+    if (io_mode != IO_THREAD) {
+        if ((loop_list = calloc(n_loops, sizeof(LOOP))) == NULL) {
+            perror("calloc() error");
+            exit(1);
+        }
+        for (i = 0; i < n_loops; i++) {
+            loop_list[i].id = i;
+            loop_list[i].mode = io_mode;
+            loop_list[i].listen_fd = listen_socket();
+            if ((loop_list[i].arena = malloc(LOOP_ARENA)) == NULL) {
+                perror("malloc() error");
                 exit(1);
             }
-            if (start_bit == '1') receive_report(connect_fd);   //Riceve informazioni dall'ASL
-            else if (start_bit == '0') receive_ID(connect_fd);  //Riceve informazioni dall'AppVerifica
-            else printf("Client non riconosciuto\n");
+            pool_init(&loop_list[i].pool, loop_list[i].arena, LOOP_ARENA);
+        }
+        __atomic_store_n(&loops, loop_list, __ATOMIC_RELEASE); //Il thread delle statistiche legge i cicli solo dopo l'inizializzazione
+        printf("In attesa di Green Pass\n");
+        for (i = 1; i < n_loops; i++) {
+            if (pthread_create(&tid, NULL, loop_thread, &loops[i]) != 0) {
+                perror("pthread_create() error");
+                exit(1);
+            }
+            pthread_detach(tid);
+        }
+        loop_thread(&loops[0]);
+    }
+
+    listen_fd = listen_socket();
+    for (;;) {
+    printf("In attesa di Green Pass\n");
+
+
+        //Accetta una nuova connessione
+        if ((connect_fd = accept(listen_fd, (struct sockaddr *)NULL, NULL)) < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            //Descrittori o memoria esauriti: il server resta attivo e riprova dopo un'attesa
+            perror("accept() error");
+            usleep(ACCEPT_RETRY_MS * 1000);
+            continue;
+        }
 
-            close(connect_fd);
-            exit(0);
-        } else close(connect_fd);
+        //Creazione del thread che gestisce il client
+        client_spawn(connect_fd);
     }
     exit(0);
 }